@@ -1,9 +1,12 @@
 #include "Calibration.h"
 #include "Estimation.h"
 #include "Image.h"
+#include "Geometry.h"
 #include <iostream>
 #include <algorithm>
 #include <iterator>
+#include <fstream>
+#include <sstream>
 
 using namespace cv;
 using namespace std;
@@ -14,6 +17,23 @@ using namespace Eigen;
 
 #define MIN_HOMOGRAPHY_ERROR 10.f
 
+// How far from the middle of a square, in squares, a quad can land and still be numbered as that square's checker
+#define LATTICE_TOLERANCE 0.3f
+
+// Detection fails unless it finds at least this fraction of the board's checkers
+#define MIN_CHECKER_FRACTION 0.9f
+
+// A quad is thrown away if the short side of its bounding rectangle is less than this fraction of
+// the long side, or if it is more than this many times bigger or smaller than the median quad
+#define MIN_QUAD_ASPECT 0.2f
+#define MAX_QUAD_SIZE_RATIO 3.f
+
+// Threshold against the local mean rather than the global mean. This copes with uneven lighting.
+// The window is this fraction of the image width, and pixels this percent darker than the local mean are black
+#define ADAPTIVE_THRESHOLD
+#define ADAPTIVE_THRESHOLD_WINDOW_FRACTION 8
+#define ADAPTIVE_THRESHOLD_PERCENT 15
+
 //#define DEBUG
 //#define DEBUG_CORNERS
 //#define DEBUG_THRESHOLD
@@ -47,14 +67,15 @@ float L2norm(Point2f a)
 	return (float)sqrt(a.x*a.x + a.y*a.y);
 }
 // Actual Function
-bool CheckerDetection(const Mat& checkerboard, vector<Quad>& quads, bool debug)
+bool CheckerDetection(const Mat& checkerboard, const BoardDescriptor& board, vector<Quad>& quads, bool debug, mt19937& rng)
 {
-	// Copy the image
-	Mat img = checkerboard.clone();
-
-	// Threshold the image
-	Mat temp = img.clone();
-	if (!AverageThreshold(temp, img))
+	// Threshold the image. Everything after this works on runs of black, not pixels
+	RunLengthImage binary;
+#ifdef ADAPTIVE_THRESHOLD
+	if (!AdaptiveThresholdRunLength(checkerboard, binary, checkerboard.cols / ADAPTIVE_THRESHOLD_WINDOW_FRACTION, ADAPTIVE_THRESHOLD_PERCENT))
+#else
+	if (!AverageThresholdRunLength(checkerboard, binary))
+#endif
 	{
 		return false;
 	}
@@ -73,39 +94,67 @@ bool CheckerDetection(const Mat& checkerboard, vector<Quad>& quads, bool debug)
 	
 	// Find contours in the thresholded image
 	vector<Contour> contours;
-	if (!FindContours(img, contours))
+	if (!FindContours(binary, contours))
 	{
 		return false;
 	}
 
 	// From each contour derive quads or throw contour away
-	int quadID = 0;
 	vector<Quad> quadsThisIteration;
 	for (auto& c : contours)
 	{
 		Quad q;
-		if (FindQuad(img, c, q))
+		if (FindQuad(checkerboard, c, q, rng))
 		{
-			q.id = quadID++;
 			// Fill with dummy IDs
 			q.associatedCorners[0] = pair<int, int>(-1, -1);
 			q.associatedCorners[1] = pair<int, int>(-1, -1);
 			q.associatedCorners[2] = pair<int, int>(-1, -1);
 			q.associatedCorners[3] = pair<int, int>(-1, -1);
 			q.numLinkedCorners = 0;
-			q.size = 0;
 			q.number = 0;
-			for (int idx = 0; idx < 4; ++idx)
-			{
-				q.size += DistBetweenPoints(q.centre, q.points[idx])/4;
-			}
 
 			quadsThisIteration.push_back(q);
 		}
 	}
 
+	// Bring all the corners, and so the centres, to sub-pixel accuracy
+	RefineQuadCorners(checkerboard, quadsThisIteration);
+
+	// Size up each quad by the smallest rectangle around it. A checker is a square, so even at
+	// a steep angle it isn't much longer than it is wide, and the checkers on a board are all
+	// about the same size. A quad that is very thin, or far bigger or smaller than the median, is
+	// two blobs run together, a corner gone wrong, or something that isn't a checker at all
+	vector<float> aspects;
+	vector<float> sizes;
 	for (Quad& q : quadsThisIteration)
 	{
+		const RotatedRect box = GetBoundingRect(q);
+		const float longSide = max(box.size.width, box.size.height);
+		const float shortSide = min(box.size.width, box.size.height);
+		aspects.push_back(longSide > 0 ? shortSide / longSide : 0);
+		// Centre to corner
+		q.size = 0.5f * sqrt(longSide * longSide + shortSide * shortSide);
+		sizes.push_back(q.size);
+	}
+	float medianSize = 0;
+	if (!sizes.empty())
+	{
+		vector<float> sorted = sizes;
+		nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+		medianSize = sorted[sorted.size() / 2];
+	}
+
+	int quadID = 0;
+	for (int i = 0; i < quadsThisIteration.size(); ++i)
+	{
+		if (aspects[i] < MIN_QUAD_ASPECT ||
+			sizes[i] > MAX_QUAD_SIZE_RATIO * medianSize || sizes[i] * MAX_QUAD_SIZE_RATIO < medianSize)
+		{
+			continue;
+		}
+		Quad& q = quadsThisIteration[i];
+		q.id = quadID++;
 		quads.push_back(q);
 	}
 
@@ -113,6 +162,27 @@ bool CheckerDetection(const Mat& checkerboard, vector<Quad>& quads, bool debug)
 	// For each pair of quads, find any corners they share
 	// Note these links in an array, where the index of the quad's own corner
 	// holds a pair of the ID of the other quad, plus the corner index it links to
+	// So that this doesn't compare every quad to every other, all the corners go in a grid
+	// with cells about the size of a checker. Corner k is corner k%4 of quad k/4
+	vector<Point2f> allCorners;
+	vector<float> diagonals;
+	allCorners.reserve(4 * quads.size());
+	diagonals.reserve(quads.size());
+	for (const Quad& q : quads)
+	{
+		allCorners.insert(allCorners.end(), q.points, q.points + 4);
+		diagonals.push_back(GetLongestDiagonal(q));
+	}
+	float cellSize = 1.f;
+	if (!diagonals.empty())
+	{
+		nth_element(diagonals.begin(), diagonals.begin() + diagonals.size() / 2, diagonals.end());
+		cellSize = diagonals[diagonals.size() / 2];
+	}
+	PointGrid cornerGrid;
+	BuildPointGrid(allCorners, cellSize, cornerGrid);
+
+	vector<int> nearbyCorners;
 	for (int i = 0; i < quads.size(); ++i)
 	{
 		Quad& q1 = quads[i];
@@ -123,51 +193,56 @@ bool CheckerDetection(const Mat& checkerboard, vector<Quad>& quads, bool debug)
 			continue;
 		}
 
-		// Find all quads within a certain radius
-		vector<pair<int, Quad>> closestQuads;
 		const float diag1 = GetLongestDiagonal(q1);
-		for (int j = i + 1; j < quads.size(); ++j)
-		{
-			Quad& q2 = quads[j];
-
-			if (q2.numLinkedCorners == 4)
-			{
-				continue;
-			}
-
-			// Sanity check - if their centres are further away than twice the longest diagonal of the first quad, 
-			// ignore this quad
-			if (DistBetweenPoints(q1.centre, q2.centre) < 2 * diag1)
-			{
-				closestQuads.push_back(pair<int, Quad>(j, q2));
-			}	
-		}
 
 		// For each corner of q1, find the closest point amongst the closest quads
 		for (int c = 0; c < 4; ++c)
 		{
-			Point corner = q1.points[c];
+			Point2f corner = q1.points[c];
 			float minDistToPoint = 2*diag1; // upper bound
 
-			int closestQuadIndex = 0;
+			// Corners move a little as they get linked, so the grid only narrows down the
+			// candidates. Their distances are measured where they are now
+			int closestQuadIndex = -1;
 			int closestPointIndex = 0;
-			for (int k = 0; k < closestQuads.size(); ++k)
+			FindPointsWithinRadius(cornerGrid, q1.points[c], 2 * diag1, nearbyCorners);
+			for (const int k : nearbyCorners)
 			{
-				Quad q2 = closestQuads[k].second;
-				for (int c2 = 0; c2 < 4; ++c2)
+				const int j = k / 4;
+				const int c2 = k % 4;
+				if (j <= i)
 				{
-					float d = DistBetweenPoints(q2.points[c2], corner);
-					if (d < minDistToPoint)
-					{
-						minDistToPoint = d;
-						closestPointIndex = c2;
-						closestQuadIndex = closestQuads[k].first;
-					}
+					continue;
+				}
+				const Quad& candidate = quads[j];
+				if (candidate.numLinkedCorners == 4)
+				{
+					continue;
+				}
+
+				// Sanity check - if their centres are further away than twice the longest diagonal of the first quad, 
+				// ignore this quad
+				if (DistBetweenPoints(q1.centre, candidate.centre) >= 2 * diag1)
+				{
+					continue;
+				}
+
+				float d = L2norm(candidate.points[c2] - corner);
+				if (d < minDistToPoint)
+				{
+					minDistToPoint = d;
+					closestPointIndex = c2;
+					closestQuadIndex = j;
 				}
 			}
+			if (closestQuadIndex < 0)
+			{
+				// Nothing nearby to link to
+				continue;
+			}
 
 			Quad& q2 = quads[closestQuadIndex];
-			Point corner2 = q2.points[closestPointIndex];
+			Point2f corner2 = q2.points[closestPointIndex];
 
 			if (debug)
 			{
@@ -226,13 +301,13 @@ bool CheckerDetection(const Mat& checkerboard, vector<Quad>& quads, bool debug)
 				}
 			}
 
-			if (DistBetweenPoints(corner, corner2) > 0.7*diag1)
+			if (L2norm(corner - corner2) > 0.7*diag1)
 			{
 				continue;
 			}
 
 			// Things worked! Mark this
-			Point cornerFinal((corner.x + corner2.x) / 2, (corner.y + corner2.y) / 2);
+			Point2f cornerFinal((corner.x + corner2.x) / 2, (corner.y + corner2.y) / 2);
 			q1.points[c] = cornerFinal;
 			q2.points[closestPointIndex] = cornerFinal;
 			q1.associatedCorners[c] = pair<int, int>(q2.id, closestPointIndex);
@@ -261,9 +336,8 @@ bool CheckerDetection(const Mat& checkerboard, vector<Quad>& quads, bool debug)
 		}
 	}
 
-	// Make sure at least 90% of the desired number of quads have been found
-	// I've upped this to 100% just because this should be guaranteed on the images we have
-	if (quads.size() < 32)
+	// Make sure most of the board's checkers have been found
+	if (quads.size() < MIN_CHECKER_FRACTION * NumCheckers(board))
 	{
 		return false;
 	}
@@ -280,11 +354,11 @@ bool CheckerDetection(const Mat& checkerboard, vector<Quad>& quads, bool debug)
 	test the reprojection error. Keep the homography with the smallest reprojection error. Since the corners
 	will always be perfect, the reprojection error includes the four checkers attached to the corner checkers
 	too. 
+	Once the best of these has numbered every checker, H is fitted again to all of them, and refined by LM
 */
 // Helper
-float GetReprojectionError(const Mat& img, const Mat& checkerboard,const vector<Quad>& gtQuads, const vector<Quad>& quads,
-	                       const Quad gtCorners[], const Point2f gtSize,
-	                       const Point2f size, const vector<Quad> corners, 
+float GetReprojectionError(const Mat& img, const vector<Quad>& gtQuads, const vector<Quad>& quads,
+	                       const Quad gtCorners[], const Point2f size, const vector<Quad> corners, 
 	                       vector<int> indices, const Matrix3f& H)
 {
 
@@ -346,46 +420,17 @@ float GetReprojectionError(const Mat& img, const Mat& checkerboard,const vector<
 	return e;
 }
 // Actual Function
-bool GetHomographyAndMatchQuads(Matrix3f& H, const Mat& img, const cv::Mat& checkerboard, vector<Quad>& gtQuads, vector<Quad>& quads)
+bool GetHomographyAndMatchQuads(Matrix3f& H, const Mat& img, const BoardDescriptor& board,
+	                            const vector<Quad>& gtQuads, vector<Quad>& quads)
 {
-	vector<pair<Point, Point>> matches;
-
-	// Find the four corners of the gt quads and mark them
-	// The topmost leftmost is 1, rightmost is 5, bottom left 28, bottom right 32
-	Quad topleft = gtQuads[0];
-	Quad topright = gtQuads[0];
-	Quad bottomleft = gtQuads[0];
-	Quad bottomright = gtQuads[0];
-	for (Quad q : gtQuads)
+	// Find the four corners of the gt quads
+	int gtCornerIndices[4];
+	if (!FindCornerQuads(gtQuads, gtCornerIndices))
 	{
-		// topleft
-		if ((float)q.centre.x < topleft.centre.x*0.9f || (float)q.centre.y < topleft.centre.y*0.9f)
-		{
-			topleft = q;
-		}
-		// topright
-		if ((float)q.centre.x > topright.centre.x*1.1f || (float)q.centre.y < topright.centre.y*0.9f)
-		{
-			topright = q;
-		}
-		// bottom left
-		if ((float)q.centre.x < bottomleft.centre.x*0.9f || (float)q.centre.y > bottomleft.centre.y*1.1f)
-		{
-			bottomleft = q;
-		}
-		// bottom right
-		if ((float)q.centre.x > bottomright.centre.x*1.1f || (float)q.centre.y > bottomright.centre.y*1.1f)
-		{
-			bottomright = q;
-		}
+		return false;
 	}
-	Quad gtCorners[4] = {topleft, topright, bottomright, bottomleft};
-
-	// reiterate, just in case it was overwritten
-	topleft.number = 1;
-	topright.number = 5;
-	bottomleft.number = 28;
-	bottomright.number = 32;
+	Quad gtCorners[4] = { gtQuads[gtCornerIndices[0]], gtQuads[gtCornerIndices[1]],
+		                  gtQuads[gtCornerIndices[2]], gtQuads[gtCornerIndices[3]] };
 
 	// Find the corners of the detected quads
 	// Find a corner on the left side of the image
@@ -418,19 +463,15 @@ bool GetHomographyAndMatchQuads(Matrix3f& H, const Mat& img, const cv::Mat& chec
 
 		// Iterate over all permutations
 		float minError = 100000000;
-		int perm[] = { 0,1,2,3 };
 		Matrix3f homography;
 		for (int i = 0; i < 4; ++i)
 		{
-			vector<pair<Point2f, Point2f>> matches;
-			matches.push_back(pair<Point2f, Point2f>(corners[i].centre, gtCorners[0].centre));
-			matches.push_back(pair<Point2f, Point2f>(corners[(i+1)%4].centre, gtCorners[1].centre));
-			matches.push_back(pair<Point2f, Point2f>(corners[(i+2)%4].centre, gtCorners[2].centre));
-			matches.push_back(pair<Point2f, Point2f>(corners[(i+3)%4].centre, gtCorners[3].centre));
+			const Point2f from[4] = { corners[i].centre, corners[(i+1)%4].centre, corners[(i+2)%4].centre, corners[(i+3)%4].centre };
+			const Point2f to[4] = { gtCorners[0].centre, gtCorners[1].centre, gtCorners[2].centre, gtCorners[3].centre };
 
 			Matrix3f h;
-			// Use SVD to get the homography from these pairs
-			if (!GetHomographyFromMatches(matches, h))
+			// Get the homography from these pairs
+			if (!GetHomographyFromFourMatches(from, to, h))
 			{
 				// This permutation wasn't good enough
 				cout << "No homography from this matching" << endl;
@@ -439,15 +480,11 @@ bool GetHomographyAndMatchQuads(Matrix3f& H, const Mat& img, const cv::Mat& chec
 
 			// How mcuh error did this iteration get?
 			vector<int> indices = { i,(i + 1) % 4,(i + 2) % 4,(i + 3) % 4 };
-			float e = GetReprojectionError(img, checkerboard, gtQuads, quads, gtCorners, Point2f(checkerboard.cols, checkerboard.rows), Point2f(img.cols, img.rows), corners, indices, h);
+			float e = GetReprojectionError(img, gtQuads, quads, gtCorners, Point2f(img.cols, img.rows), corners, indices, h);
 			cout << "Error this homography: " << e << endl;
 			if (e < minError)
 			{
 				minError = e;
-				perm[0] = indices[0];
-				perm[1] = indices[1];
-				perm[2] = indices[2];
-				perm[3] = indices[3];
 				homography = h;
 			}
 		}
@@ -463,27 +500,6 @@ bool GetHomographyAndMatchQuads(Matrix3f& H, const Mat& img, const cv::Mat& chec
 		cout << "The minimum error was " << minError << endl;
 #endif
 		H = homography;
-
-		// Number the corner quads using this homography
-		for (Quad& q : quads)
-		{
-			if (q.id == corners[perm[0]].id)
-			{
-				q.number = 1;
-			}
-			if (q.id == corners[perm[1]].id)
-			{
-				q.number = 5;
-			}
-			if (q.id == corners[perm[2]].id)
-			{
-				q.number = 32;
-			}
-			if (q.id == corners[perm[3]].id)
-			{
-				q.number = 28;
-			}
-		}
 	}
 	else
 	{
@@ -492,643 +508,523 @@ bool GetHomographyAndMatchQuads(Matrix3f& H, const Mat& img, const cv::Mat& chec
 		return false;
 	}
 
-	// Now number the rest of the quads
-	TransformAndNumberQuads(H, checkerboard, Point2f(img.cols, img.rows), quads);
+	// Now number all the quads from where they land on the board
+	if (!TransformAndNumberQuads(H, board, quads))
+	{
+		return false;
+	}
+
+	// The four corner checkers were enough to number the rest, but now that every checker has a
+	// number, fit H to all of them. This averages out the error in any one centre.
+	// The DLT minimises an algebraic error, so finish with a few LM steps on the actual distances
+	Correspondences matches;
+	for (const Quad& q : quads)
+	{
+		if (q.number > 0)
+		{
+			AddCorrespondence(matches, q.centre, gtQuads[q.number - 1].centre);
+		}
+	}
+	Matrix3f refined;
+	if (GetHomographyFromMatches(matches, refined))
+	{
+		BundleAdjustment(matches, refined);
+		H = refined;
+	}
 
 	return true;
 }
 
 /*
-	Transform and number quads
-
-	H is expected to transform the plane the quads are in to the ground truth plane
-	where is it a trivial matter to scan through and assign the correct number to each quad
-
-	We use a bound of half the transformed top left quad's diagonal as the measure for whether
-	or not another quad is in the same column or row
+	Board geometry
 
+	The board is rows x cols squares, and the checkers are the black squares, numbered
+	1, 2, 3 ... along each row from the top. The corner squares are black, so a row that
+	starts on a black square has (cols + 1)/2 checkers and the rows in between have one fewer.
+	For the 9 x 7 board that gives rows of 5 and 4, for 32 checkers in all.
 */
-void TransformAndNumberQuads(const Eigen::Matrix3f& H, const Mat& checkerboard, const Point2f size, std::vector<Quad>& quads)
+int NumCheckers(const BoardDescriptor& board)
 {
-	int currentQuadIndex = 1;
-
-	// First, transform all quads
-	for (Quad& q : quads)
+	return (board.rows * board.cols + 1) / 2;
+}
+int CheckerNumber(const BoardDescriptor& board, const int row, const int col)
+{
+	if (row < 0 || row >= board.rows || col < 0 || col >= board.cols || (row + col) % 2 != 0)
 	{
-		Vector3f x(q.centre.x, q.centre.y, 1);
-		Vector3f Hx = H * x;
-		Hx /= Hx(2);
-		q.centre = Point2f(Hx(0), Hx(1));
-
-		// Convert all corners too
-		for (int i = 0; i < 4; ++i)
-		{
-			Vector3f p(q.points[i].x, q.points[i].y, 1);
-			Vector3f Hp = H * p;
-			Hp /= Hp(2);
-			q.points[i] = Point2f(Hp(0), Hp(1));
-		}
+		return 0;
 	}
+	// Squares before this one, halved, count the black squares before it since the board starts black
+	return (row * board.cols + col) / 2 + 1;
+}
 
-	// Do each row separately, hardcoded
-	// Horrible, but hey it works. 
+/*
+	Find the four corner checkers of a board in a set of quads.
+	These are the quads furthest out along each diagonal direction, so this assumes the
+	board isn't rotated by anything close to 45 degrees from how it is laid out in the image.
+	Indices come out in the order top left, top right, bottom right, bottom left
+*/
+bool FindCornerQuads(const vector<Quad>& quads, int corners[4])
+{
+	if (quads.empty())
+	{
+		return false;
+	}
 
-	// Find quads #1 and #5:
-	int indexQ1 = -1;
-	int indexQ5 = -1;
+	corners[0] = corners[1] = corners[2] = corners[3] = 0;
 	for (int i = 0; i < quads.size(); ++i)
 	{
-		if (quads[i].number == 1)
+		const Point2f& c = quads[i].centre;
+		if (c.x + c.y < quads[corners[0]].centre.x + quads[corners[0]].centre.y)
 		{
-			indexQ1 = i;
+			corners[0] = i;
 		}
-		if (quads[i].number == 5)
+		if (c.x - c.y > quads[corners[1]].centre.x - quads[corners[1]].centre.y)
 		{
-			indexQ5 = i;
+			corners[1] = i;
 		}
-	}
-	if (indexQ1 == -1 || indexQ5 == -1)
-	{
-		// we failed? Return. SHould have an error code. At least false?
-		cout << "Couldn't find quads 1 and 5" << endl;
-		return;
-	}
-	
-	Quad& q1 = quads[indexQ1];
-	Quad& q5 = quads[indexQ5];
-	// Draw a line between the two
-	LineSegment l;
-	l.p1 = q1.centre;
-	l.p2 = q5.centre;
-
-	// Find the three other quads whose centres lie within half a diagonal's length of the line
-	float bound = GetLongestDiagonal(q1)/2;
-	vector<Quad*> quadsInRow;
-	for (int i = 0; i < quads.size(); ++i)
-	{
-		float d = abs(PointDistToLineSigned(quads[i].centre, q1.centre, q5.centre));
-		if (d < bound)
+		if (c.x + c.y > quads[corners[2]].centre.x + quads[corners[2]].centre.y)
 		{
-			quadsInRow.push_back(&quads[i]);
+			corners[2] = i;
+		}
+		if (c.y - c.x > quads[corners[3]].centre.y - quads[corners[3]].centre.x)
+		{
+			corners[3] = i;
 		}
 	}
+	return true;
+}
 
-	// Order all these quads by x coord
-	sort(quadsInRow.begin(), quadsInRow.end(), CompareQuadByCentreX);
+/*
+	Read a board descriptor from a text file.
+	Each line is a keyword followed by its values, and # starts a comment:
 
-	// Number
-	for (int i = 0; i < quadsInRow.size(); ++i)
+	rows 7                  squares down the board
+	cols 9                  squares across the board
+	origin 47 44.5          centre of the top left checker, on the ground truth plane
+	pitch 46.875 46.083     distance between neighbouring squares, across and down
+	checker 47 43.5         width and height of a checker. Defaults to the pitch
+
+	Any units will do for the ground truth plane. They are the units the poses come out in
+*/
+bool ReadBoardDescriptor(const std::string& filename, BoardDescriptor& board)
+{
+	ifstream file(filename);
+	if (!file.is_open())
 	{
-		quadsInRow[i]->number = currentQuadIndex;
-		currentQuadIndex++;
+		cout << "Could not open board descriptor " << filename << endl;
+		return false;
 	}
-	q5.number = 5;
-	currentQuadIndex = 6;
 
-	// Number the two attached to q1 and q5
-	int indexQ6 = -1;
-	int indexQ9 = -1;
-	for (int n = 0; n < quads.size(); ++n)
+	board.rows = 0;
+	board.cols = 0;
+	board.origin = Point2f(0, 0);
+	board.colStep = Point2f(0, 0);
+	board.rowStep = Point2f(0, 0);
+	board.checkerSize = Size2f(0, 0);
+	bool hasPitch = false;
+
+	string line;
+	int lineNumber = 0;
+	while (getline(file, line))
 	{
-		for (int i = 0; i < 4; ++i)
+		lineNumber++;
+		const size_t comment = line.find('#');
+		if (comment != string::npos)
 		{
-			if (q1.associatedCorners[i].first != -1)
-			{
-				if (q1.associatedCorners[i].first == quads[n].id)
-					indexQ6 = n;
-			}
-			if (q5.associatedCorners[i].first != -1)
-			{
-				if (q5.associatedCorners[i].first == quads[n].id)
-					indexQ9 = n;
-			}
+			line.erase(comment);
 		}
-	}
 
-	// Precautionary
-	if (indexQ6 == -1 || indexQ9 == -1)
-	{
-		cout << "Couldn't find quads 6 and 9" << endl;
-		return;
-	}
+		stringstream values(line);
+		string keyword;
+		if (!(values >> keyword))
+		{
+			// Blank line
+			continue;
+		}
 
-	// Next row
-	Quad& q6 = quads[indexQ6];
-	Quad& q9 = quads[indexQ9];
-	// Draw a line between the two
-	l.p1 = q6.centre;
-	l.p2 = q9.centre;
+		bool ok = true;
+		if (keyword == "rows")
+		{
+			ok = (bool)(values >> board.rows);
+		}
+		else if (keyword == "cols")
+		{
+			ok = (bool)(values >> board.cols);
+		}
+		else if (keyword == "origin")
+		{
+			ok = (bool)(values >> board.origin.x >> board.origin.y);
+		}
+		else if (keyword == "pitch")
+		{
+			float across = 0, down = 0;
+			ok = (bool)(values >> across >> down);
+			board.colStep = Point2f(across, 0);
+			board.rowStep = Point2f(0, down);
+			hasPitch = true;
+		}
+		else if (keyword == "checker")
+		{
+			ok = (bool)(values >> board.checkerSize.width >> board.checkerSize.height);
+		}
+		else
+		{
+			cout << "Unknown keyword " << keyword << " on line " << lineNumber << " of " << filename << endl;
+			return false;
+		}
 
-	bound = GetLongestDiagonal(q6) / 2;
-	quadsInRow.clear();
-	for (Quad& q : quads)
-	{
-		float d = abs(PointDistToLineSigned(q.centre, q6.centre, q9.centre));
-		if (d < bound)
+		if (!ok)
 		{
-			quadsInRow.push_back(&q);
+			cout << "Bad values for " << keyword << " on line " << lineNumber << " of " << filename << endl;
+			return false;
 		}
 	}
-	sort(quadsInRow.begin(), quadsInRow.end(), CompareQuadByCentreX);
 
-	// Number
-	for (int i = 0; i < quadsInRow.size(); ++i)
+	if (board.rows < 3 || board.cols < 3 || board.rows % 2 == 0 || board.cols % 2 == 0)
 	{
-		quadsInRow[i]->number = currentQuadIndex;
-		currentQuadIndex++;
+		// Needs a black square in each corner for the corner checkers to exist
+		cout << "Board must be at least 3 x 3 squares, and odd in both directions" << endl;
+		return false;
 	}
-	q9.number = 9;
-	currentQuadIndex = 10;
-
-	// Number the two attached to q1 and q5
-	int indexQ10 = -1;
-	int indexQ14 = -1;
-	for (int n = 0; n < quads.size(); ++n)
+	if (!hasPitch || board.colStep.x <= 0 || board.rowStep.y <= 0)
 	{
-		for (int i = 0; i < 4; ++i)
-		{
-			if (q6.associatedCorners[i].first != -1)
-			{
-				if (q6.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q6.centre.y && quads[n].centre.x < q6.centre.x)
-					{
-						quads[n].number = 10;
-						indexQ10 = n;
-					}
-				}
-			}
-			if (q9.associatedCorners[i].first != -1)
-			{
-				if (q9.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q9.centre.y  && quads[n].centre.x > q6.centre.x)
-					{
-						quads[n].number = 14;
-						indexQ14 = n;
-					}
-				}
-			}
-		}
+		cout << "Board needs a positive pitch" << endl;
+		return false;
 	}
-	if (indexQ10 == -1 || indexQ14 == -1)
+	if (board.checkerSize.width <= 0 || board.checkerSize.height <= 0)
 	{
-		cout << "Couldn't find quads 10 and 14" << endl;
-		// we failed? Return. SHould have an error code. At least false?
- 		return;
+		board.checkerSize = Size2f(board.colStep.x, board.rowStep.y);
 	}
 
-	// Next row
-	Quad& q10 = quads[indexQ10];
-	Quad& q14 = quads[indexQ14];
-	// Draw a line between the two
-	l.p1 = q10.centre;
-	l.p2 = q14.centre;
+	return true;
+}
 
-	bound = GetLongestDiagonal(q10) / 2;
-	quadsInRow.clear();
-	for (Quad& q : quads)
-	{
-		float d = abs(PointDistToLineSigned(q.centre, q10.centre, q14.centre));
-		if (d < bound)
-		{
-			quadsInRow.push_back(&q);
-		}
-	}
-	sort(quadsInRow.begin(), quadsInRow.end(), CompareQuadByCentreX);
+/*
+	Generate the ground truth checkers straight from the board descriptor.
+	Quad i is checker number i + 1, and has id i. Its corners go clockwise from the top left.
+	Checkers that meet diagonally have those corners linked, just as CheckerDetection
+	would link them, so the corner checkers have one link each
+*/
+void GenerateBoardQuads(const BoardDescriptor& board, std::vector<Quad>& quads)
+{
+	quads.clear();
+	quads.reserve(NumCheckers(board));
 
-	// Number
-	for (int i = 0; i < quadsInRow.size(); ++i)
-	{
-		quadsInRow[i]->number = currentQuadIndex;
-		currentQuadIndex++;
-	}
-	q14.number = 14;
-	currentQuadIndex = 15;
+	const Point2f halfAcross = Point2f(board.checkerSize.width / 2, 0);
+	const Point2f halfDown = Point2f(0, board.checkerSize.height / 2);
+	// Corners clockwise from the top left, and the square that meets each one diagonally
+	const int cornerRowOffset[4] = { -1, -1, 1, 1 };
+	const int cornerColOffset[4] = { -1, 1, 1, -1 };
 
-	// Number the two attached to q1 and q5
-	int indexQ15 = -1;
-	int indexQ18 = -1;
-	for (int n = 0; n < quads.size(); ++n)
+	for (int row = 0; row < board.rows; ++row)
 	{
-		for (int i = 0; i < 4; ++i)
+		for (int col = 0; col < board.cols; ++col)
 		{
-			if (q10.associatedCorners[i].first != -1)
+			const int number = CheckerNumber(board, row, col);
+			if (number == 0)
 			{
-				if (q10.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q10.centre.y)
-					{
-						quads[n].number = 15;
-						indexQ15 = n;
-					}
-				}
+				continue;
+			}
+
+			Quad q;
+			q.id = number - 1;
+			q.number = number;
+			q.centre = board.origin + board.colStep * (float)col + board.rowStep * (float)row;
+			q.points[0] = q.centre - halfAcross - halfDown;
+			q.points[1] = q.centre + halfAcross - halfDown;
+			q.points[2] = q.centre + halfAcross + halfDown;
+			q.points[3] = q.centre - halfAcross + halfDown;
+			q.size = 0;
+			for (int idx = 0; idx < 4; ++idx)
+			{
+				q.size += L2norm(q.points[idx] - q.centre) / 4;
 			}
-			if (q14.associatedCorners[i].first != -1)
+			q.angleToCentre = 0;
+
+			q.numLinkedCorners = 0;
+			for (int c = 0; c < 4; ++c)
 			{
-				if (q14.associatedCorners[i].first == quads[n].id)
+				const int other = CheckerNumber(board, row + cornerRowOffset[c], col + cornerColOffset[c]);
+				if (other == 0)
 				{
-					if (quads[n].centre.y > q14.centre.y)
-					{
-						quads[n].number = 18;
-						indexQ18 = n;
-					}
+					q.associatedCorners[c] = pair<int, int>(-1, -1);
+					continue;
 				}
+				// The other checker touches this one with its opposite corner
+				q.associatedCorners[c] = pair<int, int>(other - 1, (c + 2) % 4);
+				q.numLinkedCorners++;
 			}
+
+			quads.push_back(q);
 		}
 	}
+}
+
+/*
+	Transform and number quads
+
+	H is expected to transform the plane the quads are in to the ground truth plane, where
+	the board lattice is. We move each quad's centre onto that plane, then solve for where it
+	sits in the lattice, in squares across and down. Rounding that gives the square, and so
+	the checker number. This is one pass over the quads, whatever the size of the board.
+
+	A quad that lands too far from the middle of a square, or on a white one, or off the board,
+	is left unnumbered. If two quads land on the same square, the closer one gets it.
+	The quads themselves are not moved.
 
-	if (indexQ15 == -1 || indexQ18 == -1)
+	Returns false if the lattice is degenerate, or no quads could be numbered
+*/
+bool TransformAndNumberQuads(const Eigen::Matrix3f& H, const BoardDescriptor& board, std::vector<Quad>& quads)
+{
+	const float det = board.colStep.x * board.rowStep.y - board.colStep.y * board.rowStep.x;
+	if (abs(det) < 1e-6f)
 	{
-		// we failed? Return. SHould have an error code. At least false?
-		cout << "Couldn't find quads 15 and 18" << endl;
-		return;
+		cout << "Board lattice is degenerate" << endl;
+		return false;
 	}
 
-	// Next row
-	Quad& q15 = quads[indexQ15];
-	Quad& q18 = quads[indexQ18];
-	// Draw a line between the two
-	l.p1 = q15.centre;
-	l.p2 = q18.centre;
-
-	bound = GetLongestDiagonal(q15) / 2;
-	quadsInRow.clear();
-	for (Quad& q : quads)
+	// Which quad has each square so far, and how far it was from the middle of the square
+	vector<int> owner(board.rows * board.cols, -1);
+	vector<float> offset(board.rows * board.cols, 0);
+	for (int i = 0; i < quads.size(); ++i)
 	{
-		float d = abs(PointDistToLineSigned(q.centre, q15.centre, q18.centre));
-		if (d < bound)
+		Quad& q = quads[i];
+		q.number = 0;
+
+		Vector3f x(q.centre.x, q.centre.y, 1);
+		Vector3f Hx = H * x;
+		if (Hx(2) == 0)
 		{
-			quadsInRow.push_back(&q);
+			continue;
 		}
-	}
-	sort(quadsInRow.begin(), quadsInRow.end(), CompareQuadByCentreX);
+		Hx /= Hx(2);
 
-	// Number
-	for (int i = 0; i < quadsInRow.size(); ++i)
-	{
-		quadsInRow[i]->number = currentQuadIndex;
-		currentQuadIndex++;
-	}
-	q18.number = 18;
-	currentQuadIndex = 19;
+		// Solve d = col * colStep + row * rowStep
+		const Point2f d(Hx(0) - board.origin.x, Hx(1) - board.origin.y);
+		const float col = (d.x * board.rowStep.y - d.y * board.rowStep.x) / det;
+		const float row = (board.colStep.x * d.y - board.colStep.y * d.x) / det;
+		const int nearestCol = (int)floor(col + 0.5f);
+		const int nearestRow = (int)floor(row + 0.5f);
+		const float off = max(abs(col - nearestCol), abs(row - nearestRow));
+		if (off > LATTICE_TOLERANCE || CheckerNumber(board, nearestRow, nearestCol) == 0)
+		{
+			continue;
+		}
 
-	// Number the two attached to q1 and q5
-	int indexQ19 = -1;
-	int indexQ23 = -1;
-	for (int n = 0; n < quads.size(); ++n)
-	{
-		for (int i = 0; i < 4; ++i)
+		const int square = nearestRow * board.cols + nearestCol;
+		if (owner[square] == -1 || off < offset[square])
 		{
-			if (q15.associatedCorners[i].first != -1)
+			if (owner[square] != -1)
 			{
-				if (q15.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q15.centre.y && quads[n].centre.x < q15.centre.x)
-					{
-						quads[n].number = 19;
-						indexQ19 = n;
-					}
-				}
-			}
-			if (q18.associatedCorners[i].first != -1)
-			{
-				if (q18.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q18.centre.y && quads[n].centre.x > q18.centre.x)
-					{
-						quads[n].number = 23;
-						indexQ23 = n;
-					}
-				}
+				quads[owner[square]].number = 0;
 			}
+			owner[square] = i;
+			offset[square] = off;
+			q.number = CheckerNumber(board, nearestRow, nearestCol);
 		}
 	}
-	if (indexQ19 == -1 || indexQ23 == -1)
-	{
-		// we failed? Return. SHould have an error code. At least false?
-		cout << "Couldn't find quads 19 and 23" << endl;
-		return;
-	}
-
-	// Next row
-	Quad& q19 = quads[indexQ19];
-	Quad& q23 = quads[indexQ23];
-	// Draw a line between the two
-	l.p1 = q19.centre;
-	l.p2 = q23.centre;
 
-	bound = GetLongestDiagonal(q19) / 2;
-	quadsInRow.clear();
-	for (Quad& q : quads)
+	for (int square : owner)
 	{
-		float d = abs(PointDistToLineSigned(q.centre, q19.centre, q23.centre));
-		if (d < bound)
+		if (square != -1)
 		{
-			quadsInRow.push_back(&q);
+			return true;
 		}
 	}
-	sort(quadsInRow.begin(), quadsInRow.end(), CompareQuadByCentreX);
+	cout << "No quads landed on the board" << endl;
+	return false;
+}
 
-	// Number
-	for (int i = 0; i < quadsInRow.size(); ++i)
-	{
-		quadsInRow[i]->number = currentQuadIndex;
-		currentQuadIndex++;
-	}
-	q23.number = 23;
-	currentQuadIndex = 24;
+/*
+	Given a series of correspondences between images (in normalised coords),
+	compute a pinhole model calibration, if possible, and return it
+
+	This may seem a little arbitrary and magical, but Zhang computes constraints on the homographies
+	for the two checkerboard planes. Using these constraints, he creates a system of linear equations
+	in the terms of a matrix B = A.transpose() * A. We sovle this for B, then compute the values of A.
+
+	Each homography gives two rows of V, v_12 and v_11 - v_22, and b is the null vector of V, which
+	is the eigenvector of VtV with the smallest eigenvalue. VtV is always 6x6, so like the DLT we
+	never build V. Each homography's two rows are folded into VtV as it arrives, and at the end
+	there's one 6x6 symmetric eigen-solve. This is constant memory, allocates nothing, and can be
+	solved again after every new image for an up to date K.
+
+	In pixels, the third row of H is thousands of times smaller than the first two, and VtV would
+	square that twice over. So each H is taken into coordinates where the image runs from about -1
+	to 1, H' = N * H, and scaled to unit size so that every image counts the same. Then K = N^-1 * K'.
+	N comes from the first image's size, since every image has to share it.
+
+	This can fail when VtV is rank deficient; that is, there aren't enough different views of the
+	board to pin down all five parameters, or when B comes out not positive definite, which is noise
+*/
+// Helpers
+// Zhang's v_ij, for columns i and j of H
+template <typename Scalar>
+Matrix<Scalar, 6, 1> ZhangRow(const Matrix<Scalar, 3, 3>& H, const int i, const int j)
+{
+	Matrix<Scalar, 6, 1> v;
+	v << H(0, i)*H(0, j),
+		 H(0, i)*H(1, j) + H(1, i)*H(0, j),
+		 H(1, i)*H(1, j),
+		 H(2, i)*H(0, j) + H(0, i)*H(2, j),
+		 H(2, i)*H(1, j) + H(1, i)*H(2, j),
+		 H(2, i)*H(2, j);
+	return v;
+}
+
+// Actual Functions
+template <typename Scalar>
+void ResetZhangAccumulator(ZhangAccumulator<Scalar>& zhang)
+{
+	zhang.VtV.setZero();
+	zhang.N.setIdentity();
+	zhang.numHomographies = 0;
+}
 
-	// Number the two attached to q1 and q5
-	int indexQ24 = -1;
-	int indexQ27 = -1;
-	for (int n = 0; n < quads.size(); ++n)
+template <typename Scalar>
+void AddHomographyToZhang(ZhangAccumulator<Scalar>& zhang, const Eigen::Matrix3f& H, const cv::Point2f& imageSize)
+{
+	if (zhang.numHomographies == 0 && imageSize.x > 0 && imageSize.y > 0)
 	{
-		for (int i = 0; i < 4; ++i)
-		{
-			if (q19.associatedCorners[i].first != -1)
-			{
-				if (q19.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q19.centre.y)
-					{
-						quads[n].number = 24;
-						indexQ24 = n;
-					}
-				}
-			}
-			if (q23.associatedCorners[i].first != -1)
-			{
-				if (q23.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q23.centre.y)
-					{
-						quads[n].number = 27;
-						indexQ27 = n;
-					}
-				}
-			}
-		}
+		const Scalar scale = 2 / ((Scalar)imageSize.x + imageSize.y);
+		zhang.N << scale, 0, -scale * imageSize.x / 2,
+			       0, scale, -scale * imageSize.y / 2,
+			       0, 0, 1;
 	}
-	if (indexQ24 == -1 || indexQ27 == -1)
+
+	Matrix<Scalar, 3, 3> Hn = zhang.N * H.cast<Scalar>();
+	const Scalar norm = Hn.norm();
+	if (norm == 0)
 	{
-		// we failed? Return. SHould have an error code. At least false?
-		cout << "Couldn't find quads 24 and 27" << endl;
 		return;
 	}
+	Hn /= norm;
+
+	// [  v_12 transpose         ] 
+	// [  (v_11 - v_22) transpose] b = 0
+	const Matrix<Scalar, 6, 1> v12 = ZhangRow(Hn, 0, 1);
+	const Matrix<Scalar, 6, 1> v11MinusV22 = ZhangRow(Hn, 0, 0) - ZhangRow(Hn, 1, 1);
+	zhang.VtV.noalias() += v12 * v12.transpose();
+	zhang.VtV.noalias() += v11MinusV22 * v11MinusV22.transpose();
+	zhang.numHomographies++;
+}
 
-	// Next row
-	Quad& q24 = quads[indexQ24];
-	Quad& q27 = quads[indexQ27];
-	// Draw a line between the two
-	l.p1 = q24.centre;
-	l.p2 = q27.centre;
-
-	bound = GetLongestDiagonal(q24) / 2;
-	quadsInRow.clear();
-	for (Quad& q : quads)
+template <typename Scalar>
+bool SolveZhang(const ZhangAccumulator<Scalar>& zhang, Eigen::Matrix3f& K)
+{
+	if (zhang.numHomographies < 3)
 	{
-		float d = abs(PointDistToLineSigned(q.centre, q24.centre, q27.centre));
-		if (d < bound)
-		{
-			quadsInRow.push_back(&q);
-		}
+		cout << "Zhang needs at least three homographies, and has " << zhang.numHomographies << endl;
+		return false;
 	}
-	sort(quadsInRow.begin(), quadsInRow.end(), CompareQuadByCentreX);
 
-	// Number
-	for (int i = 0; i < quadsInRow.size(); ++i)
+	SelfAdjointEigenSolver<Matrix<Scalar, 6, 6> > eigen(zhang.VtV);
+	if (eigen.info() != Success)
 	{
-		quadsInRow[i]->number = currentQuadIndex;
-		currentQuadIndex++;
+		return false;
 	}
-	q27.number = 27;
-	currentQuadIndex = 28;
 
-	// Number the two attached to q1 and q5
-	int indexQ28 = -1;
-	int indexQ32 = -1;
-	for (int n = 0; n < quads.size(); ++n)
+	// Eigenvalues come in increasing order, so the one we want is first
+	// B = (B11, B12, B22, B13, B23, B33)
+	Matrix<Scalar, 6, 1> B = eigen.eigenvectors().col(0);
+
+	// B is only known up to scale, and that includes its sign. The true B is positive definite
+	if (B(0) < 0)
 	{
-		for (int i = 0; i < 4; ++i)
-		{
-			if (q24.associatedCorners[i].first != -1)
-			{
-				if (q24.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q24.centre.y && quads[n].centre.x < q24.centre.x)
-					{
-						quads[n].number = 28;
-						indexQ28 = n;
-					}
-				}
-			}
-			if (q27.associatedCorners[i].first != -1)
-			{
-				if (q27.associatedCorners[i].first == quads[n].id)
-				{
-					if (quads[n].centre.y > q27.centre.y && quads[n].centre.x > q27.centre.x)
-					{
-						quads[n].number = 32;
-						indexQ32 = n;
-					}
-				}
-			}
-		}
+		B = -B;
 	}
-	if (indexQ28 == -1 || indexQ32 == -1)
+
+	/*
+	Now that we have the parameters of B, compute parameters of K. 
+	This is using Burger's closed form of Zhang's Appendix B, where B = lambda A-T A, and
+	these come out the same whatever lambda is
+	*/
+	const Scalar d = B(0) * B(2) - B(1) * B(1);
+	const Scalar w = B(0) * B(2) * B(5) - B(1) * B(1) * B(5) - B(0) * B(4) * B(4) + 2 * B(1) * B(3) * B(4) - B(2) * B(3) * B(3);
+	if (d <= 0 || w <= 0)
 	{
-		// we failed? Return. SHould have an error code. At least false?
-		cout << "Couldn't find quads 28 and 32" << endl;
-		return;
+		// B isn't positive definite, so there's no K that gives it
+		cout << "Zhang's B is not positive definite" << endl;
+		return false;
 	}
 
-	// Final row
-	Quad& q28 = quads[indexQ28];
-	Quad& q32 = quads[indexQ32];
-	// Draw a line between the two
-	l.p1 = q28.centre;
-	l.p2 = q32.centre;
+	// B12 = -skew / (fx^2 fy), so the skew has the opposite sign to B12
+	const Scalar focalX = sqrt(w / (d*B(0)));
+	const Scalar focalY = sqrt(w* B(0) / (d*d));
+	const Scalar skew = -B(1) * sqrt(w / (d * d * B(0)));
+	const Scalar principalX = (B(1)*B(4) - B(2)*B(3)) / d;
+	const Scalar principalY = (B(1) * B(3) - B(0) * B(4)) / d;
 
-	bound = GetLongestDiagonal(q28) / 2;
-	quadsInRow.clear();
-	for (Quad& q : quads)
-	{
-		float d = abs(PointDistToLineSigned(q.centre, q28.centre, q32.centre));
-		if (d < bound)
-		{
-			quadsInRow.push_back(&q);
-		}
-	}
-	sort(quadsInRow.begin(), quadsInRow.end(), CompareQuadByCentreX);
+	Matrix<Scalar, 3, 3> Kn;
+	Kn << focalX, skew, principalX,
+		  0, focalY, principalY,
+		  0, 0, 1;
+
+	// Back out of the normalised image coordinates
+	Matrix<Scalar, 3, 3> A = zhang.N.inverse() * Kn;
+	A /= A(2, 2);
+	K = A.template cast<float>();
 
-	// Number
-	for (int i = 0; i < quadsInRow.size(); ++i)
+	return true;
+}
+
+template void ResetZhangAccumulator<float>(ZhangAccumulator<float>&);
+template void ResetZhangAccumulator<double>(ZhangAccumulator<double>&);
+template void AddHomographyToZhang<float>(ZhangAccumulator<float>&, const Eigen::Matrix3f&, const cv::Point2f&);
+template void AddHomographyToZhang<double>(ZhangAccumulator<double>&, const Eigen::Matrix3f&, const cv::Point2f&);
+template bool SolveZhang<float>(const ZhangAccumulator<float>&, Eigen::Matrix3f&);
+template bool SolveZhang<double>(const ZhangAccumulator<double>&, Eigen::Matrix3f&);
+
+template <typename Scalar>
+bool ComputeCalibrationImpl(const std::vector<Calibration>& estimates, Matrix3f& K)
+{
+	ZhangAccumulator<Scalar> zhang;
+	ResetZhangAccumulator(zhang);
+	for (const Calibration& c : estimates)
 	{
-		quadsInRow[i]->number = currentQuadIndex;
-		currentQuadIndex++;
+		AddHomographyToZhang(zhang, c.H, c.size);
 	}
-	q32.number = 32;
+	return SolveZhang(zhang, K);
+}
 
-	// Transform them back
-	for (Quad& q : quads)
+bool ComputeCalibration(const std::vector<Calibration>& estimates, Matrix3f& K, const CalibrationPrecision precision)
+{
+	// Mixed precision only means something for refinement. There's nothing to vectorise here,
+	// and double keeps B from losing its sign in the square roots
+	if (precision == PRECISION_FLOAT)
 	{
-		Vector3f x(q.centre.x , q.centre.y, 1);
-		Vector3f Hx = H.inverse() * x;
-		Hx /= Hx(2);
-		q.centre = Point2f(Hx(0), Hx(1));
-
-		// Convert all corners too
-		for (int i = 0; i < 4; ++i)
-		{
-			Vector3f p(q.points[i].x, q.points[i].y, 1);
-			Vector3f Hp = H.inverse() * p;
-			Hp /= Hp(2);
-			q.points[i] = Point2f(Hp(0), Hp(1));
-		}
+		return ComputeCalibrationImpl<float>(estimates, K);
 	}
+	return ComputeCalibrationImpl<double>(estimates, K);
 }
 
 /*
-	Given a series of correspondences between images (in normalised coords),
-	compute a pinhole model calibration, if possible, and return it
-
-	This may seem a little arbitrary and magical, but Zhang computes constraints on the homographies
-	for the two checkerboard planes. Using these constraints, he creates a system of linear equations
-	in the terms of a matrix B = A.transpose() * A. We sovle this for B, then compute the values of A.
-
-	This can fail when the matrix V is rank deficient; that is, oversolved, such that rows conflict and
-	there are infinitely many solutions
+	Given K, take the pose of the board out of its homography. See Zhang, Appendix C.
+	H = lambda K [r1 r2 t], so K^-1 H gives the first two columns of R and t, up to a scale that
+	makes r1 a unit vector. r3 is r1 x r2.
+	With noise, that R isn't quite a rotation. If R = USV^T, then UV^T is the nearest rotation
 */
-bool ComputeCalibration(const std::vector<Calibration>& estimates, Matrix3f& K)
+bool PoseFromHomography(const Eigen::Matrix3f& K, Calibration& c)
 {
-	// Construct the system of linear equations in the parameters of B
-	// The size of V is 2x total quads by 6
-	MatrixXf V;
-	V.resize(estimates.size() * 2, 6);
-	V.setZero();
-	for (size_t i = 0; i < estimates.size(); ++i)
+	// These are evaluated into real vectors. An auto Eigen expression would keep
+	// references to the temporaries in it, which are gone by the next line
+	const Matrix3f Kinv = K.inverse();
+	const float lambda = 1.f / (Kinv * Vector3f(c.H(0, 0), c.H(1, 0), c.H(2, 0))).norm();
+	c.r[0] = lambda * Kinv * Vector3f(c.H(0,0), c.H(1,0), c.H(2,0));
+	c.r[1] = lambda * Kinv * Vector3f(c.H(0, 1), c.H(1, 1), c.H(2, 1));
+	c.r[2] = c.r[0].cross(c.r[1]);
+	c.t = lambda * Kinv * Vector3f(c.H(0, 2), c.H(1, 2), c.H(2, 2));
+
+	c.R << c.r[0][0], c.r[1][0], c.r[2][0],
+		c.r[0][1], c.r[1][1], c.r[2][1],
+		c.r[0][2], c.r[1][2], c.r[2][2];
+
+	JacobiSVD<Matrix3f> svd(c.R, ComputeFullU | ComputeFullV);
+	if (!svd.computeU() || !svd.computeV())
 	{
-		// Compute the vectors 
-		const Matrix3f& H = estimates[i].H;
-		// These are 6-vectors
-		VectorXf v11(6);
-		VectorXf v12(6);
-		VectorXf v22(6);
-
-		// i = j = 1
-		v11(0) = H(0, 0)*H(0, 0);
-		v11(1) = H(0, 0)*H(1, 0) + H(1, 0)*H(0, 0);
-		v11(2) = H(1, 0)*H(1, 0);
-		v11(3) = H(2, 0)*H(0, 0) + H(0, 0)*H(2, 0);
-		v11(4) = H(2, 0)*H(1, 0) + H(1, 0)*H(2, 0);
-		v11(5) = H(2, 0)*H(2, 0);
-
-		// i = 1. j = 2
-		v12(0) = H(0, 0)*H(0, 1);
-		v12(1) = H(0, 0)*H(1, 1) + H(1, 0)*H(0, 1);
-		v12(2) = H(1, 0)*H(1, 1);
-		v12(3) = H(2, 0)*H(0, 1) + H(0, 0)*H(2, 1);
-		v12(4) = H(2, 0)*H(1, 1) + H(1, 0)*H(2, 1);
-		v12(5) = H(2, 0)*H(2, 1);
-
-		// i = j = 2
-		v22(0) = H(0, 1)*H(0, 1);
-		v22(1) = H(0, 1)*H(1, 1) + H(1, 1)*H(0, 1);
-		v22(2) = H(1, 1)*H(1, 1);
-		v22(3) = H(2, 1)*H(0, 1) + H(0, 1)*H(2, 1);
-		v22(4) = H(2, 1)*H(1, 1) + H(1, 1)*H(2, 1);
-		v22(5) = H(2, 1)*H(2, 1);
-
-		// Use these to create the matrix V
-		// [  v_12 transpose         ] 
-		// [  (v_11 - v_22) transpose] b = 0
-		// as per zhang, so form these equations in V
-		V(2 * i, 0) = v12(0);
-		V(2 * i, 1) = v12(1);
-		V(2 * i, 2) = v12(2);
-		V(2 * i, 3) = v12(3);
-		V(2 * i, 4) = v12(4);
-		V(2 * i, 5) = v12(5);
-
-		V(2 * i + 1, 0) = v11(0) - v22(0);
-		V(2 * i + 1, 1) = v11(1) - v22(1);
-		V(2 * i + 1, 2) = v11(2) - v22(2);
-		V(2 * i + 1, 3) = v11(3) - v22(3);
-		V(2 * i + 1, 4) = v11(4) - v22(4);
-		V(2 * i + 1, 5) = v11(5) - v22(5);
-	}
-	cout << V << endl;
-
-	// Get the singular values from the decomposition
-	BDCSVD<MatrixXf> svd(V, ComputeThinU | ComputeFullV);
-	if (!svd.computeV())
 		return false;
-	auto& v = svd.matrixV();
-
-	// Get the matrix of singular values, and find the index of the minimum
-	auto index = svd.nonzeroSingularValues();
-	int idx = index - 1;
-	cout << v << endl;
-	cout << "Nonzero singular values: " << index << endl;
-
-	// We get a six-vector out of this. Get the singular values for our vector
-	// see the code from work about this section. 
-	// We use the matrix form of this vector (see Zhang) when pulling it out of V;
-	// Set B to be the column of V corresponding to the smallest singular value
-	// which is the last as singular values come well-ordered
-	// B = (B11, B12, B22, B13, B23, B33)
-	VectorXf B(6);
-	B << v(0, idx), v(1, idx), v(2, idx),
-		v(3, idx), v(4, idx), v(5, idx);
-	cout << B << endl;
-
-	/*
-	Now that we have the parameters of B, compute parameters of K. 
-	This is using Zhang's equations from his Appendix B, 
-	where B = lambda A-T A
-	Since we don't care about scale, we divide throughout by lambda once we have it
-	*/
-	// Use the difference computation to get these values?
-	// Give it a shot
-	// TODO: Burger's computations instead if Zhang's
-	// page 19
-
-	// Burger
-	// These are better, so did I get the zhang equations wrong? Perhaps off by a factor?
-	// But it's still wrong
-	float d = B(0) * B(2) - B(1) * B(1);
-	float w = B(0) * B(2) * B(5) - B(1) * B(1) * B(5) - B(0) * B(4) * B(4) + 2 * B(1) * B(3) * B(4) - B(2) * B(3) * B(3);
-	
-	float focalX = sqrt(w / (d*B(0)));
-	float focalY = sqrt(w* B(0) / (d*d));
-	float skew = B(1) * sqrt(w / (d * d * B(0)));
-	float principalX = (B(1)*B(4) - B(2)*B(3)) / d;
-	float principalY = (B(1) * B(3) - B(0) * B(4)) / d;
-	float lambda = 1;
-
-	/* Zhang
-	float principalY = (B(1)*B(3) - B(0)*B(4)) / (B(0)*B(2) - B(1)*B(1));
-	float lambda = B(5) - (B(3)*B(3) + principalY*(B(1)*B(3) - B(0)*B(4)))/B(0);
-	float focalX = sqrt(lambda/B(0));
-	float focalY = sqrt(lambda*B(0)/(B(0)*B(2) - B(1)*B(1)));
-	float skew = -B(1)*focalX*focalX*focalY/lambda;
-	float principalX = (skew*principalY/focalY) - B(3)*focalX*focalX/lambda;
-	*/
-	
-	// TODO:
-	// SOmetimes getting NaN cos taking sqrt of negative
-	// Also getting wildly different numbers
-	// I think this is because the checker detection is not very consistent
-
-	K.setZero();
-	K(0, 0) = focalX;
-	K(1, 1) = focalY;
-	K(2, 2) = lambda;
-	K(0, 1) = skew;
-	K(0, 2) = principalX;
-	K(1, 2) = principalY;
-	K /= K(2,2);
+	}
+	c.R = svd.matrixU() * svd.matrixV().transpose();
 
 	return true;
 }
\ No newline at end of file
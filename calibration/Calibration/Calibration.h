@@ -4,12 +4,37 @@
 #include <opencv2/highgui.hpp>
 #include <vector>
 #include <utility>
+#include <random>
+#include <string>
 #include <Eigen/Dense>
 #include "Features.h"
 #include "Image.h"
 
 #define MAX_ERODE_ITERATIONS 4 // 10
 
+// Radial k1, k2, k3 and tangential p1, p2, kept in OpenCV's order: k1, k2, p1, p2, k3
+#define NUM_DISTORTION_PARAMS 5
+typedef Eigen::Matrix<float, NUM_DISTORTION_PARAMS, 1> DistortionVector;
+
+/*
+	Precision of calibration. Residuals and Jacobians are evaluated in one scalar type, Real, and
+	the normal equations are accumulated and solved in another, Accum.
+	- Float does everything in float.
+	- Mixed evaluates in float, which keeps Eigen's fixed-size float kernels four to a register,
+	  but accumulates and solves in double. JtJ is a sum over thousands of observations, and the
+	  Schur complement subtracts large blocks that nearly cancel, and both lose float digits.
+	- Double does everything in double, for validating the others against.
+	The refinement is templated on both. The initial estimate has nothing to vectorise, so it
+	runs in double unless everything is float
+*/
+enum CalibrationPrecision
+{
+	PRECISION_FLOAT,
+	PRECISION_MIXED,
+	PRECISION_DOUBLE
+};
+#define CALIBRATION_PRECISION PRECISION_MIXED
+
 // structure for the calibration of a camera
 struct Calibration
 {
@@ -21,20 +46,77 @@ struct Calibration
 
 	cv::Point2f size;
 
-	/*
-	TODO: have distortion params here
-	*/
+	DistortionVector distortion;
 
 	std::vector<Quad> quads;
 };
 
+// A checkerboard of rows x cols squares. Both are odd, so that all four corner squares are black.
+// The black squares are the checkers, numbered from 1 along each row from the top.
+// On the ground truth plane, origin is the centre of the top left checker, and colStep and
+// rowStep go one square across and one square down. Checkers can be smaller than a square,
+// so that they don't touch
+struct BoardDescriptor
+{
+	int rows;
+	int cols;
+	cv::Point2f origin;
+	cv::Point2f colStep;
+	cv::Point2f rowStep;
+	cv::Size2f checkerSize;
+};
+
 float L2norm(cv::Point a);
 
+/* Board functions */
+int NumCheckers(const BoardDescriptor& board);
+
+// The number of the checker on a square, or 0 if the square is white or off the board
+int CheckerNumber(const BoardDescriptor& board, const int row, const int col);
+
+// Indices of the top left, top right, bottom right and bottom left quads
+bool FindCornerQuads(const std::vector<Quad>& quads, int corners[4]);
+
+// Read a board from a text descriptor. See Calibration.cpp for the format
+bool ReadBoardDescriptor(const std::string& filename, BoardDescriptor& board);
+
+// The exact ground truth checkers of a board, numbered and with their corners linked
+void GenerateBoardQuads(const BoardDescriptor& board, std::vector<Quad>& quads);
+
 /* Calibration functions */
-bool CheckerDetection(const cv::Mat& checkerboard, std::vector<Quad>& quads, bool debug);
+// Quad finding is randomised, so the caller supplies the RNG. Give each concurrent
+// detection its own. Fails unless most of the board's checkers are found
+bool CheckerDetection(const cv::Mat& checkerboard, const BoardDescriptor& board, std::vector<Quad>& quads, bool debug,
+	                  std::mt19937& rng);
+
+bool GetHomographyAndMatchQuads(Eigen::Matrix3f& H, const cv::Mat& img, const BoardDescriptor& board,
+	                            const std::vector<Quad>& gtQuads, std::vector<Quad>& quads);
+
+// Number each quad by the board square it lands on, after H takes it to the ground truth plane
+bool TransformAndNumberQuads(const Eigen::Matrix3f& H, const BoardDescriptor& board, std::vector<Quad>& quads);
+
+// Zhang's linear system for K, kept as VtV, so that homographies can be added one at a time.
+// N takes pixels to normalised image coordinates
+template <typename Scalar>
+struct ZhangAccumulator
+{
+	Eigen::Matrix<Scalar, 6, 6> VtV;
+	Eigen::Matrix<Scalar, 3, 3> N;
+	int numHomographies;
+};
+
+template <typename Scalar>
+void ResetZhangAccumulator(ZhangAccumulator<Scalar>& zhang);
+
+// Add one image's homography, from the board to the image. The first image's size fixes the normalisation
+template <typename Scalar>
+void AddHomographyToZhang(ZhangAccumulator<Scalar>& zhang, const Eigen::Matrix3f& H, const cv::Point2f& imageSize);
 
-bool GetHomographyAndMatchQuads(Eigen::Matrix3f& H, const cv::Mat& img, const cv::Mat& checkerboard, std::vector<Quad>& gtQuads, std::vector<Quad>& quads);
+// Solve for K from everything added so far. Needs at least three homographies
+template <typename Scalar>
+bool SolveZhang(const ZhangAccumulator<Scalar>& zhang, Eigen::Matrix3f& K);
 
-void TransformAndNumberQuads(const Eigen::Matrix3f& H, const cv::Mat& checkerboard, const cv::Point2f size, std::vector<Quad>& quads);
+bool ComputeCalibration(const std::vector<Calibration>& estimates, Eigen::Matrix3f& K, const CalibrationPrecision precision);
 
-bool ComputeCalibration(const std::vector<Calibration>& estimates, Eigen::Matrix3f& K);
\ No newline at end of file
+// Set the pose of the board in an image, R and t, from its homography and K
+bool PoseFromHomography(const Eigen::Matrix3f& K, Calibration& c);
\ No newline at end of file
@@ -3,186 +3,167 @@
 #include <algorithm>
 #include <Eigen/SVD>
 #include "Estimation.h"
-#include <stdlib.h>
-#include <time.h>
 
 using namespace cv;
 using namespace std;
 using namespace Eigen;
 
+/*
+	Correspondences
+	Kept as four arrays of floats. Everything that loops over matches only wants the coordinates,
+	and a Feature drags its 128 float descriptor along with them
+*/
+int NumCorrespondences(const Correspondences& c)
+{
+	return (int)c.x.size();
+}
+void AddCorrespondence(Correspondences& c, const Point2f& p, const Point2f& pPrime)
+{
+	c.x.push_back(p.x);
+	c.y.push_back(p.y);
+	c.xPrime.push_back(pPrime.x);
+	c.yPrime.push_back(pPrime.y);
+}
+void CorrespondencesFromMatches(const vector<pair<Feature, Feature> >& matches, Correspondences& c)
+{
+	c = Correspondences();
+	c.x.reserve(matches.size());
+	c.y.reserve(matches.size());
+	c.xPrime.reserve(matches.size());
+	c.yPrime.reserve(matches.size());
+	for (const auto& m : matches)
+	{
+		AddCorrespondence(c, m.second.p, m.first.p);
+	}
+}
+void SelectCorrespondences(const Correspondences& all, const vector<int>& indices, Correspondences& subset)
+{
+	subset.x.resize(indices.size());
+	subset.y.resize(indices.size());
+	subset.xPrime.resize(indices.size());
+	subset.yPrime.resize(indices.size());
+	for (int k = 0; k < (int)indices.size(); ++k)
+	{
+		subset.x[k] = all.x[indices[k]];
+		subset.y[k] = all.y[indices[k]];
+		subset.xPrime[k] = all.xPrime[indices[k]];
+		subset.yPrime[k] = all.yPrime[indices[k]];
+	}
+}
+
 /*
 	Find the best homography between the two images. This is returned in H.
 
 	Using a RANSAC approach, pick four random matches. Estimate the homography between
 	the images using just these four. Measure the success of this homography by how well
-	it predicts the rest of the matches. Refine the homography for the inlier set, 
-	and count new number of inliers. Repeat until no more inliers. Measure the error.
-	Take the best of these.
-	Repeat for another random four.
+	it predicts the rest of the matches, and keep the one that predicts the most.
+	Then refine that homography over its inliers.
 
-	We'll do this a maximum number of times, and remember the best.
+	The RANSAC loop itself is in Ransac.h. It stops once it's RANSAC_CONFIDENCE sure it has seen
+	the best model, given the best inlier ratio so far, so a clean set of matches takes a
+	handful of hypotheses rather than MAX_RANSAC_ITERATIONS. A T(1,1) test throws most bad
+	hypotheses away after checking one match.
 	If we never find a homography that produces matches below the epsilon, well,
 	maybe this image pair just ain't good, yeah?
 
-	NOTE: We can scale and shift the points to have 0 mean and std dev of 1.
-	This can be useful if most of your matches are on one part of the image, with a few elsewhere - 
-	it can unfairly weight parts of the image. 
-
-	I don't normalise, and I get results that are fine. 
+	The points for each hypothesis are normalised inside the homography solver, so there's
+	nothing to do for that here.
 */
 // Support functions
-void GetRandomFourIndices(int& i1, int& i2, int& i3, int& i4, int max, const vector<pair<Feature, Feature> >& matches)
+// Symmetric transfer error, L2(x' - Hx) + L2(x - Hinverse x').
+// This is plain float arithmetic, so that a loop over correspondences can vectorise
+inline float SymmetricTransferError(const Matrix3f& H, const Matrix3f& Hinv, const float x, const float y,
+	                                const float xPrime, const float yPrime)
 {
-	i1 = rand() % max;
+	const float w = H(2, 0)*x + H(2, 1)*y + H(2, 2);
+	const float dx = xPrime - (H(0, 0)*x + H(0, 1)*y + H(0, 2)) / w;
+	const float dy = yPrime - (H(1, 0)*x + H(1, 1)*y + H(1, 2)) / w;
 
-	do
-	{
-		i2 = rand() % max;
-	} while (i2 == i1);
+	const float wPrime = Hinv(2, 0)*xPrime + Hinv(2, 1)*yPrime + Hinv(2, 2);
+	const float dxPrime = x - (Hinv(0, 0)*xPrime + Hinv(0, 1)*yPrime + Hinv(0, 2)) / wPrime;
+	const float dyPrime = y - (Hinv(1, 0)*xPrime + Hinv(1, 1)*yPrime + Hinv(1, 2)) / wPrime;
 
-	do
-	{
-		i3 = rand() % max;
-	} while (i3 == i1 || i3 == i2);
-
-	do
-	{
-		i4 = rand() % max;
-	} while (i4 == i1 || i4 == i2 || i4 == i3);
+	return sqrt(dx*dx + dy*dy) + sqrt(dxPrime*dxPrime + dyPrime*dyPrime);
 }
-// Normalise points
-pair<Matrix3f, Matrix3f> ConvertPoints(const vector<pair<Feature, Feature> >& matches)
+
+// A homography and its inverse, so the inverse is only found once per hypothesis
+struct HomographyModel
+{
+	Matrix3f H;
+	Matrix3f Hinv;
+};
+
+// The homography from x to x' over a set of correspondences, as a RANSAC problem
+struct HomographyRansacProblem
 {
-	// For each point in first and second, collect the mean
-	// and compute std deviation
-	unsigned int size = matches.size();
-	Point2f firstAvg(0.f, 0.f);
-	Point2f secondAvg(0.f, 0.f);
-	for (unsigned int i = 0; i < size; ++i)
+	typedef HomographyModel Model;
+	static const int SampleSize = 4;
+
+	const Correspondences& matches;
+
+	int NumData() const
 	{
-		firstAvg += matches[i].first.p;
-		secondAvg += matches[i].second.p;
+		return NumCorrespondences(matches);
 	}
-	firstAvg /= (float)size;
-	secondAvg /= (float)size;
-
-	// Now compute std deviation
-	Point2f firstStdDev(0.f, 0.f);
-	Point2f secondStdDev(0.f, 0.f);
-	for (unsigned int i = 0; i < size; ++i)
+	bool Fit(const int* sample, Model& model) const
 	{
-		auto temp = matches[i].first.p - firstAvg;
-		firstStdDev += Point2f(temp.x*temp.x, temp.y*temp.y);
-
-		temp = matches[i].second.p - secondAvg;
-		secondStdDev += Point2f(temp.x*temp.x, temp.y*temp.y);
+		Point2f from[4], to[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			from[k] = Point2f(matches.x[sample[k]], matches.y[sample[k]]);
+			to[k] = Point2f(matches.xPrime[sample[k]], matches.yPrime[sample[k]]);
+		}
+		if (!GetHomographyFromFourMatches(from, to, model.H))
+		{
+			return false;
+		}
+		bool invertible = false;
+		model.H.computeInverseWithCheck(model.Hinv, invertible);
+		return invertible;
 	}
-	firstStdDev /= (float)size;
-	secondStdDev /= (float)size;
-	firstStdDev.x = sqrt(firstStdDev.x);
-	firstStdDev.y = sqrt(firstStdDev.y);
-	secondStdDev.x = sqrt(secondStdDev.x);
-	secondStdDev.y = sqrt(secondStdDev.y);
-
-	Matrix3f conversionForSecondPoints;
-	conversionForSecondPoints << 1 / secondStdDev.x,             0.f        , -1*secondAvg.x / secondStdDev.x,
-		                                  0.f      ,      1 / secondStdDev.y, -1*secondAvg.y / secondStdDev.y,
-		                                  0.f      ,             0.f        ,           1.f;
- 	Matrix3f conversionForFirstPoints;
-	conversionForFirstPoints << 1 / firstStdDev.x,             0.f        , -1*firstAvg.x / firstStdDev.x,
-		                                  0.f      ,      1 / firstStdDev.y, -1*firstAvg.y / firstStdDev.y,
-		                                  0.f      ,             0.f        ,           1.f;
-
-	return make_pair(conversionForFirstPoints, conversionForSecondPoints);
-}
-// Actual function
-bool FindHomography(Matrix3f& homography, vector<pair<Feature,Feature> > matches)
-{
-	// Initialise RNG
-	srand(time(NULL));
-
-	// Get normalisation matrices, and normalise all points in the matches
-	// This distributes the points across a normal distribution, mean 0 std dev 1. 
-	// This is to counteract any uneven distribution of points, that might weight a homography
-	// towards a certain part of the image. Technically, refinement should fix this. 
-	// You can try turning this on and see what effect it has
-	/*auto normalisationMatrixPair = ConvertPoints(matches);
-	for (unsigned int i = 0; i < matches.size(); ++i)
-	{
-		auto p1 = matches[i].first.p;
-		Vector3f v1(p1.x, p1.y, 1);
-		auto v1Prime = normalisationMatrixPair.first * v1;
-		matches[i].first.p.x = v1Prime(0);
-		matches[i].first.p.y = v1Prime(1);
-
-		auto p2 = matches[i].second.p;
-		Vector3f v2(p2.x, p2.y, 1);
-		auto v2Prime = normalisationMatrixPair.second * v2;
-		matches[i].second.p.x = v2Prime(0);
-		matches[i].second.p.y = v2Prime(1);
-	}*/
-
-	// RANSAC
-	// For a maximum of MAX_RANSAC_ITERATIONS, pick four matches at random
-	// Create a homography, perform the tests, refine etc, see how it is
-	// If it meets the bar for quality, break. 
-	// If not, keep trying
-	int maxInliers = 0;
-	Matrix3f bestH;
-	int numMatches = matches.size();
-	vector<pair<Feature, Feature> > inlierSet;
-	for (int k = 0; k < MAX_RANSAC_ITERATIONS; ++k)
-	{
-		// Pick four random matches by generating four random indices
-		// and ensuring they are not equal
-		int i1, i2, i3, i4;
-		GetRandomFourIndices(i1, i2, i3, i4, numMatches, matches);
-		
-		// Get the points for those features and generate the homography
-		// Since we match from left to right, and the homography goes from right
-		// to left, the first in the pair is the feature on the right, and the second on the left
-		vector<pair<Point, Point>> points;
-		Matrix3f H;
-		points.push_back(make_pair(matches[i1].second.p, matches[i1].first.p));
-		points.push_back(make_pair(matches[i2].second.p, matches[i2].first.p));
-		points.push_back(make_pair(matches[i3].second.p, matches[i3].first.p));
-		points.push_back(make_pair(matches[i4].second.p, matches[i4].first.p));
-		if (!GetHomographyFromMatches(points, H))
-			continue;
-		
-		// Test the homography again all matches
-		// Normalise homography
-		H /= H(2, 2);
-		auto set = EvaluateHomography(matches, H);
-		if (set.size() > maxInliers)
+	bool IsInlier(const Model& model, const int i) const
+	{
+		return SymmetricTransferError(model.H, model.Hinv, matches.x[i], matches.y[i], matches.xPrime[i], matches.yPrime[i])
+			< POSITIONAL_UNCERTAINTY * RANSAC_INLIER_MULTIPLER;
+	}
+	int CountInliers(const Model& model, const int begin, const int end) const
+	{
+		const float* x = matches.x.data();
+		const float* y = matches.y.data();
+		const float* xPrime = matches.xPrime.data();
+		const float* yPrime = matches.yPrime.data();
+		int count = 0;
+		for (int i = begin; i < end; ++i)
 		{
-			maxInliers = inlierSet.size();
-			inlierSet = set;
-			bestH = H;
+			count += (SymmetricTransferError(model.H, model.Hinv, x[i], y[i], xPrime[i], yPrime[i]) < POSITIONAL_UNCERTAINTY * RANSAC_INLIER_MULTIPLER);
 		}
-
-		// TODO: add L-M here
-
-		// Not enough inliers. Loop again
+		return count;
 	}
+};
+// Actual function
+bool FindHomography(Matrix3f& homography, const Correspondences& matches, mt19937& rng)
+{
+	const HomographyRansacProblem problem = { matches };
+	const RansacParams params = { RANSAC_CONFIDENCE, MAX_RANSAC_ITERATIONS, 0, RANSAC_PRETEST_SIZE };
+	HomographyModel best;
+	vector<int> inliers;
+	const int maxInliers = Ransac(problem, params, rng, best, inliers);
 
 	cout << "max inliers: " << maxInliers << endl;
 
 	if (maxInliers != 0)
 	{
-		cout << "normalised homography: " << endl << bestH << endl;
-
+		cout << "homography: " << endl << best.H << endl;
 
 		// Now bundle adjust on just the inlier set
+		Correspondences inlierSet;
+		SelectCorrespondences(matches, inliers, inlierSet);
 		cout << "Bundle adjustment" << endl;
+		Matrix3f bestH = best.H;
 		BundleAdjustment(inlierSet, bestH);
 		cout << "Refined homography: " << endl << bestH << endl;
 
-		
-		// convert H back to regular coords from normalised coords
-		homography = /*normalisationMatrixPair.first.inverse() */ bestH /* normalisationMatrixPair.second*/;
-		cout << "unnormalised homography: " << endl << homography << endl;
-		// renormalise
+		homography = bestH;
 		homography /= homography(2, 2);
 			
 		return true;
@@ -193,130 +174,171 @@ bool FindHomography(Matrix3f& homography, vector<pair<Feature,Feature> > matches
 }
 
 /*
-	Singular Value Decomposition
-	This is where we actually construct the homography, for a given set of four matching pairs. 
+	Direct Linear Transform
+	This is where we actually construct the homography, for a given set of matching pairs. 
 	This is quite tricky to describe in just text, so I've linked everything I used to figure this out,
 	in the README, under https://github.com/dmckinnon/stitch#finding-the-best-transform
 
-	Find the homography for four sets of corresponding points
-
 	How do we estimate the homography?
 
 	Create the Matrix A, which is
 	[ -u1  -v1  -1   0    0    0   u1u'1  v1u'1  u'1]
 	[  0    0    0  -u1  -v1  -1   u1v'1  v1v'1  v'1] * h = 0
 	................................................
-	[  0    0    0  -u4  -v4  -1   u4v'4  v4v'4  v'4]
+	[  0    0    0  -uN  -vN  -1   uNv'N  vNv'N  v'N]
 	where x' = Hx and h = [h1 ... h9] as a vector
 
-	This is specifically for four sets of points. You can have more points and the matrix keeps growing.
+	h is the null vector of A, which is also the eigenvector of AtA with the smallest eigenvalue.
+	AtA is always 9x9, however many points there are, and each point adds its two rows' outer
+	products to it. So we never build A at all - we fold each match into a fixed-size AtA as we
+	go, and then do one 9x9 symmetric eigen-solve. Nothing here allocates, which matters since
+	RANSAC does this thousands of times.
 
-	Use Singular Value Decomposition to compute A:
-	UDV^T = A
-	h = V_smallest (column of V corresponding to smallest singular value)
-	Then form H out of that.
-	Then unnormalise H, using the inverse of the normalisation matrix for the points
+	Before that, the points are normalised (Hartley, In Defense of the Eight-Point Algorithm):
+	each set is shifted so its centroid is at the origin and scaled so the average distance from
+	it is sqrt(2). In pixel coordinates the columns of A differ in scale by the square of the
+	image size, and forming AtA squares that again, which float can't take. Normalised, all the
+	columns are about the same size. Then H = T'^-1 * Hn * T undoes the normalisation.
 
 	NOTE:
 	In the pairs, the first is x, the point from the image we come from
 	the second is x prime, the point in the image we are transforming to
-
-	To SVD A, we use Eigen. 
-	Really, we could also just do eigenvalue decomposition on AT * A
-	Since V's columns are eigenvectors of AT * A
-	But whatever
 */
-bool GetHomographyFromMatches(const vector<pair<Point, Point>> points, Matrix3f& H)
-{
-	// Construct A
-	MatrixXf A;
-	A.resize(points.size()*2, 9);
-	A.setZero();
-	for (unsigned int i = 0; i < points.size(); ++i)
-	{
-		auto& p = points[i];
-
-		auto secondPoint = Vector3f(p.second.x, p.second.y, 1.f); // left
-		auto firstPoint = Vector3f(p.first.x, p.first.y, 1.f); // right
-
-		// Continue building A
-		A(2*i,   0) = -1 * firstPoint(0);
-		A(2 * i, 1) = -1 * firstPoint(1);
-		A(2 * i, 2) = -1;
-		A(2 * i, 6) = firstPoint(0) * secondPoint(0);
-		A(2 * i, 7) = firstPoint(1) * secondPoint(0);
-		A(2 * i, 8) = secondPoint(0);
-
-		A(2 * i + 1, 3) = -1 * firstPoint(0);
-		A(2 * i + 1, 4) = -1 * firstPoint(1);
-		A(2 * i + 1, 5) = -1;
-		A(2 * i + 1, 6) = firstPoint(0) * secondPoint(1);
-		A(2 * i + 1, 7) = firstPoint(1) * secondPoint(1);
-		A(2 * i + 1, 8) = secondPoint(1);
-	}
-
-	// Get the V matrix of the SVD decomposition
-	BDCSVD<MatrixXf> svd(A, ComputeThinU | ComputeFullV);
-	if (!svd.computeV())
+// Helpers
+typedef Matrix<float, 9, 9> DLTMatrix;
+
+// Hartley normalisation for n points, each fetched by index
+template <typename GetPoint>
+bool NormalisingTransform(const int n, GetPoint point, Matrix3f& T)
+{
+	Point2f centroid(0, 0);
+	for (int i = 0; i < n; ++i)
+	{
+		centroid += point(i);
+	}
+	centroid *= 1.f / n;
+
+	float meanDist = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		const Point2f d = point(i) - centroid;
+		meanDist += sqrt(d.x*d.x + d.y*d.y);
+	}
+	meanDist /= n;
+	if (meanDist == 0)
+	{
+		// All the points are the same point
+		return false;
+	}
+
+	const float scale = sqrt(2.f) / meanDist;
+	T << scale, 0, -scale * centroid.x,
+		 0, scale, -scale * centroid.y,
+		 0, 0, 1;
+	return true;
+}
+
+// Add the two rows of A for x -> x' to AtA. Both points are already normalised
+void AccumulateDLTRows(DLTMatrix& AtA, const Vector3f& x, const Vector3f& xPrime)
+{
+	Matrix<float, 2, 9> rows;
+	rows << -x(0), -x(1), -1, 0, 0, 0, x(0)*xPrime(0), x(1)*xPrime(0), xPrime(0),
+		    0, 0, 0, -x(0), -x(1), -1, x(0)*xPrime(1), x(1)*xPrime(1), xPrime(1);
+	AtA.noalias() += rows.transpose() * rows;
+}
+
+// The eigenvector of AtA with the smallest eigenvalue, taken back out of normalised coordinates
+bool SolveDLT(const DLTMatrix& AtA, const Matrix3f& T, const Matrix3f& TPrime, Matrix3f& H)
+{
+	SelfAdjointEigenSolver<DLTMatrix> eigen(AtA);
+	if (eigen.info() != Success)
+	{
 		return false;
-	auto& V = svd.matrixV();
+	}
 
-	// Set H to be the column of V corresponding to the smallest singular value
-	// which is the last as singular values come well-ordered
-	H << V(0, 8), V(1, 8), V(2, 8),
-		 V(3, 8), V(4, 8), V(5, 8),
-		 V(6, 8), V(7, 8), V(8, 8);
+	// Eigenvalues come in increasing order, so the one we want is first
+	const Matrix<float, 9, 1> h = eigen.eigenvectors().col(0);
+	Matrix3f Hn;
+	Hn << h(0), h(1), h(2),
+		  h(3), h(4), h(5),
+		  h(6), h(7), h(8);
+
+	H = TPrime.inverse() * Hn * T;
+	if (H(2, 2) == 0)
+	{
+		return false;
+	}
 
 	// Normalise H
 	H /= H(2, 2);
 
 	return true;
 }
-bool GetHomographyFromMatches(const vector<pair<Point2f, Point2f>> points, Matrix3f& H)
+
+// Actual functions
+bool GetHomographyFromFourMatches(const Point2f from[4], const Point2f to[4], Matrix3f& H)
 {
-	// Construct A
-	MatrixXf A;
-	A.resize(points.size() * 2, 9);
-	A.setZero();
-	for (unsigned int i = 0; i < points.size(); ++i)
+	Matrix3f T, TPrime;
+	if (!NormalisingTransform(4, [&](const int i) { return from[i]; }, T) ||
+		!NormalisingTransform(4, [&](const int i) { return to[i]; }, TPrime))
 	{
-		auto& p = points[i];
-
-		auto secondPoint = Vector3f(p.second.x, p.second.y, 1.f); // left
-		auto firstPoint = Vector3f(p.first.x, p.first.y, 1.f); // right
+		return false;
+	}
 
-															   // Continue building A
-		A(2 * i, 0) = -1 * firstPoint(0);
-		A(2 * i, 1) = -1 * firstPoint(1);
-		A(2 * i, 2) = -1;
-		A(2 * i, 6) = firstPoint(0) * secondPoint(0);
-		A(2 * i, 7) = firstPoint(1) * secondPoint(0);
-		A(2 * i, 8) = secondPoint(0);
+	// Four points give exactly eight rows, so A is 8x9 and h is its null vector. Setting h9 = 1 turns
+	// that into an 8x8 solve, which only fails if the centroid of the first points goes to infinity
+	Matrix<float, 8, 9> A;
+	for (int i = 0; i < 4; ++i)
+	{
+		const Vector3f x = T * Vector3f(from[i].x, from[i].y, 1.f);
+		const Vector3f xPrime = TPrime * Vector3f(to[i].x, to[i].y, 1.f);
+		A.row(2 * i) << -x(0), -x(1), -1, 0, 0, 0, x(0)*xPrime(0), x(1)*xPrime(0), xPrime(0);
+		A.row(2 * i + 1) << 0, 0, 0, -x(0), -x(1), -1, x(0)*xPrime(1), x(1)*xPrime(1), xPrime(1);
+	}
 
-		A(2 * i + 1, 3) = -1 * firstPoint(0);
-		A(2 * i + 1, 4) = -1 * firstPoint(1);
-		A(2 * i + 1, 5) = -1;
-		A(2 * i + 1, 6) = firstPoint(0) * secondPoint(1);
-		A(2 * i + 1, 7) = firstPoint(1) * secondPoint(1);
-		A(2 * i + 1, 8) = secondPoint(1);
+	const FullPivLU<Matrix<float, 8, 8> > lu(A.leftCols<8>());
+	if (!lu.isInvertible())
+	{
+		// Three of the points are in a line
+		return false;
 	}
+	const Matrix<float, 8, 1> h = lu.solve(-A.col(8));
+
+	Matrix3f Hn;
+	Hn << h(0), h(1), h(2),
+		  h(3), h(4), h(5),
+		  h(6), h(7), 1;
+	H = TPrime.inverse() * Hn * T;
+	if (H(2, 2) == 0)
+	{
+		return false;
+	}
+	H /= H(2, 2);
 
-	// Get the V matrix of the SVD decomposition
-	BDCSVD<MatrixXf> svd(A, ComputeThinU | ComputeFullV);
-	if (!svd.computeV())
+	return true;
+}
+bool GetHomographyFromMatches(const Correspondences& matches, Matrix3f& H)
+{
+	const int n = NumCorrespondences(matches);
+	if (n < 4)
+	{
 		return false;
-	auto& V = svd.matrixV();
+	}
 
-	// Set H to be the column of V corresponding to the smallest singular value
-	// which is the last as singular values come well-ordered
-	H << V(0, 8), V(1, 8), V(2, 8),
-		V(3, 8), V(4, 8), V(5, 8),
-		V(6, 8), V(7, 8), V(8, 8);
+	Matrix3f T, TPrime;
+	if (!NormalisingTransform(n, [&](const int i) { return Point2f(matches.x[i], matches.y[i]); }, T) ||
+		!NormalisingTransform(n, [&](const int i) { return Point2f(matches.xPrime[i], matches.yPrime[i]); }, TPrime))
+	{
+		return false;
+	}
 
-	// Normalise H
-	H /= H(2, 2);
+	DLTMatrix AtA = DLTMatrix::Zero();
+	for (int i = 0; i < n; ++i)
+	{
+		AccumulateDLTRows(AtA, T * Vector3f(matches.x[i], matches.y[i], 1.f), TPrime * Vector3f(matches.xPrime[i], matches.yPrime[i], 1.f));
+	}
 
-	return true;
+	return SolveDLT(AtA, T, TPrime, H);
 }
 
 /*
@@ -328,43 +350,21 @@ bool GetHomographyFromMatches(const vector<pair<Point2f, Point2f>> points, Matri
 	H inverse to project x' into the image for x and get the difference). 
 	These can be added to get a good idea of the total error.
 
-	We count the number of inliers, and return the inlier set and TODO: the error
+	We return the number of inliers, and their indices in the matches
 */
-vector<pair<Feature, Feature> > EvaluateHomography(const vector<pair<Feature,Feature> >& matches, const Matrix3f& H)
+int EvaluateHomography(const Correspondences& matches, const Matrix3f& H, vector<int>& inliers)
 {
-	vector<float> diffs;
-	int numInliers = 0;
-	float allError = 0;
-	vector<pair<Feature, Feature>> inlierSet;
-	// Over all matches
-	for (unsigned int i = 0; i < matches.size(); ++i)
+	inliers.clear();
+	const Matrix3f Hinv = H.inverse();
+	for (int i = 0; i < NumCorrespondences(matches); ++i)
 	{
-		// Convert both points to Eigen points
-		Vector3f x(matches[i].second.p.x, matches[i].second.p.y, 1);
-		Vector3f xprime(matches[i].first.p.x, matches[i].first.p.y, 1);
-
-		Vector3f Hx = H * x;
-
-		// Normalise
-		Hx /= Hx(2);
-
-		Vector3f Hxprime = H.inverse() * xprime;
-		Hxprime /= Hxprime(2);
-
-		// Use total reprojection error
-		// This is L2(x' - Hx) + L2(x - Hinverse x')
-		auto projectiveDiff = xprime - Hx;
-		auto reprojectiveDiff = x - Hxprime;
-		float totalError = projectiveDiff.norm() + reprojectiveDiff.norm();
-		if (totalError < POSITIONAL_UNCERTAINTY * RANSAC_INLIER_MULTIPLER)
+		if (SymmetricTransferError(H, Hinv, matches.x[i], matches.y[i], matches.xPrime[i], matches.yPrime[i]) < POSITIONAL_UNCERTAINTY * RANSAC_INLIER_MULTIPLER)
 		{
-			numInliers++;
-			inlierSet.push_back(matches[i]);
+			inliers.push_back(i);
 		}
-		allError += totalError;
 	}
 
-	return inlierSet;
+	return (int)inliers.size();
 }
 
 
@@ -383,154 +383,136 @@ vector<pair<Feature, Feature> > EvaluateHomography(const vector<pair<Feature,Fea
 
 	We ignore covariance for now
 
-	When the outlier error is large, we use Huber. 
-	After this reduces and we want to quickly converge, we switch to Tukey. 
-	These have the same function prototypes, so we just implement this as a cost
-	function pointer that is swapped out.
+	H has nine entries but only eight degrees of freedom, so we fix H(2,2) = 1 and optimise the
+	other eight. That makes this a fixed-size problem for the LM solver in LevenbergMarquardt.h,
+	and JtJ an 8x8 matrix on the stack.
+	In pixel coordinates the entries of H differ in scale by about the square of the image size,
+	and so do the entries of JtJ, which float can't solve accurately. So we optimise the
+	homography between the Hartley-normalised points instead, exactly as in the DLT. The
+	normalisation is a similarity, so the error there is the pixel error times a constant, and
+	the answer is the same.
 */
 // Helper functions
-float ErrorInHomography(const vector<pair<Feature, Feature> >& matches, const Matrix3f& H)
+float ErrorInHomography(const Correspondences& matches, const Matrix3f& H)
 {
+	const float* x = matches.x.data();
+	const float* y = matches.y.data();
+	const float* xPrime = matches.xPrime.data();
+	const float* yPrime = matches.yPrime.data();
 	float error = 0;
-	for (unsigned int i = 0; i < matches.size(); ++i)
+	for (int i = 0; i < NumCorrespondences(matches); ++i)
 	{
-		Vector3f x(matches[i].second.p.x, matches[i].second.p.y, 1);
-		Vector3f xprime(matches[i].first.p.x, matches[i].first.p.y, 1);
-
 		// Get the error term
-		auto projectiveDiff = xprime - H * x;
-		error += projectiveDiff.norm();
+		const float w = H(2, 0)*x[i] + H(2, 1)*y[i] + H(2, 2);
+		const float dx = xPrime[i] - (H(0, 0)*x[i] + H(0, 1)*y[i] + H(0, 2)) / w;
+		const float dy = yPrime[i] - (H(1, 0)*x[i] + H(1, 1)*y[i] + H(1, 2)) / w;
+		error += sqrt(dx*dx + dy*dy);
 	}
 
 	return error;
 }
-// Actual function
-void BundleAdjustment(const vector<pair<Feature, Feature> >& matches, Matrix3f& H)
+// The eight free entries of H, row by row, with H(2,2) = 1
+typedef Matrix<float, 8, 1> HomographyParams;
+Matrix3f HomographyFromParams(const HomographyParams& h)
 {
-	// L-M update parameter
-	float lambda =  .001f;
-	float prevError = 100000000; // Some massive number so that our first error is always acceptable
-	for (int its = 0; its < MAX_BA_ITERATIONS; ++its)
-	{
-		unsigned int i = 0;
-
-		// These first two loops exist only to compute the standard deviation
-		// for the huber and tukey cost functions
-
-		// Get error vector, std dev vector, and Hx vector
-		vector<Vector2f> errors;
-		float avg = 0;
-		float stddev = 0;
-		vector<Vector3f> hxVals;
-		for (i = 0; i < matches.size(); ++i)
-		{
-			// As above, first is x, the point on the right,
-			// and second is x', the point on the left
-			Vector3f x(matches[i].second.p.x, matches[i].second.p.y, 1);
-			Vector3f xprime(matches[i].first.p.x, matches[i].first.p.y, 1);
-
-			// Get the error term
-			Vector3f Hx = H * x;
-			float w = Hx(2);
-			Hx /= w;
-			Vector3f e = xprime - Hx;
-			Vector2f e2(e(0), e(1));
-
-			errors.push_back(e2);
-			hxVals.push_back(Hx);
-
-			avg += e2.norm();
-		}
-		avg /= matches.size();
+	Matrix3f H;
+	H << h(0), h(1), h(2),
+		 h(3), h(4), h(5),
+		 h(6), h(7), 1;
+	return H;
+}
 
-		// Now compute the std dev
-		for (i = 0; i < errors.size(); ++i)
-		{
-			stddev += pow(errors[i].norm() - avg, 2);
-		}
-		stddev = sqrt(stddev);
+// Reprojection error of x' against Hx, with both sets of points normalised on the fly by
+// x -> scale * (x - centre), so there's nothing to copy
+struct HomographyLMProblem
+{
+	static const int NumParams = 8;
 
+	const Correspondences& matches;
+	float scale;
+	Point2f centre;
+	float scalePrime;
+	Point2f centrePrime;
 
-		VectorXf update(9);
-		float error_accum = 0;
-		MatrixXf JtJ(9, 9);
+	float Accumulate(const HomographyParams& h, Matrix<float, 8, 8>& JtJ, HomographyParams& Jte) const
+	{
 		JtJ.setZero();
-		VectorXf Jte(9);
 		Jte.setZero();
-
-		// This loop is the actual refinement
-		for (i = 0; i < matches.size(); ++i)
+		float cost = 0;
+		Matrix<float, 2, 8> J;
+		for (int i = 0; i < NumCorrespondences(matches); ++i)
 		{
-			// As above, first is x, the point on the right,
-			// and second is x', the point on the left
-			Vector3f x(matches[i].second.p.x, matches[i].second.p.y, 1);
-			Vector3f xprime(matches[i].first.p.x, matches[i].first.p.y, 1);
-
-			// Get the error term
-			Vector3f Hx = H * x;
-			float w = Hx(2);
-			Hx /= w;
-			Vector3f e = xprime - Hx;
-			const Vector2f e2(e(0), e(1));
-
-			float costWeight = 1.f;
-			float objectiveValue = 0.f;
-			// use a robust cost function, but only if we need to
-			/*if (i > 5)
-				Huber(errors[i].norm(), stddev, objectiveValue, costWeight);
-			else
-				Tukey(errors[i].norm(), stddev, objectiveValue, costWeight);*/
-
-			// Build the Jacobian
-			MatrixXf J(2, 9);
-			J.setZero();
-			// We've confirmed by Finite Diff that this Jacobian is correct
-			J << x(0), x(1), x(2), 0, 0, 0, -Hx(0)*x(0), -Hx(0)*x(1), -Hx(0),
-				0, 0, 0, x(0), x(1), x(2), -Hx(1)*x(0), -Hx(1)*x(1), -Hx(1);
+			const float x = scale * (matches.x[i] - centre.x);
+			const float y = scale * (matches.y[i] - centre.y);
+			const float xPrime = scalePrime * (matches.xPrime[i] - centrePrime.x);
+			const float yPrime = scalePrime * (matches.yPrime[i] - centrePrime.y);
+
+			const float w = h(6)*x + h(7)*y + 1;
+			const float u = (h(0)*x + h(1)*y + h(2)) / w;
+			const float v = (h(3)*x + h(4)*y + h(5)) / w;
+			const Vector2f e(xPrime - u, yPrime - v);
+
+			// We've confirmed by Finite Diff that this Jacobian is correct.
+			// It's the usual one without the column for H(2,2)
+			J << x, y, 1, 0, 0, 0, -u*x, -u*y,
+				 0, 0, 0, x, y, 1, -v*x, -v*y;
 			J /= w;
 
-			// Accumulate
-			JtJ += costWeight * J.transpose() * J;
-			Jte += costWeight * J.transpose() * e2;
-
-			error_accum += e2.norm();
+			JtJ.noalias() += J.transpose() * J;
+			Jte.noalias() += J.transpose() * e;
+			cost += e.squaredNorm();
 		}
+		return cost;
+	}
 
-		// Levenberg-Marquardt update
-		for (i = 0; i < JtJ.rows(); ++i)
+	float Cost(const HomographyParams& h) const
+	{
+		float cost = 0;
+		for (int i = 0; i < NumCorrespondences(matches); ++i)
 		{
-			JtJ(i, i) += lambda * JtJ(i, i);
+			const float x = scale * (matches.x[i] - centre.x);
+			const float y = scale * (matches.y[i] - centre.y);
+			const float xPrime = scalePrime * (matches.xPrime[i] - centrePrime.x);
+			const float yPrime = scalePrime * (matches.yPrime[i] - centrePrime.y);
+
+			const float w = h(6)*x + h(7)*y + 1;
+			const float du = xPrime - (h(0)*x + h(1)*y + h(2)) / w;
+			const float dv = yPrime - (h(3)*x + h(4)*y + h(5)) / w;
+			cost += du*du + dv*dv;
 		}
+		return cost;
+	}
+};
+// Actual function
+void BundleAdjustment(const Correspondences& matches, Matrix3f& H)
+{
+	const int n = NumCorrespondences(matches);
+	Matrix3f T, TPrime;
+	if (n < 4 ||
+		!NormalisingTransform(n, [&](const int i) { return Point2f(matches.x[i], matches.y[i]); }, T) ||
+		!NormalisingTransform(n, [&](const int i) { return Point2f(matches.xPrime[i], matches.yPrime[i]); }, TPrime))
+	{
+		return;
+	}
 
-		// Compute the update
-		update = JtJ.inverse() * Jte;
-		Matrix3f updateToH;
-		updateToH << update(0), update(1), update(2),
-			update(3), update(4), update(5),
-			update(6), update(7), update(8);
+	// Move H into normalised coordinates, and scale it so that H(2,2) = 1 there
+	Matrix3f Hn = TPrime * H * T.inverse();
+	if (Hn(2, 2) == 0)
+	{
+		return;
+	}
+	Hn /= Hn(2, 2);
+	HomographyParams h;
+	h << Hn(0, 0), Hn(0, 1), Hn(0, 2), Hn(1, 0), Hn(1, 1), Hn(1, 2), Hn(2, 0), Hn(2, 1);
 
-		float currError = error_accum;
+	// T is scale * (x - centre), so the centre is -T(0,2) / scale
+	const HomographyLMProblem problem = { matches, T(0, 0), Point2f(-T(0, 2) / T(0, 0), -T(1, 2) / T(0, 0)),
+		                                  TPrime(0, 0), Point2f(-TPrime(0, 2) / TPrime(0, 0), -TPrime(1, 2) / TPrime(0, 0)) };
+	const LMSettings settings = { MAX_BA_ITERATIONS, 0, LM_MIN_RELATIVE_DECREASE, LM_MIN_RELATIVE_STEP };
+	LevenbergMarquardt(problem, settings, h);
 
-		// Early cutoff if our error is low enough
-		if (currError < BA_THRESHOLD)
-		{
-			break;
-		}
-		// Update and continue if good enough
-		if (currError < prevError)
-		{
-			lambda /= 10;
-			prevError = currError;	
-		}
-		else
-		{
-			lambda *= 10;
-		}
-
-		H += updateToH;
-		H /= H(2, 2);		
-	}
-	return;
+	H = TPrime.inverse() * HomographyFromParams(h) * T;
+	H /= H(2, 2);
 }
 
 /*
@@ -552,9 +534,13 @@ void BundleAdjustment(const vector<pair<Feature, Feature> >& matches, Matrix3f&
 	be tuned as necessary. 
 	Usually a robust measure of spread is used in preference to the standard deviation of
 	the residuals. For example, a common approach is to take sigma = MAR/0.6745, where MAR is
-	the median absolute residual. This is because std dev is computationally expensive, requiring
-	square roots and multiple passes over the data. I'm going to use the true std dev, because here
-	I don't care about computation time.
+	the median absolute residual. The std dev itself gets dragged up by the very outliers we're
+	trying to ignore, and needs a second pass over the data. So we use the median, which
+	nth_element finds in linear time without sorting. Our residuals are 2D distances rather than
+	signed 1D errors, hence the different constant, see Estimation.h.
+
+	Cauchy sits between the two. Its weight falls off like 1/e^2, so a gross outlier counts for
+	almost nothing, but it never hits zero, so it can still recover from a poor start.
 */
 void Huber(const float& e, const float& stddev, float& objectiveValue, float& weight)
 {
@@ -584,6 +570,46 @@ void Tukey(const float& e, const float& stddev, float& objectiveValue, float& we
 		weight = 0;
 	}
 }
+void Cauchy(const float& e, const float& stddev, float& objectiveValue, float& weight)
+{
+	float k = CAUCHY_K * stddev;
+	float r = e / k;
+	objectiveValue = 0.5f * k * k * log(1 + r * r);
+	weight = 1.f / (1 + r * r);
+}
+
+void RobustCost(const RobustLoss loss, const float e, const float stddev, float& objectiveValue, float& weight)
+{
+	switch (loss)
+	{
+	case LOSS_HUBER:
+		Huber(e, stddev, objectiveValue, weight);
+		break;
+	case LOSS_TUKEY:
+		Tukey(e, stddev, objectiveValue, weight);
+		break;
+	case LOSS_CAUCHY:
+		Cauchy(e, stddev, objectiveValue, weight);
+		break;
+	default:
+		objectiveValue = 0.5f*e*e;
+		weight = 1.f;
+		break;
+	}
+}
+
+float MedianScale(vector<float>& residuals)
+{
+	if (residuals.empty())
+	{
+		return POSITIONAL_UNCERTAINTY;
+	}
+	auto middle = residuals.begin() + residuals.size() / 2;
+	nth_element(residuals.begin(), middle, residuals.end());
+	// A perfect fit would give a zero scale, and then every residual is an outlier.
+	// Nothing is measured better than our positional uncertainty anyway
+	return max(*middle * MEDIAN_RESIDUAL_TO_STDDEV, POSITIONAL_UNCERTAINTY);
+}
 
 /*
 	The purpose of this is to compute the difference between:
@@ -641,293 +667,1028 @@ void FiniteDiff(const Matrix3f& H)
 	cout << J - difference << endl;
 }
 
+/*
+	The same check for the projection in calibration refinement. Each intrinsic parameter, and each
+	direction of a left update of the pose, is nudged both ways, and the change in the projected
+	point is compared against the analytic Jacobians. Central differences are accurate to the
+	square of the nudge, which float needs with the board a long way from the camera
+*/
+template <typename Real>
+void FiniteDiffProjection(const Calibration& c, const Vector3f& X)
+{
+	typedef Matrix<Real, 3, 3> Matrix3;
+	typedef Matrix<Real, 3, 1> Vector3;
+	typedef Matrix<Real, 2, 1> Vector2;
+	const Matrix3 K0 = c.K.cast<Real>();
+	const DistortionVectorT<Real> distortion0 = c.distortion.cast<Real>();
+	const Matrix3 R0 = c.R.cast<Real>();
+	const Vector3 t0 = c.t.cast<Real>();
+	const Vector3 X0 = X.cast<Real>();
+
+	IntrinsicJacobian<Real> J_K;
+	PoseJacobian<Real> J_P;
+	ProjectPointWithJacobians(K0, distortion0, R0, t0, X0, J_K, J_P);
+
+	const Real e = 0.01f;
+	IntrinsicJacobian<Real> differenceK;
+	for (int i = 0; i < NUM_INTRINSIC_PARAMS; ++i)
+	{
+		IntrinsicVector<Real> update = IntrinsicVector<Real>::Zero();
+		update(i) = e;
+		Matrix3 K = K0;
+		DistortionVectorT<Real> distortion = distortion0;
+		ApplyIntrinsicUpdate(update, K, distortion);
+		const Vector2 forward = ProjectPoint(K, distortion, R0, t0, X0);
+		K = K0;
+		distortion = distortion0;
+		update = -update;
+		ApplyIntrinsicUpdate(update, K, distortion);
+		const Vector2 back = ProjectPoint(K, distortion, R0, t0, X0);
+		differenceK.col(i) = (forward - back) / (2 * e);
+	}
+
+	PoseJacobian<Real> differenceP;
+	for (int j = 0; j < NUM_POSE_PARAMS; ++j)
+	{
+		PoseVector<Real> update = PoseVector<Real>::Zero();
+		update(j) = e;
+		Matrix3 forwardR = R0, backR = R0;
+		Vector3 forwardT = t0, backT = t0;
+		UpdatePose(update, forwardR, forwardT);
+		update = -update;
+		UpdatePose(update, backR, backT);
+		differenceP.col(j) = (ProjectPoint(K0, distortion0, forwardR, forwardT, X0) -
+			                  ProjectPoint(K0, distortion0, backR, backT, X0)) / (2 * e);
+	}
+
+	// The differences should be vanishing
+	cout << "J_K: " << endl << J_K << endl;
+	cout << "Finite difference: " << endl << differenceK << endl;
+	cout << J_K - differenceK << endl;
+	cout << "J_P: " << endl << J_P << endl;
+	cout << "Finite difference: " << endl << differenceP << endl;
+	cout << J_P - differenceP << endl;
+}
+
 /*
 	Use RANSAC to estimate a line from a set of points. 
 
 	InlierSetSize is the minimum size a set of inliers can be
 	maxError is the maximum distance between a pixel and the line before it isn't an inlier
-	seedPoints are the two points, as a pair, used to find the line
-
-	Returned is the inlier set, empty if no line could be found
+	confidence is how sure we want to be that there's no such line, before giving up
+	maxIts caps the number of hypotheses, whatever the confidence says
+	line is the line found, normalised so that ax + by + c is the distance to it
+	isInlier gets one entry per point, nonzero for the inliers of the line found
+
+	Returned is the number of inliers, 0 if no line could be found
+
+	We stop at the first line that's good enough, so the number of iterations needed comes
+	from the smallest acceptable line, and when there are fewer than that many points left we
+	don't have to try at all. See Ransac.h. 
+	There's no T(d,d) test here. Each side of a quad has only a quarter of the points, so a good
+	line would fail it most of the time, and scoring is cheap anyway: the points are copied once
+	into float x and y arrays, and each block is one pass of the batch line kernels in Lines.h
 */
 // Helper functions
-float distToLine(Point p, pair<Point, Point> line)
+struct LineRansacProblem
 {
-	// derive the equation of the line?
-	int a = line.second.y - line.first.y;
-	int b = line.first.x - line.second.x;
-	int c = -1 * line.first.x*a - line.first.y*b;
+	typedef Line2f Model;
+	static const int SampleSize = 2;
 
-	float d = abs(a*p.x + b*p.y + c) / sqrt(a*a + b*b);
-	return d;
-}
-// Actual function
-vector<Point> FindLineInPointsRANSAC(const vector<Point>& points, const int inlierSetSize,
-	const int maxError, const int its, std::pair<cv::Point, cv::Point>& seedPoints)
-{
-	vector<Point> inliers;
-	srand(time(NULL));
+	const float* xs;
+	const float* ys;
+	int length;
+	float maxError;
 
-	// Over the given number of iterations
-	const int length = points.size();
-	if (length < 2)
+	int NumData() const
 	{
-		return inliers;
+		return length;
 	}
-	for (int i = 0; i < its; ++i)
+	bool Fit(const int* sample, Model& line) const
 	{
-		// Pick two random nonequal indices
-		int i1 = rand() % length;
-		int i2 = 0;
-		do
-		{
-			i2 = rand() % length;
-		} while (i2 == i1);
-
-		// Form a line with these points
-		seedPoints.first = points[i1];
-		seedPoints.second = points[i2];
+		line = Normalised(LineThroughPoints(xs[sample[0]], ys[sample[0]], xs[sample[1]], ys[sample[1]]));
+		return line.a != 0 || line.b != 0;
+	}
+	bool IsInlier(const Model& line, const int i) const
+	{
+		return abs(EvaluateLine(line, xs[i], ys[i])) <= maxError;
+	}
+	int CountInliers(const Model& line, const int begin, const int end) const
+	{
+		return CountPointsNearLine(line, xs + begin, ys + begin, end - begin, maxError);
+	}
+};
+// Actual function
+int FindLineInPointsRANSAC(const vector<Point>& points, const int inlierSetSize,
+	const float maxError, const float confidence, const int maxIts, Line2f& line,
+	vector<uchar>& isInlier, mt19937& rng)
+{
+	const int length = points.size();
+	isInlier.assign(length, 0);
 
-		// Enforce a minimum distance between these points to avoid
-		// minute errors turning into large errors with angles in small lines
-		//???
+	vector<float> xs(length), ys(length);
+	for (int i = 0; i < length; ++i)
+	{
+		xs[i] = (float)points[i].x;
+		ys[i] = (float)points[i].y;
+	}
 
-		// Check all other points. If they are within maxError of the line,
-		// then add them to the inlier set
-		for (auto& p : points)
-		{
-			float d = distToLine(p, seedPoints);
-			if (d <= maxError)
-			{
-				inliers.push_back(p);
-			}
-		}
-		//cout << ". Inliers - " << inliers.size() << endl;
-		// If the inlier set is big enough, stop and set the seed points
-		if (inliers.size() >= inlierSetSize)
-		{
-			break;
-		}
-		
-		// Otherwise, clear the inlier set and repeat
-		inliers.clear();
+	const LineRansacProblem problem = { xs.data(), ys.data(), length, maxError };
+	const RansacParams params = { confidence, maxIts, max(inlierSetSize, 2), 0 };
+	vector<int> inliers;
+	const int numInliers = Ransac(problem, params, rng, line, inliers);
+	for (const int i : inliers)
+	{
+		isInlier[i] = 1;
 	}
 
-	return inliers;
+	return numInliers;
 }
 
 
-// Unit test dist to line and RANSAC line on horizontal and vertical lines
+// Unit test the line kernels and RANSAC line on horizontal and vertical lines
 void TestDistToLine()
 {
-	Point a(60,56);
-	Point b(40,56);
-
-	auto line = pair<Point, Point>(a, b);
-	Point c(30,56);
-	auto val = distToLine(c, line);
-	assert(val <= 1);
-	Point d(-1, 1);
-	assert(distToLine(d, line) == 1);
-	Point e(0, 1);
-	assert(distToLine(e, line) == 0);
+	const Line2f horizontal = LineThroughPoints(Point2f(60, 56), Point2f(40, 56));
+	assert(SignedDistToLine(horizontal, Point2f(30, 56)) == 0);
+	assert(abs(SignedDistToLine(horizontal, Point2f(-1, 1))) == 55);
+	assert(abs(SignedDistToLine(horizontal, Point2f(0, 57))) == 1);
+	assert(!OnSameSideOfLine(horizontal, Point2f(0, 57), Point2f(0, 55)));
+	assert(OnSameSideOfLine(horizontal, Point2f(0, 57), Point2f(100, 99)));
+
+	const Line2d vertical = LineThroughPoints(Point2d(3, 0), Point2d(3, 10));
+	Point2d crossing;
+	assert(IntersectLines(LineThroughPoints(Point2d(60, 56), Point2d(40, 56)), vertical, crossing));
+	assert(crossing.x == 3 && crossing.y == 56);
+	assert(!IntersectLines(vertical, LineThroughPoints(Point2d(7, 1), Point2d(7, 2)), crossing));
 }
 
 void TestRANSACLine()
 {
+	mt19937 rng(0);
 	vector<Point> points;
 	for (int i = 0; i < 50; ++i)
 	{
 		points.push_back(Point(i,0));
 	}
-	for (int i = 0; i < 50; i += rand() % points.size() + 5)
+	for (int i = 0; i < 50; i += rng() % points.size() + 5)
 	{
 		points.push_back(Point(i, 1));
 	}
-	for (int i = 0; i < 50; i += rand() % points.size() + 5)
+	for (int i = 0; i < 50; i += rng() % points.size() + 5)
 	{
 		points.push_back(Point(i, 2));
 	}
 
-	pair<Point, Point> seedPoints;
-	auto inliers = FindLineInPointsRANSAC(points, 50, 1, 50, seedPoints);
-	assert(inliers.size() >= 50);
+	Line2f line;
+	vector<uchar> isInlier;
+	auto numInliers = FindLineInPointsRANSAC(points, 50, 1, 0.99f, 50, line, isInlier, rng);
+	assert(numInliers >= 50);
 
 }
 
 /*
-	Refine our calibration estimate.
-	This uses Levenberg-Marquardt optimisation, and for now just refines the pose parameters 
-	for each checkerboard plane, and the camera matrix parameters over all checkerboards. 
-
-	We represent the pose of the checkerboard with an SE(3) element, and update this with a 
-	left exponential update
+	Block-sparse normal equations for calibration refinement.
+
+	The full JtJ is (10 + 6N) square for N images, but each observation only touches the intrinsics
+	and the pose of its own image. So JtJ is zero everywhere except the intrinsic block, the
+	diagonal pose blocks, and the blocks that cross between the intrinsics and each pose.
+	We keep only those. 
+
+	To solve, we use the Schur complement. Eliminating the poses from
+	    [ U   W ] [ dK ]   [ bK ]
+	    [ Wt  V ] [ dP ] = [ bP ]
+	gives
+	    (U - W V^-1 Wt) dK = bK - W V^-1 bP
+	which is just a 10x10 system, and V is block diagonal so V^-1 is one 6x6 solve per pose.
+	Then each pose update is dP_n = V_n^-1 (bP_n - W_nt dK). 
+	This is all linear in the number of images, in both time and memory. 
+
+	Each observation's Jacobian products are formed in Real, where they're only a few terms each,
+	and only added into the sums in Accum.
+
+	See http://ethaneade.com/optimization.pdf, or Triggs et al, Bundle Adjustment - A Modern Synthesis,
+	section 6.1
 */
-bool RefineCalibration(std::vector<Calibration>& estimates, std::map<int, Quad> gtQuadMap)
+template <typename Accum>
+void ResetNormalEquations(CalibrationNormalEquations<Accum>& eqs, const int numPoses)
 {
-	// Assumed: that estimates is of size at least three
-	//          that there are 32 gt quads
-	Matrix3f K = estimates[0].K;
-
-	// L-M update parameter
-	float lambda = 1.f;
-	float prevError = 100000000; // Some massive number so that our first error is always acceptable
-	// Update all the estimates with the new parameters
-	float currError = 0;
-	for (int its = 0; its < MAX_BA_ITERATIONS; ++its)
+	eqs.U.setZero();
+	eqs.bK.setZero();
+	eqs.V.assign(numPoses, PoseBlock<Accum>::Zero());
+	eqs.W.assign(numPoses, CrossBlock<Accum>::Zero());
+	eqs.bP.assign(numPoses, PoseVector<Accum>::Zero());
+}
+
+template <typename Real, typename Accum>
+void AccumulateObservation(CalibrationNormalEquations<Accum>& eqs, const int pose, const IntrinsicJacobian<Real>& J_K,
+	                       const PoseJacobian<Real>& J_P, const Matrix<Real, 2, 1>& e, const float weight)
+{
+	const Matrix<Real, NUM_INTRINSIC_PARAMS, 2> wJ_Kt = (Real)weight * J_K.transpose();
+	const Matrix<Real, NUM_POSE_PARAMS, 2> wJ_Pt = (Real)weight * J_P.transpose();
+	eqs.U += (wJ_Kt * J_K).template cast<Accum>();
+	eqs.bK += (wJ_Kt * e).template cast<Accum>();
+	eqs.V[pose] += (wJ_Pt * J_P).template cast<Accum>();
+	eqs.W[pose] += (wJ_Kt * J_P).template cast<Accum>();
+	eqs.bP[pose] += (wJ_Pt * e).template cast<Accum>();
+}
+
+template <typename Accum>
+bool SolveNormalEquations(const CalibrationNormalEquations<Accum>& eqs, const Accum lambda, IntrinsicVector<Accum>& updateK,
+	                      AlignedVector<PoseVector<Accum> >& updateP)
+{
+	const int numPoses = eqs.V.size();
+	updateP.assign(numPoses, PoseVector<Accum>::Zero());
+
+	// Levenberg-Marquardt damping on the diagonal
+	IntrinsicBlock<Accum> S = eqs.U;
+	S.diagonal() *= (1 + lambda);
+	IntrinsicVector<Accum> rhs = eqs.bK;
+
+	// Each damped pose block gets factored once, and used again for the back substitution
+	AlignedVector<LDLT<PoseBlock<Accum> > > poseSolvers(numPoses);
+	for (int n = 0; n < numPoses; ++n)
 	{
-		// create the jacobian matrix
-		// create the update vector
-		// These each have to accomodate udpates for each pose
-		// for each image. 
-		// So:
-		// 6x calibration params
-		// 6 vector update per image
-		// To come: distortion params
-		// J_K is 2 by 5
-		// J_P is 3 x 6
-		// so 2 + 3 x num estimates by 6
-		// Therefore JtJ is square 2 + 3 x num estimates
-		// updates is JtJ long
-		// JtJ will be pretty sparse
-		int numParams = 5 + 6 * estimates.size();
-		MatrixXf JtJ(numParams, numParams);
-		JtJ.setZero();
-		VectorXf Jte(numParams);
-		Jte.setZero();
-		VectorXf update(numParams);
+		// A pose with no observations can't be updated
+		if (eqs.V[n].isZero())
+		{
+			continue;
+		}
+
+		PoseBlock<Accum> Vn = eqs.V[n];
+		Vn.diagonal() *= (1 + lambda);
+		poseSolvers[n].compute(Vn);
+		if (poseSolvers[n].info() != Success)
+		{
+			return false;
+		}
+
+		// Y = W_n V_n^-1, computed as (V_n^-1 W_nt)t since V_n is symmetric
+		CrossBlock<Accum> Y = poseSolvers[n].solve(eqs.W[n].transpose()).transpose();
+		S -= Y * eqs.W[n].transpose();
+		rhs -= Y * eqs.bP[n];
+	}
+
+	// Solve the reduced camera system for the intrinsics
+	// S may not be well conditioned, so use a pivoting solver rather than an inverse.
+	// The intrinsics are in very different units, from focal lengths in the hundreds to distortion
+	// terms that barely move a point, so first scale S to a unit diagonal. Otherwise the
+	// invertibility test, which is relative to the largest pivot, rejects it outright
+	IntrinsicVector<Accum> scale;
+	for (int i = 0; i < NUM_INTRINSIC_PARAMS; ++i)
+	{
+		scale(i) = S(i, i) > 0 ? 1 / sqrt(S(i, i)) : 1;
+	}
+	FullPivLU<IntrinsicBlock<Accum> > lu(scale.asDiagonal() * S * scale.asDiagonal());
+	if (!lu.isInvertible())
+	{
+		return false;
+	}
+	updateK = scale.asDiagonal() * lu.solve(scale.asDiagonal() * rhs);
+
+	// Back substitute for the poses
+	for (int n = 0; n < numPoses; ++n)
+	{
+		if (eqs.V[n].isZero())
+		{
+			continue;
+		}
+		updateP[n] = poseSolvers[n].solve(eqs.bP[n] - eqs.W[n].transpose() * updateK);
+	}
+
+	return true;
+}
+
+/*
+	Projection of a point on the board into the image.
+
+	The board point X goes through the pose to Xc = RX + t in the camera frame, and onto the
+	normalised image plane at (x, y) = (Xc/Zc, Yc/Zc). The lens then distorts it, with Brown's
+	model, as OpenCV has it:
+	    r^2 = x^2 + y^2
+	    radial = 1 + k1 r^2 + k2 r^4 + k3 r^6
+	    xd = x radial + 2 p1 x y + p2 (r^2 + 2 x^2)
+	    yd = y radial + p1 (r^2 + 2 y^2) + 2 p2 x y
+	and finally K takes (xd, yd) to pixels:
+	    u = fx xd + s yd + cx
+	    v = fy yd + cy
+
+	The Jacobians follow the same chain backwards. By the intrinsics, u and v are linear in K,
+	and linear in the distortion through (xd, yd). By the pose, a left update by (u, w) moves Xc
+	by u + w x Xc, so dXc = [I | -[Xc]x], and this goes through the perspective division, the
+	distortion, and the top left 2x2 of K.
+	These are checked against finite differences in FiniteDiffProjection.
+
+	See Zhang section 3.3, and Hartley and Zisserman chapter 7.4
+*/
+template <typename Real>
+Matrix<Real, 2, 1> ProjectPointWithJacobians(const Matrix<Real, 3, 3>& K, const DistortionVectorT<Real>& distortion,
+	                                         const Matrix<Real, 3, 3>& R, const Matrix<Real, 3, 1>& t,
+	                                         const Matrix<Real, 3, 1>& X,
+	                                         IntrinsicJacobian<Real>& J_K, PoseJacobian<Real>& J_P)
+{
+	const Real k1 = distortion(0);
+	const Real k2 = distortion(1);
+	const Real p1 = distortion(2);
+	const Real p2 = distortion(3);
+	const Real k3 = distortion(4);
+
+	const Matrix<Real, 3, 1> Xc = R * X + t;
+	const Real invZ = 1 / Xc(2);
+	const Real x = Xc(0) * invZ;
+	const Real y = Xc(1) * invZ;
+
+	const Real r2 = x*x + y*y;
+	const Real r4 = r2*r2;
+	const Real r6 = r4*r2;
+	const Real radial = 1 + k1*r2 + k2*r4 + k3*r6;
+	const Real xd = x*radial + 2*p1*x*y + p2*(r2 + 2*x*x);
+	const Real yd = y*radial + p1*(r2 + 2*y*y) + 2*p2*x*y;
+
+	// The part of K that the distorted point goes through
+	Matrix<Real, 2, 2> A;
+	A << K(0, 0), K(0, 1),
+		0, K(1, 1);
+
+	// By fx, fy, s, cx, cy
+	J_K.setZero();
+	J_K(0, 0) = xd;
+	J_K(1, 1) = yd;
+	J_K(0, 2) = yd;
+	J_K(0, 3) = 1;
+	J_K(1, 4) = 1;
+
+	// By k1, k2, p1, p2, k3, going through A
+	Matrix<Real, 2, NUM_DISTORTION_PARAMS> D;
+	D << x*r2, x*r4, 2*x*y, r2 + 2*x*x, x*r6,
+		y*r2, y*r4, r2 + 2*y*y, 2*x*y, y*r6;
+	J_K.template block<2, NUM_DISTORTION_PARAMS>(0, NUM_CAMERA_PARAMS) = A * D;
+
+	// Distorted point by the undistorted one
+	const Real dRadial = 2 * (k1 + 2*k2*r2 + 3*k3*r4);
+	Matrix<Real, 2, 2> Dd;
+	Dd << radial + x*x*dRadial + 2*p1*y + 6*p2*x, x*y*dRadial + 2*p1*x + 2*p2*y,
+		x*y*dRadial + 2*p1*x + 2*p2*y, radial + y*y*dRadial + 6*p1*y + 2*p2*x;
+
+	// Perspective division by the camera frame point
+	Matrix<Real, 2, 3> Dn;
+	Dn << invZ, 0, -x*invZ,
+		0, invZ, -y*invZ;
+
+	// Camera frame point by the left update
+	Matrix<Real, 3, NUM_POSE_PARAMS> Dx;
+	Dx << 1, 0, 0, 0, Xc(2), -Xc(1),
+		0, 1, 0, -Xc(2), 0, Xc(0),
+		0, 0, 1, Xc(1), -Xc(0), 0;
+
+	J_P = A * Dd * Dn * Dx;
+
+	return Matrix<Real, 2, 1>(K(0, 0)*xd + K(0, 1)*yd + K(0, 2), K(1, 1)*yd + K(1, 2));
+}
+
+template <typename Real>
+Matrix<Real, 2, 1> ProjectPoint(const Matrix<Real, 3, 3>& K, const DistortionVectorT<Real>& distortion,
+	                            const Matrix<Real, 3, 3>& R, const Matrix<Real, 3, 1>& t, const Matrix<Real, 3, 1>& X)
+{
+	IntrinsicJacobian<Real> J_K;
+	PoseJacobian<Real> J_P;
+	return ProjectPointWithJacobians(K, distortion, R, t, X, J_K, J_P);
+}
 
-		float error_accum = 0;
+/*
+	Build the normal equations for a single image.
+
+	Each image only contributes to its own pose blocks, so images can be accumulated
+	independently of each other, and only the intrinsic blocks need summing across them.
 
-		// Over each estimate
-		for (int n = 0; n < estimates.size(); ++n)
+	Each observation is weighted by iteratively reweighted least squares: the loss gives a weight
+	for the size of its residual, and the observation goes into the normal equations that many
+	times over. A misnumbered quad lands a whole square away, so it gets a tiny weight, or none
+*/
+template <typename Real, typename Accum>
+Accum AccumulateCalibrationEstimate(const Calibration& c, const CalibrationParams<Real>& params, const int frame,
+	                                const map<int, Quad>& gtQuadMap, const RobustLoss loss, const float scale,
+	                                CalibrationNormalEquations<Accum>& eqs, const int pose, vector<float>& residuals)
+{
+	Accum error_accum = 0;
+
+	IntrinsicJacobian<Real> J_K;
+	PoseJacobian<Real> J_P;
+	// Over each quad within the estimate
+	for (int m = 0; m < c.quads.size(); ++m)
+	{
+		Point2f m_ij = c.quads[m].centre;
+		auto result = gtQuadMap.find(c.quads[m].number);
+		if (result == gtQuadMap.end())
 		{
-			Calibration& c = estimates[n];
-			// Over each quad within the estimate
-			for (int m = 0; m < c.quads.size(); ++m)
+			continue;
+		}
+		Point2f M_j = result->second.centre;
+
+		const Matrix<Real, 2, 1> f = ProjectPointWithJacobians(params.K, params.distortion, params.R[frame], params.t[frame],
+			                                                   Matrix<Real, 3, 1>(M_j.x, M_j.y, 0), J_K, J_P);
+		const Matrix<Real, 2, 1> e = Matrix<Real, 2, 1>(m_ij.x, m_ij.y) - f;
+
+		// Weight by the loss, and accumulate jacobians
+		const float distance = (float)e.norm();
+		float objectiveValue, weight;
+		RobustCost(loss, distance, scale, objectiveValue, weight);
+		AccumulateObservation(eqs, pose, J_K, J_P, e, weight);
+
+		// accumulate error this iteration
+		error_accum += objectiveValue;
+		residuals.push_back(distance);
+	}
+
+	return error_accum;
+}
+
+// Each of the intrinsic updates just add
+template <typename Real>
+void ApplyIntrinsicUpdate(const IntrinsicVector<Real>& update, Matrix<Real, 3, 3>& K, DistortionVectorT<Real>& distortion)
+{
+	K(0, 0) += update(0);
+	K(1, 1) += update(1);
+	K(0, 1) += update(2);
+	K(0, 2) += update(3);
+	K(1, 2) += update(4);
+	distortion += update.template tail<NUM_DISTORTION_PARAMS>();
+}
+
+/*
+	Update a pose with a left exponential update
+	The following comes from Section 3.2, equations 77 to 84 of Ethan Eade's lie.pdf,
+	http://ethaneade.com/lie.pdf
+*/
+template <typename Real>
+void UpdatePose(const PoseVector<Real>& update, Matrix<Real, 3, 3>& R, Matrix<Real, 3, 1>& t)
+{
+	typedef Matrix<Real, 3, 3> Matrix3;
+	typedef Matrix<Real, 3, 1> Vector3;
+	Vector3 u(update(0), update(1), update(2));
+	Vector3 w(update(3), update(4), update(5));
+	Matrix3 I;
+	I.setIdentity();
+
+	Real theta = w.norm();
+	Real A = 1;
+	Real B = 0.5;
+	Real C = (Real)1 / 6;
+	// For tiny rotations (and poses that got no update), use the limits of these as theta goes to 0
+	if (theta > 1e-6)
+	{
+		A = sin(theta) / theta;
+		B = (1 - cos(theta)) / (theta*theta);
+		C = (1 - A) / (theta*theta);
+	}
+
+	Matrix3 w_skew;
+	w_skew << 0, -w(2), w(1),
+		w(2), 0, -w(0),
+		-w(1), w(0), 0;
+
+	Matrix3 dR = I + A * w_skew + B * w_skew*w_skew;
+	Matrix3 V = I + B * w_skew + C * w_skew*w_skew;
+
+	R = dR * R;
+	t = dR * t + V * u;
+}
+
+/*
+	One pass over all the observations, at the current parameters.
+
+	Building the normal equations is split across the thread pool: the images are cut into batches,
+	and each task fills in the pose blocks for its own batch of images, plus its own partial sums of
+	the intrinsic blocks. The partial sums are then added up in batch order, so the result is the
+	same no matter how many threads there are or what order they finish in.
+	Each frame's share of the intrinsic blocks is kept too, so that a frame can be taken back out
+	of the sums later without another pass. Frames that aren't active are skipped
+*/
+template <typename Real, typename Accum>
+void AccumulatePass(const vector<Calibration>& estimates, const CalibrationParams<Real>& params,
+	                const map<int, Quad>& gtQuadMap, const RobustLoss loss, const float scale,
+	                const vector<uchar>& frameActive, ThreadPool& pool, RefinementPass<Accum>& pass)
+{
+	const int numEstimates = estimates.size();
+	const int numBatches = (numEstimates + REFINEMENT_IMAGES_PER_TASK - 1) / REFINEMENT_IMAGES_PER_TASK;
+	AlignedVector<CalibrationNormalEquations<Accum> > batchEqs(numBatches);
+	vector<vector<float> > batchResiduals(numBatches);
+	vector<future<Accum> > batchErrors(numBatches);
+	vector<int> frameCount(numEstimates, 0);
+	pass.frameU.resize(numEstimates);
+	pass.frameBK.resize(numEstimates);
+
+	// The parameters are:
+	// 5 calibration params
+	// 5 distortion params
+	// 6 vector update per image
+	// J_K is 2 by 10
+	// J_P is 2 by 6
+	// Only the blocks of JtJ that these touch are kept, see above
+	for (int b = 0; b < numBatches; ++b)
+	{
+		batchErrors[b] = pool.Enqueue([&, b]() {
+			const int begin = b * REFINEMENT_IMAGES_PER_TASK;
+			const int end = min(begin + REFINEMENT_IMAGES_PER_TASK, numEstimates);
+			CalibrationNormalEquations<Accum>& partial = batchEqs[b];
+			ResetNormalEquations(partial, end - begin);
+			Accum error = 0;
+			for (int n = begin; n < end; ++n)
 			{
-				Point2f m_ij = c.quads[m].centre;
-				auto result = gtQuadMap.find(c.quads[m].number);
-				if (result == gtQuadMap.end())
+				pass.frameU[n].setZero();
+				pass.frameBK[n].setZero();
+				if (!frameActive[n])
 				{
 					continue;
 				}
-				Point2f M_j = result->second.centre;
-
-				Vector3f vM_j(M_j.x, M_j.y, 0);
-				Vector3f rx = c.R * vM_j + c.t; // This is an interim calculation stage for the error that makes everything later easier
-				Vector3f f = K * rx;
-				f /= f(2); // normalise
-
-				Vector3f e(m_ij.x, m_ij.y, 1);
-				e = e - f;
-
-				// Build the Jacobian
-				//     ( rx[0]   0   rx[1] rx[2]   0   |       | 
-				// J = (   0   rx[1]   0     0   rx[2] |  I_3  | -f skew ... per estimate
-				//     (   0     0     0     0     0   |       |  
-				MatrixXf J(3, numParams);
-				J.setZero();
-				int dP = 5 + n * 6;
-				J(0, 0) = rx[0];
-				J(1, 1) = rx[1];
-				J(0, 2) = rx[1];
-				J(0, 3) = rx[2];
-				J(1, 4) = rx[2];
-				J(0, dP) = 1;
-				J(1, dP + 1) = 1;
-				J(2, dP + 2) = 1;
-				J(1, dP + 3) = -f(2);
-				J(2, dP + 3) = f(1);
-				J(0, dP + 4) = f(2);
-				J(2, dP + 4) = -f(0);
-				J(0, dP + 5) = -f(1);
-				J(1, dP + 5) = f(0);
-
-				// Accumulate jacobians
-				JtJ += J.transpose() * J;
-				Jte += J.transpose() * e;
-
-				// accumulate error this iteration
-				error_accum += e.norm();
+				const IntrinsicBlock<Accum> U = partial.U;
+				const IntrinsicVector<Accum> bK = partial.bK;
+				const int count = batchResiduals[b].size();
+				error += AccumulateCalibrationEstimate(estimates[n], params, n, gtQuadMap, loss, scale,
+					                                   partial, n - begin, batchResiduals[b]);
+				pass.frameU[n] = partial.U - U;
+				pass.frameBK[n] = partial.bK - bK;
+				frameCount[n] = batchResiduals[b].size() - count;
 			}
+			return error;
+		});
+	}
+
+	// Reduce, in batch order
+	ResetNormalEquations(pass.eqs, numEstimates);
+	pass.residuals.clear();
+	pass.error = 0;
+	for (int b = 0; b < numBatches; ++b)
+	{
+		pass.error += batchErrors[b].get();
+		const CalibrationNormalEquations<Accum>& partial = batchEqs[b];
+		pass.eqs.U += partial.U;
+		pass.eqs.bK += partial.bK;
+		const int begin = b * REFINEMENT_IMAGES_PER_TASK;
+		for (int n = 0; n < partial.V.size(); ++n)
+		{
+			pass.eqs.V[begin + n] = partial.V[n];
+			pass.eqs.W[begin + n] = partial.W[n];
+			pass.eqs.bP[begin + n] = partial.bP[n];
 		}
+		pass.residuals.insert(pass.residuals.end(), batchResiduals[b].begin(), batchResiduals[b].end());
+	}
+	pass.frameStart.assign(numEstimates + 1, 0);
+	for (int n = 0; n < numEstimates; ++n)
+	{
+		pass.frameStart[n + 1] = pass.frameStart[n] + frameCount[n];
+	}
+}
 
-		// Levenberg-Marquardt update
-		for (int i = 0; i < JtJ.rows(); ++i)
+// Total objective of some residuals under a loss
+template <typename Accum>
+Accum SumObjective(const RobustLoss loss, const float scale, const vector<float>& residuals, const int begin, const int end)
+{
+	Accum sum = 0;
+	for (int i = begin; i < end; ++i)
+	{
+		float objectiveValue, weight;
+		RobustCost(loss, residuals[i], scale, objectiveValue, weight);
+		sum += objectiveValue;
+	}
+	return sum;
+}
+
+// Re-estimate the scale from the accepted residuals, and rescore the accepted pass at it,
+// so that the next step is compared like for like
+template <typename Real, typename Accum>
+void Rescale(const RobustLoss loss, RefinementState<Real, Accum>& state)
+{
+	if (loss == LOSS_L2)
+	{
+		return;
+	}
+	vector<float> residuals(state.accepted.residuals);
+	state.scale = MedianScale(residuals);
+	state.accepted.error = SumObjective<Accum>(loss, state.scale, state.accepted.residuals, 0, state.accepted.residuals.size());
+	cout << "Residual scale: " << state.scale << endl;
+}
+
+template <typename Real, typename Accum>
+void ResetRefinementState(RefinementState<Real, Accum>& state, const int numFrames)
+{
+	state.params.R.clear();
+	state.params.t.clear();
+	state.accepted.error = 0;
+	state.frameActive.assign(numFrames, 1);
+	state.lambda = REFINEMENT_INITIAL_LAMBDA;
+	state.scale = POSITIONAL_UNCERTAINTY;
+	state.valid = false;
+}
+
+template <typename Real, typename Accum>
+void AddFrameToRefinementState(RefinementState<Real, Accum>& state, const Calibration& c)
+{
+	state.params.R.push_back(c.R.cast<Real>());
+	state.params.t.push_back(c.t.cast<Real>());
+	state.frameActive.push_back(1);
+	state.valid = false;
+}
+
+template <typename Accum>
+float FrameRMS(const RefinementPass<Accum>& pass, const int frame)
+{
+	const int begin = pass.frameStart[frame];
+	const int end = pass.frameStart[frame + 1];
+	if (end == begin)
+	{
+		return 0;
+	}
+	float sum = 0;
+	for (int i = begin; i < end; ++i)
+	{
+		sum += pass.residuals[i] * pass.residuals[i];
+	}
+	return sqrt(sum / (end - begin));
+}
+
+/*
+	Per-frame outlier rejection.
+	The robust loss deals with the odd bad quad, but a frame with a bad homography, or one where
+	the numbering has slipped, is wrong everywhere, and a robust loss can't tell that from a
+	frame with a lot of noise. So each frame is scored by its RMS residual, and frames far above
+	the median frame are dropped, worst first, as long as there are enough left to calibrate.
+
+	Dropping a frame doesn't need a new pass. Its pose blocks are zeroed, which takes its pose out
+	of the problem, and its share of the intrinsic blocks and the cost is subtracted. Refinement
+	then carries on from the same place. The damping is reset, since the problem has changed
+*/
+template <typename Real, typename Accum>
+int RejectOutlierFrames(const RobustLoss loss, RefinementState<Real, Accum>& state)
+{
+	RefinementPass<Accum>& pass = state.accepted;
+	vector<int> frames;
+	vector<float> rms;
+	for (int n = 0; n < state.frameActive.size(); ++n)
+	{
+		if (state.frameActive[n] && pass.frameStart[n + 1] > pass.frameStart[n])
 		{
-			JtJ(i, i) += lambda * JtJ(i, i);
+			frames.push_back(n);
+			rms.push_back(FrameRMS(pass, n));
 		}
+	}
+	if (rms.size() <= MIN_REFINEMENT_FRAMES)
+	{
+		return 0;
+	}
+
+	vector<float> sorted(rms);
+	auto middle = sorted.begin() + sorted.size() / 2;
+	nth_element(sorted.begin(), middle, sorted.end());
+	const float threshold = max(FRAME_REJECTION_FACTOR * *middle, FRAME_REJECTION_MIN_RMS);
 
-		// Compute the update
-		// JtJ inverse may not always exist ... may need the pseudoinverse
-		// in which case we can do LDLt 
-		update = JtJ.inverse() * Jte;
+	// Worst first
+	vector<int> order(rms.size());
+	for (int k = 0; k < order.size(); ++k)
+	{
+		order[k] = k;
+	}
+	sort(order.begin(), order.end(), [&](const int a, const int b) { return rms[a] > rms[b]; });
 
-		currError = error_accum;
-		cout << "Current error: " << currError << endl;
+	int numActive = rms.size();
+	int dropped = 0;
+	for (const int k : order)
+	{
+		if (rms[k] <= threshold || numActive <= MIN_REFINEMENT_FRAMES)
+		{
+			break;
+		}
+		const int n = frames[k];
+		cout << "Dropping frame " << n << ", RMS residual " << rms[k] << endl;
+		state.frameActive[n] = 0;
+		pass.eqs.U -= pass.frameU[n];
+		pass.eqs.bK -= pass.frameBK[n];
+		pass.eqs.V[n].setZero();
+		pass.eqs.W[n].setZero();
+		pass.eqs.bP[n].setZero();
+		pass.error -= SumObjective<Accum>(loss, state.scale, pass.residuals, pass.frameStart[n], pass.frameStart[n + 1]);
+		numActive--;
+		dropped++;
+	}
+
+	if (dropped > 0)
+	{
+		state.lambda = REFINEMENT_INITIAL_LAMBDA;
+	}
+	return dropped;
+}
+
+
+template <typename Real, typename Accum>
+bool RefineCalibration(std::vector<Calibration>& estimates, const std::map<int, Quad>& gtQuadMap, const RobustLoss loss,
+	                   RefinementState<Real, Accum>& state, ThreadPool& pool)
+{
+	// Assumed: that estimates is of size at least three
+	//          that gtQuadMap has every checker of the board, by number
+	CalibrationParams<Real>& params = state.params;
+	const int numEstimates = estimates.size();
+
+	if (!state.valid)
+	{
+		// Warm started, we already have a scale for the loss. Otherwise there's nothing to scale
+		// it by until we've seen the residuals, so the first pass is plain least squares
+		RobustLoss firstLoss = loss;
+		if (params.R.size() != numEstimates)
+		{
+			firstLoss = LOSS_L2;
+
+			// Start from the estimates, in the precision we're refining in
+			params.K = estimates[0].K.cast<Real>();
+			params.distortion = estimates[0].distortion.cast<Real>();
+			params.R.resize(numEstimates);
+			params.t.resize(numEstimates);
+			for (int n = 0; n < numEstimates; ++n)
+			{
+				params.R[n] = estimates[n].R.cast<Real>();
+				params.t[n] = estimates[n].t.cast<Real>();
+			}
+		}
+
+		AccumulatePass(estimates, params, gtQuadMap, firstLoss, state.scale, state.frameActive, pool, state.accepted);
+		cout << "Current error: " << state.accepted.error << endl;
+		Rescale(loss, state);
+		state.valid = true;
+	}
+
+	// The parameters before each step, to go back to if it doesn't work
+	CalibrationParams<Real> prev;
+	RefinementPass<Accum> trial;
+	IntrinsicVector<Accum> updateK;
+	AlignedVector<PoseVector<Accum> > updateP;
+	for (int its = 0; its < MAX_BA_ITERATIONS; ++its)
+	{
 		// Early cutoff if our error is low enough
-		if (currError < BA_THRESHOLD)
+		if (state.accepted.error < BA_THRESHOLD)
 		{
 			cout << "Error low early" << endl;
-
 			break;
 		}
-		// Update and continue if good enough
-		if (currError < prevError)
+
+		// Compute the Levenberg-Marquardt update
+		if (!SolveNormalEquations(state.accepted.eqs, state.lambda, updateK, updateP))
 		{
-			lambda /= 10;
-			prevError = currError;
+			cout << "Normal equations are singular" << endl;
+			return false;
+		}
 
-			cout << "Improving, lambda = " << lambda << endl;
+		Accum updateNorm = updateK.squaredNorm();
+		for (auto& u : updateP)
+		{
+			updateNorm += u.squaredNorm();
+		}
+		cout << "Update vector: " << sqrt(updateNorm) << endl;
+
+		prev = params;
+
+		// Now pull out the little bits of each update and apply them
+		const IntrinsicVector<Real> stepK = updateK.template cast<Real>();
+		ApplyIntrinsicUpdate(stepK, params.K, params.distortion);
+
+		// update the poses
+		for (int n = 0; n < numEstimates; ++n)
+		{
+			const PoseVector<Real> stepP = updateP[n].template cast<Real>();
+			UpdatePose(stepP, params.R[n], params.t[n]);
+		}
+
+		AccumulatePass(estimates, params, gtQuadMap, loss, state.scale, state.frameActive, pool, trial);
+		cout << "Current error: " << trial.error << endl;
+		if (trial.error < state.accepted.error)
+		{
+			// Accept, and keep this pass
+			const Accum decrease = state.accepted.error - trial.error;
+			const Accum prevError = state.accepted.error;
+			swap(state.accepted, trial);
+			state.lambda /= 10;
+			cout << "Improving, lambda = " << state.lambda << endl;
+			Rescale(loss, state);
+			if (decrease <= REFINEMENT_MIN_RELATIVE_DECREASE * prevError)
+			{
+				cout << "Converged" << endl;
+				break;
+			}
 		}
 		else
 		{
-			lambda *= 10;
+			// Undo the step, and try a smaller one
+			state.lambda *= 10;
+			cout << "Not improving, lambda = " << state.lambda << endl;
+			swap(params, prev);
+			if (state.lambda > LM_MAX_LAMBDA)
+			{
+				break;
+			}
+		}
+	}
+
+	// Hand the result back in float
+	estimates[0].K = params.K.template cast<float>();
+	estimates[0].distortion = params.distortion.template cast<float>();
+	for (int n = 0; n < numEstimates; ++n)
+	{
+		estimates[n].R = params.R[n].template cast<float>();
+		estimates[n].t = params.t[n].template cast<float>();
+	}
+
+	return true;
+}
+
+template <typename Real, typename Accum>
+bool RefineCalibrationImpl(std::vector<Calibration>& estimates, const std::map<int, Quad>& gtQuadMap, const RobustLoss loss,
+	                       ThreadPool& pool)
+{
+	RefinementState<Real, Accum> state;
+	ResetRefinementState(state, estimates.size());
+	return RefineCalibration(estimates, gtQuadMap, loss, state, pool);
+}
+
+/*
+	Solve, score each frame, drop the outliers, and re-solve, warm started from the last solve.
+	Each round only costs the few iterations it takes to settle after losing the bad frames
+*/
+template <typename Real, typename Accum>
+bool RefineCalibrationRejectingFramesImpl(std::vector<Calibration>& estimates, const std::map<int, Quad>& gtQuadMap,
+	                                      const RobustLoss loss, ThreadPool& pool)
+{
+	RefinementState<Real, Accum> state;
+	ResetRefinementState(state, estimates.size());
+	if (!RefineCalibration(estimates, gtQuadMap, loss, state, pool))
+	{
+		return false;
+	}
 
-			cout << "Not improving, lambda = " << lambda << endl;
+	for (int round = 0; round < MAX_FRAME_REJECTION_ROUNDS; ++round)
+	{
+		if (RejectOutlierFrames(loss, state) == 0)
+		{
+			break;
 		}
+		if (!RefineCalibration(estimates, gtQuadMap, loss, state, pool))
+		{
+			return false;
+		}
+	}
 
-		cout << "Update vector: " << update.norm() << endl;
+	return true;
+}
 
-		// Now pull out the little bits of each update and apply them
-		// Each of the calibration updates just add
-		K(0, 0) += update(0);
-		K(1, 1) += update(1);
-		K(0, 1) += update(2);
-		K(0, 2) += update(3);
-		K(1, 2) += update(4);
-
-		// update the poses with a left exponential update
-		// The following comes from Section 3.2, equations 77 to 84 of Ethan Eade's lie.pdf,
-		// http://ethaneade.com/lie.pdf
-		for (int n = 0; n < estimates.size(); ++n)
+/*
+	Online calibration.
+	Until Zhang can be solved, frames just go into its accumulator. The first time it can be, its K
+	gives every frame so far a pose, and refinement starts from there. After that, each new frame
+	gets its pose from its homography and the current intrinsics, and joins the refinement where
+	the last frame left it, so each frame only costs the few iterations it takes to take it in.
+	If refinement fails, we go back to Zhang's K with everything seen so far, and start again,
+	keeping the last K that refinement gave until there's a new one
+*/
+template <typename Real, typename Accum>
+void ResetOnlineCalibration(OnlineCalibration<Real, Accum>& online)
+{
+	ResetZhangAccumulator(online.zhang);
+	online.estimates.clear();
+	ResetRefinementState(online.refinement, 0);
+	online.initialised = false;
+	online.K.setZero();
+	online.distortion.setZero();
+	online.calibrated = false;
+}
+
+template <typename Real, typename Accum>
+bool AddFrameToOnlineCalibration(OnlineCalibration<Real, Accum>& online, const Calibration& frame,
+	                             const std::map<int, Quad>& gtQuadMap, const RobustLoss loss, ThreadPool& pool, bool& kept)
+{
+	online.estimates.push_back(frame);
+	kept = true;
+
+	if (!online.initialised)
+	{
+		AddHomographyToZhang(online.zhang, frame.H, frame.size);
+		Matrix3f K;
+		if (online.estimates.size() < MIN_REFINEMENT_FRAMES || !SolveZhang(online.zhang, K))
 		{
-			Calibration& c = estimates[n];
-			Vector3f u(update(5 + 6 * n), update(5 + 6 * n + 1), update(5 + 6 * n + 2));
-			Vector3f w(update(5 + 6 * n + 3), update(5 + 6 * n + 4), update(5 + 6 * n + 5));
-			Matrix3f I;
-			I.setIdentity();
-
-			float theta = sqrt(w.transpose()*w);
-			float A = sin(theta) / theta;
-			float B = (1 - cos(theta)) / (theta*theta);
-			float C = (1 - A) / (theta*theta);
-
-			Matrix3f w_skew;
-			w_skew << 0, -w(2), w(1),
-				w(2), 0, -w(0),
-				-w(1), w(0), 0;
-			
-			Matrix3f R = I + A * w_skew + B * w_skew*w_skew;
-			Matrix3f V = I + B * w_skew + C * w_skew*w_skew;
+			return false;
+		}
+		cout << "Initial K: " << endl << K << endl;
 
-			c.R = R * c.R;
-			c.t = R * c.t + V * u;
+		for (Calibration& c : online.estimates)
+		{
+			c.K = K;
+			c.distortion.setZero();
+			if (!PoseFromHomography(K, c))
+			{
+				return false;
+			}
 		}
+		ResetRefinementState(online.refinement, online.estimates.size());
+		online.initialised = true;
+	}
+	else
+	{
+		// The new frame starts from the intrinsics so far
+		Calibration& c = online.estimates.back();
+		c.K = online.estimates[0].K;
+		c.distortion = online.estimates[0].distortion;
+		if (!PoseFromHomography(c.K, c))
+		{
+			online.estimates.pop_back();
+			kept = false;
+			return false;
+		}
+		// Zhang has to have exactly the frames we keep, in case we start again from it
+		AddHomographyToZhang(online.zhang, c.H, c.size);
+		AddFrameToRefinementState(online.refinement, c);
 	}
 
-	estimates[0].K = K;
+	const bool refined = RefineCalibration(online.estimates, gtQuadMap, loss, online.refinement, pool) &&
+		(RejectOutlierFrames(loss, online.refinement) == 0 ||
+		 RefineCalibration(online.estimates, gtQuadMap, loss, online.refinement, pool));
+	if (!refined)
+	{
+		cout << "Refinement failed, starting again from Zhang" << endl;
+		online.initialised = false;
+	}
+	// The new frame might have been rejected as an outlier
+	kept = OnlineFrameKept(online, online.estimates.size() - 1);
+	if (!refined)
+	{
+		return false;
+	}
 
+	online.K = online.estimates[0].K;
+	online.distortion = online.estimates[0].distortion;
+	online.calibrated = true;
 	return true;
-}
\ No newline at end of file
+}
+
+template <typename Real, typename Accum>
+bool OnlineFrameKept(const OnlineCalibration<Real, Accum>& online, const int n)
+{
+	// Until refinement starts, every frame goes to Zhang
+	return !online.initialised || online.refinement.frameActive[n];
+}
+
+// Actual functions
+bool RefineCalibration(std::vector<Calibration>& estimates, const std::map<int, Quad>& gtQuadMap, const RobustLoss loss,
+	                   const CalibrationPrecision precision, ThreadPool& pool)
+{
+	switch (precision)
+	{
+	case PRECISION_FLOAT:
+		return RefineCalibrationImpl<float, float>(estimates, gtQuadMap, loss, pool);
+	case PRECISION_MIXED:
+		return RefineCalibrationImpl<float, double>(estimates, gtQuadMap, loss, pool);
+	default:
+		return RefineCalibrationImpl<double, double>(estimates, gtQuadMap, loss, pool);
+	}
+}
+
+bool RefineCalibrationRejectingFrames(std::vector<Calibration>& estimates, const std::map<int, Quad>& gtQuadMap,
+	                                  const RobustLoss loss, const CalibrationPrecision precision, ThreadPool& pool)
+{
+	switch (precision)
+	{
+	case PRECISION_FLOAT:
+		return RefineCalibrationRejectingFramesImpl<float, float>(estimates, gtQuadMap, loss, pool);
+	case PRECISION_MIXED:
+		return RefineCalibrationRejectingFramesImpl<float, double>(estimates, gtQuadMap, loss, pool);
+	default:
+		return RefineCalibrationRejectingFramesImpl<double, double>(estimates, gtQuadMap, loss, pool);
+	}
+}
+
+// The precisions we build, for callers that hold their own state
+template bool RefineCalibration<float, float>(std::vector<Calibration>&, const std::map<int, Quad>&, const RobustLoss,
+	                                          RefinementState<float, float>&, ThreadPool&);
+template bool RefineCalibration<float, double>(std::vector<Calibration>&, const std::map<int, Quad>&, const RobustLoss,
+	                                           RefinementState<float, double>&, ThreadPool&);
+template bool RefineCalibration<double, double>(std::vector<Calibration>&, const std::map<int, Quad>&, const RobustLoss,
+	                                            RefinementState<double, double>&, ThreadPool&);
+template void ResetOnlineCalibration<float, float>(OnlineCalibration<float, float>&);
+template void ResetOnlineCalibration<float, double>(OnlineCalibration<float, double>&);
+template void ResetOnlineCalibration<double, double>(OnlineCalibration<double, double>&);
+template bool AddFrameToOnlineCalibration<float, float>(OnlineCalibration<float, float>&, const Calibration&,
+	                                                    const std::map<int, Quad>&, const RobustLoss, ThreadPool&, bool&);
+template bool AddFrameToOnlineCalibration<float, double>(OnlineCalibration<float, double>&, const Calibration&,
+	                                                     const std::map<int, Quad>&, const RobustLoss, ThreadPool&, bool&);
+template bool AddFrameToOnlineCalibration<double, double>(OnlineCalibration<double, double>&, const Calibration&,
+	                                                      const std::map<int, Quad>&, const RobustLoss, ThreadPool&, bool&);
+template bool OnlineFrameKept<float, float>(const OnlineCalibration<float, float>&, const int);
+template bool OnlineFrameKept<float, double>(const OnlineCalibration<float, double>&, const int);
+template bool OnlineFrameKept<double, double>(const OnlineCalibration<double, double>&, const int);
+template void ResetRefinementState<float, float>(RefinementState<float, float>&, const int);
+template void ResetRefinementState<float, double>(RefinementState<float, double>&, const int);
+template void ResetRefinementState<double, double>(RefinementState<double, double>&, const int);
+template int RejectOutlierFrames<float, float>(const RobustLoss, RefinementState<float, float>&);
+template int RejectOutlierFrames<float, double>(const RobustLoss, RefinementState<float, double>&);
+template int RejectOutlierFrames<double, double>(const RobustLoss, RefinementState<double, double>&);
+template Vector2f ProjectPoint<float>(const Matrix3f&, const DistortionVectorT<float>&, const Matrix3f&, const Vector3f&,
+	                                  const Vector3f&);
+template Vector2d ProjectPoint<double>(const Matrix3d&, const DistortionVectorT<double>&, const Matrix3d&, const Vector3d&,
+	                                   const Vector3d&);
+template void FiniteDiffProjection<float>(const Calibration&, const Eigen::Vector3f&);
+template void FiniteDiffProjection<double>(const Calibration&, const Eigen::Vector3f&);
\ No newline at end of file
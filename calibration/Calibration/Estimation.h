@@ -4,50 +4,290 @@
 #include <opencv2/highgui.hpp>
 #include <vector>
 #include <utility>
+#include <random>
 #include "Features.h"
 #include "Calibration.h"
 #include "Image.h"
+#include "ThreadPool.h"
+#include "Lines.h"
+#include "Ransac.h"
+#include "LevenbergMarquardt.h"
 #include <Eigen/Dense>
 
 #define MAX_RANSAC_ITERATIONS 5000
+#define RANSAC_CONFIDENCE 0.995f
+#define RANSAC_PRETEST_SIZE 1
 #define RANSAC_INLIER_MULTIPLER 2.447f
 #define POSITIONAL_UNCERTAINTY 0.1f
 #define MAX_BA_ITERATIONS 20
 #define BA_THRESHOLD (1e-03)
 
+// The intrinsics are the five of K, then the distortion
+#define NUM_CAMERA_PARAMS 5
+#define NUM_INTRINSIC_PARAMS (NUM_CAMERA_PARAMS + NUM_DISTORTION_PARAMS)
+#define NUM_POSE_PARAMS 6
+// Images are split into fixed-size batches for accumulating the normal equations in parallel.
+// The batches don't depend on the number of threads, so neither does the result
+#define REFINEMENT_IMAGES_PER_TASK 8
+#define REFINEMENT_INITIAL_LAMBDA 1.f
+// Refinement has converged when a step improves the cost by less than this fraction. The cost is a
+// float sum over every observation, so much below this and we'd be chasing rounding
+#define REFINEMENT_MIN_RELATIVE_DECREASE 1e-4f
+// A frame is dropped from refinement when its RMS residual is this many times the median frame's,
+// and is more than the minimum, so that we don't throw out frames for being slightly less perfect
+#define FRAME_REJECTION_FACTOR 3.f
+#define FRAME_REJECTION_MIN_RMS 1.f
+#define MAX_FRAME_REJECTION_ROUNDS 3
+#define MIN_REFINEMENT_FRAMES 3
+
 #define HUBER_K 1.345f
 #define TUKEY_K 4.685
+#define CAUCHY_K 2.3849f
+// Refinement residuals are distances in 2D. Under Gaussian noise these are Rayleigh distributed,
+// and the median of that is sigma * sqrt(2 ln 2)
+#define MEDIAN_RESIDUAL_TO_STDDEV 0.8493f
+#define REFINEMENT_LOSS LOSS_HUBER
 
-/* Estimation Functions */
-bool FindHomography(Eigen::Matrix3f& homography, std::vector<std::pair<Feature, Feature> > matches);
+/*
+	Point correspondences x -> x', for estimating a transform that takes each x to its x'.
+	The coordinates are stored as separate arrays so that loops over them only touch the floats
+	they use, and can be vectorised. Descriptors aren't needed once the matching is done, so
+	they stay behind in the Features
+*/
+struct Correspondences
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> xPrime;
+	std::vector<float> yPrime;
+};
+
+int NumCorrespondences(const Correspondences& c);
+void AddCorrespondence(Correspondences& c, const cv::Point2f& p, const cv::Point2f& pPrime);
+
+// We match from left to right, and the homography goes from right to left,
+// so the second feature of each match is x and the first is x'
+void CorrespondencesFromMatches(const std::vector<std::pair<Feature, Feature> >& matches, Correspondences& c);
 
-// Normalise points
-std::pair<Eigen::Matrix3f, Eigen::Matrix3f> ConvertPoints(const std::vector<std::pair<Feature, Feature> >& matches);
+// The correspondences at the given indices, in that order
+void SelectCorrespondences(const Correspondences& all, const std::vector<int>& indices, Correspondences& subset);
 
-// Estimate Homography
-bool GetHomographyFromMatches(const std::vector<std::pair<cv::Point, cv::Point>> points, Eigen::Matrix3f& H);
-bool GetHomographyFromMatches(const std::vector<std::pair<cv::Point2f, cv::Point2f>> points, Eigen::Matrix3f& H);
+/* Estimation Functions */
+// The RNG is passed in so that each task can own its own, and so results are reproducible
+bool FindHomography(Eigen::Matrix3f& homography, const Correspondences& matches, std::mt19937& rng);
+
+// Estimate Homography, taking each x to its x'. The points are normalised inside.
+// The four point version is for RANSAC, and allocates nothing
+bool GetHomographyFromFourMatches(const cv::Point2f from[4], const cv::Point2f to[4], Eigen::Matrix3f& H);
+bool GetHomographyFromMatches(const Correspondences& matches, Eigen::Matrix3f& H);
 
 
-// Evaluate Homography
-std::vector<std::pair<Feature, Feature> > EvaluateHomography(const std::vector<std::pair<Feature, Feature> >& matches, const Eigen::Matrix3f& H);
-float ErrorInHomography(const std::vector<std::pair<Feature, Feature> >& matches, const Eigen::Matrix3f& H);
+// Evaluate Homography. Returns the number of inliers, and fills in their indices
+int EvaluateHomography(const Correspondences& matches, const Eigen::Matrix3f& H, std::vector<int>& inliers);
+float ErrorInHomography(const Correspondences& matches, const Eigen::Matrix3f& H);
 
-// Bundle Adjustment
-void BundleAdjustment(const std::vector<std::pair<Feature, Feature> >& matches, Eigen::Matrix3f& H);
+// Bundle Adjustment. Refines H to minimise the reprojection error of x' against Hx, by LM.
+// This allocates nothing, so it's fine to call per frame
+void BundleAdjustment(const Correspondences& matches, Eigen::Matrix3f& H);
 
 // Robust cost functions
+enum RobustLoss
+{
+	LOSS_L2,
+	LOSS_HUBER,
+	LOSS_TUKEY,
+	LOSS_CAUCHY
+};
 void Huber(const float& e, const float& stddev, float& objectiveValue, float& weight);
 void Tukey(const float& e, const float& stddev, float& objectiveValue, float& weight);
+void Cauchy(const float& e, const float& stddev, float& objectiveValue, float& weight);
+
+// The objective and the IRLS weight of a residual under any of the losses
+void RobustCost(const RobustLoss loss, const float e, const float stddev, float& objectiveValue, float& weight);
+
+// Robust standard deviation of a set of residual distances, from their median. Reorders them
+float MedianScale(std::vector<float>& residuals);
 
 // Unit tests
 void FiniteDiff(const Eigen::Matrix3f& H);
+template <typename Real>
+void FiniteDiffProjection(const Calibration& c, const Eigen::Vector3f& X);
 void TestDistToLine();
 void TestRANSACLine();
 
-// Estimate a line from a series of points
-std::vector<cv::Point> FindLineInPointsRANSAC(const std::vector<cv::Point>& points, const int inlierSetSize,
-	                                          const int maxError, const int its, std::pair<cv::Point, cv::Point>& seedPoints);
+// Estimate a line from a series of points. Returns the number of inliers, which are marked in isInlier
+int FindLineInPointsRANSAC(const std::vector<cv::Point>& points, const int inlierSetSize,
+	                       const float maxError, const float confidence, const int maxIts,
+	                       Line2f& line, std::vector<uchar>& isInlier, std::mt19937& rng);
+
+/*
+	Normal equations for calibration refinement, stored block-sparse.
+	The parameter vector is the intrinsics followed by one pose per image, and since no
+	observation touches two poses, JtJ only has the intrinsic block U, a block V per pose on the
+	diagonal, and the intrinsic-pose cross blocks W. Everything else is zero, so we don't store it.
+
+	    [ U    W_1  W_2  ... ]        [ bK   ]
+	    [ W_1t V_1   0   ... ]  and   [ bP_1 ]
+	    [ W_2t  0   V_2  ... ]        [ bP_2 ]
+*/
+template <typename T> using IntrinsicBlock = Eigen::Matrix<T, NUM_INTRINSIC_PARAMS, NUM_INTRINSIC_PARAMS>;
+template <typename T> using PoseBlock = Eigen::Matrix<T, NUM_POSE_PARAMS, NUM_POSE_PARAMS>;
+template <typename T> using CrossBlock = Eigen::Matrix<T, NUM_INTRINSIC_PARAMS, NUM_POSE_PARAMS>;
+template <typename T> using IntrinsicVector = Eigen::Matrix<T, NUM_INTRINSIC_PARAMS, 1>;
+template <typename T> using PoseVector = Eigen::Matrix<T, NUM_POSE_PARAMS, 1>;
+template <typename T> using AlignedVector = std::vector<T, Eigen::aligned_allocator<T> >;
+
+template <typename Accum>
+struct CalibrationNormalEquations
+{
+	IntrinsicBlock<Accum> U;
+	IntrinsicVector<Accum> bK;
+	AlignedVector<PoseBlock<Accum> > V;
+	AlignedVector<CrossBlock<Accum> > W;
+	AlignedVector<PoseVector<Accum> > bP;
+
+	// U is a fixed-size vectorisable block, so these have to be allocated aligned
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+template <typename Accum>
+void ResetNormalEquations(CalibrationNormalEquations<Accum>& eqs, const int numPoses);
+
+template <typename T> using IntrinsicJacobian = Eigen::Matrix<T, 2, NUM_INTRINSIC_PARAMS>;
+template <typename T> using PoseJacobian = Eigen::Matrix<T, 2, NUM_POSE_PARAMS>;
+template <typename T> using DistortionVectorT = Eigen::Matrix<T, NUM_DISTORTION_PARAMS, 1>;
+
+// The parameters being refined: the intrinsics, and a pose per image
+template <typename Real>
+struct CalibrationParams
+{
+	Eigen::Matrix<Real, 3, 3> K;
+	DistortionVectorT<Real> distortion;
+	std::vector<Eigen::Matrix<Real, 3, 3> > R;
+	std::vector<Eigen::Matrix<Real, 3, 1> > t;
+};
+
+// Project a point on the board into the image, through the pose, then the distortion, then K
+template <typename Real>
+Eigen::Matrix<Real, 2, 1> ProjectPoint(const Eigen::Matrix<Real, 3, 3>& K, const DistortionVectorT<Real>& distortion,
+	                                   const Eigen::Matrix<Real, 3, 3>& R, const Eigen::Matrix<Real, 3, 1>& t,
+	                                   const Eigen::Matrix<Real, 3, 1>& X);
+
+// The same, with the Jacobians of the projection by the intrinsics, and by a left update of the pose
+template <typename Real>
+Eigen::Matrix<Real, 2, 1> ProjectPointWithJacobians(const Eigen::Matrix<Real, 3, 3>& K, const DistortionVectorT<Real>& distortion,
+	                                                const Eigen::Matrix<Real, 3, 3>& R, const Eigen::Matrix<Real, 3, 1>& t,
+	                                                const Eigen::Matrix<Real, 3, 1>& X,
+	                                                IntrinsicJacobian<Real>& J_K, PoseJacobian<Real>& J_P);
+
+// Add an update to the intrinsics, in the order fx, fy, s, cx, cy, then the distortion
+template <typename Real>
+void ApplyIntrinsicUpdate(const IntrinsicVector<Real>& update, Eigen::Matrix<Real, 3, 3>& K, DistortionVectorT<Real>& distortion);
+
+// Update a pose with a left exponential update
+template <typename Real>
+void UpdatePose(const PoseVector<Real>& update, Eigen::Matrix<Real, 3, 3>& R, Eigen::Matrix<Real, 3, 1>& t);
+
+// Add one observation's Jacobian blocks and error to the normal equations for the given pose, with an IRLS weight
+template <typename Real, typename Accum>
+void AccumulateObservation(CalibrationNormalEquations<Accum>& eqs, const int pose, const IntrinsicJacobian<Real>& J_K,
+	                       const PoseJacobian<Real>& J_P, const Eigen::Matrix<Real, 2, 1>& e, const float weight);
+
+// Solve the damped normal equations through the Schur complement on the intrinsics
+template <typename Accum>
+bool SolveNormalEquations(const CalibrationNormalEquations<Accum>& eqs, const Accum lambda, IntrinsicVector<Accum>& updateK,
+	                      AlignedVector<PoseVector<Accum> >& updateP);
+
+// Accumulate all observations from one image, at the parameters of the given frame, into the normal
+// equations as the given pose, weighted by the loss at the given scale. Appends each observation's
+// residual distance to residuals. Returns the total objective over those observations
+template <typename Real, typename Accum>
+Accum AccumulateCalibrationEstimate(const Calibration& c, const CalibrationParams<Real>& params, const int frame,
+	                                const std::map<int, Quad>& gtQuadMap, const RobustLoss loss, const float scale,
+	                                CalibrationNormalEquations<Accum>& eqs, const int pose, std::vector<float>& residuals);
+
+// Everything one pass over the observations gives: the normal equations, each frame's share of
+// the intrinsic blocks, and every residual distance, frame by frame. frameStart[n] is where frame
+// n's residuals start, and the last entry is one past the end. error is the total objective
+template <typename Accum>
+struct RefinementPass
+{
+	CalibrationNormalEquations<Accum> eqs;
+	AlignedVector<IntrinsicBlock<Accum> > frameU;
+	AlignedVector<IntrinsicVector<Accum> > frameBK;
+	std::vector<float> residuals;
+	std::vector<int> frameStart;
+	Accum error;
+};
+
+// Refinement state that carries over from one solve to the next: the parameters and the pass at
+// the last accepted step, the damping, the residual scale there, and which frames are still in
+template <typename Real, typename Accum>
+struct RefinementState
+{
+	CalibrationParams<Real> params;
+	RefinementPass<Accum> accepted;
+	std::vector<uchar> frameActive;
+	Accum lambda;
+	float scale;
+	bool valid;
+};
+
+template <typename Real, typename Accum>
+void ResetRefinementState(RefinementState<Real, Accum>& state, const int numFrames);
+
+// Add a frame to a refinement, keeping the parameters and damping so far. The new frame starts at its own pose.
+// The next refinement redoes its first pass, since the problem has changed
+template <typename Real, typename Accum>
+void AddFrameToRefinementState(RefinementState<Real, Accum>& state, const Calibration& c);
+
+// RMS residual distance of a frame in a pass
+template <typename Accum>
+float FrameRMS(const RefinementPass<Accum>& pass, const int frame);
+
+// Drop frames whose RMS residual is far above the median frame's, and take their contributions out
+// of the accepted normal equations, so that refinement can carry on from where it was.
+// Returns how many were dropped
+template <typename Real, typename Accum>
+int RejectOutlierFrames(const RobustLoss loss, RefinementState<Real, Accum>& state);
+
+// Refine from the state, and leave it at the last accepted step. A fresh state starts from the
+// estimates, and the result goes back into them either way
+template <typename Real, typename Accum>
+bool RefineCalibration(std::vector<Calibration>& estimates, const std::map<int, Quad>& gtQuadMap, const RobustLoss loss,
+	                   RefinementState<Real, Accum>& state, ThreadPool& pool);
+bool RefineCalibration(std::vector<Calibration>& estimates, const std::map<int, Quad>& gtQuadMap, const RobustLoss loss,
+	                   const CalibrationPrecision precision, ThreadPool& pool);
+
+// Refine, drop the outlier frames, and carry on refining without them, until no more frames go
+bool RefineCalibrationRejectingFrames(std::vector<Calibration>& estimates, const std::map<int, Quad>& gtQuadMap,
+	                                  const RobustLoss loss, const CalibrationPrecision precision, ThreadPool& pool);
+
+// Calibration from frames that arrive one at a time: Zhang's accumulator for the initial estimate,
+// every frame so far, and the refinement, which carries on from one frame to the next
+template <typename Real, typename Accum>
+struct OnlineCalibration
+{
+	ZhangAccumulator<Accum> zhang;
+	std::vector<Calibration> estimates;
+	RefinementState<Real, Accum> refinement;
+	bool initialised;
+	// The intrinsics from the last refinement that worked. Starting again from Zhang doesn't lose these
+	Eigen::Matrix3f K;
+	DistortionVector distortion;
+	bool calibrated;
+};
+
+template <typename Real, typename Accum>
+void ResetOnlineCalibration(OnlineCalibration<Real, Accum>& online);
 
+// Add a frame that has its homography and numbered quads. Returns true if there's a new estimate,
+// which is in K and distortion. kept says whether the calibration still has the frame afterwards
+template <typename Real, typename Accum>
+bool AddFrameToOnlineCalibration(OnlineCalibration<Real, Accum>& online, const Calibration& frame,
+	                             const std::map<int, Quad>& gtQuadMap, const RobustLoss loss, ThreadPool& pool, bool& kept);
 
-bool RefineCalibration(std::vector<Calibration>& estimates, std::map<int, Quad> gtQuadMap);
+// Whether the calibration is still using the nth of its estimates. Outlier rejection can drop any
+// of them, and starting again from Zhang brings them all back
+template <typename Real, typename Accum>
+bool OnlineFrameKept(const OnlineCalibration<Real, Accum>& online, const int n);
@@ -0,0 +1,323 @@
+#include "Geometry.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+#define RAD_TO_DEG 57.29577951f
+
+/*
+	Computational geometry on point sets
+
+	Everything here works on a convex hull, since on a hull the extreme points in
+	any direction move round monotonically as the direction turns. That is what lets
+	rotating calipers find the diameter and the minimum rectangle in one lap,
+	instead of comparing every pair of points.
+
+	The integer and float versions share one template. Cross products are done in
+	double so that integer coordinates can't overflow.
+*/
+// Helpers
+template <typename T>
+double Cross(const Point_<T>& o, const Point_<T>& a, const Point_<T>& b)
+{
+	return ((double)a.x - o.x) * ((double)b.y - o.y) - ((double)a.y - o.y) * ((double)b.x - o.x);
+}
+template <typename T>
+double SquaredDist(const Point_<T>& a, const Point_<T>& b)
+{
+	const double x = (double)a.x - b.x;
+	const double y = (double)a.y - b.y;
+	return x*x + y*y;
+}
+template <typename T>
+bool ComparePointsByXThenY(const Point_<T>& a, const Point_<T>& b)
+{
+	return a.x < b.x || (a.x == b.x && a.y < b.y);
+}
+
+/*
+	Andrew's monotone chain
+	Sort the points by x, then walk left to right building the lower hull and right to left
+	building the upper hull. Any point that doesn't make a strict turn gets popped, so
+	collinear points are dropped. O(n log n) for the sort, and linear after that
+*/
+template <typename T>
+void ConvexHullImpl(const vector<Point_<T> >& points, vector<Point_<T> >& hull)
+{
+	hull.clear();
+
+	vector<Point_<T> > sorted(points);
+	sort(sorted.begin(), sorted.end(), ComparePointsByXThenY<T>);
+	sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+
+	const int n = (int)sorted.size();
+	if (n < 3)
+	{
+		hull = sorted;
+		return;
+	}
+
+	hull.resize(2 * n);
+	int k = 0;
+	// Lower hull
+	for (int i = 0; i < n; ++i)
+	{
+		while (k >= 2 && Cross(hull[k - 2], hull[k - 1], sorted[i]) <= 0)
+		{
+			k--;
+		}
+		hull[k++] = sorted[i];
+	}
+	// Upper hull. The last point is the first point of the lower hull, so don't count it
+	for (int i = n - 2, lower = k + 1; i >= 0; --i)
+	{
+		while (k >= lower && Cross(hull[k - 2], hull[k - 1], sorted[i]) <= 0)
+		{
+			k--;
+		}
+		hull[k++] = sorted[i];
+	}
+	hull.resize(k - 1);
+}
+
+/*
+	Rotating calipers diameter
+	For each edge of the hull, the point furthest from it is found by walking forward
+	while the triangle it makes with the edge keeps growing. As the edges go round, that
+	point only ever moves forward, so the whole thing is one lap of the hull.
+	The diameter is between one of these antipodal pairs
+*/
+template <typename T>
+float ConvexHullDiameterImpl(const vector<Point_<T> >& hull)
+{
+	const int n = (int)hull.size();
+	if (n < 2)
+	{
+		return 0;
+	}
+	if (n == 2)
+	{
+		return (float)sqrt(SquaredDist(hull[0], hull[1]));
+	}
+
+	double maxDist = 0;
+	int j = 1;
+	for (int i = 0; i < n; ++i)
+	{
+		const int next = (i + 1) % n;
+		while (abs(Cross(hull[i], hull[next], hull[(j + 1) % n])) > abs(Cross(hull[i], hull[next], hull[j])))
+		{
+			j = (j + 1) % n;
+		}
+		maxDist = max(maxDist, SquaredDist(hull[i], hull[j]));
+		maxDist = max(maxDist, SquaredDist(hull[next], hull[j]));
+	}
+
+	return (float)sqrt(maxDist);
+}
+
+/*
+	Rotating calipers minimum area rectangle
+	The smallest rectangle around a convex polygon has a side along one of its edges.
+	So for each edge, we need the extreme points along the edge in both directions, and
+	the point furthest from the edge. Like the diameter, each of these only moves forward
+	as we go round, so we keep three calipers and advance them as we go
+*/
+template <typename T>
+RotatedRect MinAreaBoundingRectImpl(const vector<Point_<T> >& hull)
+{
+	const int n = (int)hull.size();
+	if (n == 0)
+	{
+		return RotatedRect();
+	}
+	if (n == 1)
+	{
+		return RotatedRect(Point2f((float)hull[0].x, (float)hull[0].y), Size2f(0, 0), 0);
+	}
+	if (n == 2)
+	{
+		const Point2f p1((float)hull[0].x, (float)hull[0].y);
+		const Point2f p2((float)hull[1].x, (float)hull[1].y);
+		const float angle = atan2(p2.y - p1.y, p2.x - p1.x) * RAD_TO_DEG;
+		return RotatedRect((p1 + p2) * 0.5f, Size2f((float)sqrt(SquaredDist(hull[0], hull[1])), 0), angle);
+	}
+
+	// Projections of point k onto the current edge direction and its normal, relative to point i
+	double ux = 0, uy = 0;
+	int i = 0;
+	auto along = [&](int k) { return ((double)hull[k].x - hull[i].x) * ux + ((double)hull[k].y - hull[i].y) * uy; };
+	auto across = [&](int k) { return ((double)hull[k].y - hull[i].y) * ux - ((double)hull[k].x - hull[i].x) * uy; };
+
+	double bestArea = -1;
+	RotatedRect best;
+	int front = 0, back = 0, far = 0;
+	for (i = 0; i < n; ++i)
+	{
+		const int next = (i + 1) % n;
+		const double length = sqrt(SquaredDist(hull[i], hull[next]));
+		ux = (hull[next].x - hull[i].x) / length;
+		uy = (hull[next].y - hull[i].y) / length;
+
+		if (i == 0)
+		{
+			// Place the calipers properly for the first edge. After this they just creep forward
+			for (int k = 0; k < n; ++k)
+			{
+				if (along(k) > along(front)) front = k;
+				if (along(k) < along(back)) back = k;
+				if (abs(across(k)) > abs(across(far))) far = k;
+			}
+		}
+		else
+		{
+			while (along((front + 1) % n) > along(front)) front = (front + 1) % n;
+			while (along((back + 1) % n) < along(back)) back = (back + 1) % n;
+			while (abs(across((far + 1) % n)) > abs(across(far))) far = (far + 1) % n;
+		}
+
+		const double minAlong = along(back);
+		const double maxAlong = along(front);
+		const double height = across(far);
+		const double area = (maxAlong - minAlong) * abs(height);
+		if (bestArea < 0 || area < bestArea)
+		{
+			bestArea = area;
+			// The edge is one side. Go halfway along it and halfway across to get the centre
+			const double midAlong = (minAlong + maxAlong) / 2;
+			const double midAcross = height / 2;
+			const Point2f centre((float)(hull[i].x + ux * midAlong - uy * midAcross),
+				                 (float)(hull[i].y + uy * midAlong + ux * midAcross));
+			best = RotatedRect(centre, Size2f((float)(maxAlong - minAlong), (float)abs(height)), (float)(atan2(uy, ux) * RAD_TO_DEG));
+		}
+	}
+
+	return best;
+}
+
+// Actual functions
+void ConvexHull(const std::vector<cv::Point>& points, std::vector<cv::Point>& hull)
+{
+	ConvexHullImpl(points, hull);
+}
+void ConvexHull(const std::vector<cv::Point2f>& points, std::vector<cv::Point2f>& hull)
+{
+	ConvexHullImpl(points, hull);
+}
+
+float ConvexHullDiameter(const std::vector<cv::Point>& hull)
+{
+	return ConvexHullDiameterImpl(hull);
+}
+float ConvexHullDiameter(const std::vector<cv::Point2f>& hull)
+{
+	return ConvexHullDiameterImpl(hull);
+}
+
+cv::RotatedRect MinAreaBoundingRect(const std::vector<cv::Point>& hull)
+{
+	return MinAreaBoundingRectImpl(hull);
+}
+cv::RotatedRect MinAreaBoundingRect(const std::vector<cv::Point2f>& hull)
+{
+	return MinAreaBoundingRectImpl(hull);
+}
+
+/*
+	Uniform point grid
+	Points are bucketed by which cell they fall in, with a counting sort so that each cell's
+	points sit together in one array. A radius query then only looks in the cells that
+	overlap the square around the query point.
+	This works well when the points are spread fairly evenly and the cell size is about the
+	query radius, like the corners of the checkers on a board
+*/
+// Helpers
+int GridCellCoord(const float value, const float origin, const float cellSize, const int numCells)
+{
+	const int cell = (int)floor((value - origin) / cellSize);
+	return min(max(cell, 0), numCells - 1);
+}
+// Actual functions
+void BuildPointGrid(const std::vector<cv::Point2f>& points, const float cellSize, PointGrid& grid)
+{
+	grid.points = points;
+	grid.cellSize = cellSize > 0 ? cellSize : 1.f;
+	grid.origin = Point2f(0, 0);
+	grid.rows = 1;
+	grid.cols = 1;
+
+	if (!points.empty())
+	{
+		Point2f minCorner = points[0];
+		Point2f maxCorner = points[0];
+		for (const Point2f& p : points)
+		{
+			minCorner.x = min(minCorner.x, p.x);
+			minCorner.y = min(minCorner.y, p.y);
+			maxCorner.x = max(maxCorner.x, p.x);
+			maxCorner.y = max(maxCorner.y, p.y);
+		}
+		grid.origin = minCorner;
+		grid.cols = (int)floor((maxCorner.x - minCorner.x) / grid.cellSize) + 1;
+		grid.rows = (int)floor((maxCorner.y - minCorner.y) / grid.cellSize) + 1;
+	}
+
+	// Count the points in each cell, then turn the counts into start offsets
+	vector<int> cellOfPoint(points.size());
+	grid.cellStart.assign(grid.rows * grid.cols + 1, 0);
+	for (int i = 0; i < (int)points.size(); ++i)
+	{
+		const int x = GridCellCoord(points[i].x, grid.origin.x, grid.cellSize, grid.cols);
+		const int y = GridCellCoord(points[i].y, grid.origin.y, grid.cellSize, grid.rows);
+		cellOfPoint[i] = y * grid.cols + x;
+		grid.cellStart[cellOfPoint[i] + 1]++;
+	}
+	for (int k = 0; k < grid.rows * grid.cols; ++k)
+	{
+		grid.cellStart[k + 1] += grid.cellStart[k];
+	}
+
+	// Drop each point into its cell. Going in order keeps each cell's points in ascending order
+	vector<int> cursor(grid.cellStart.begin(), grid.cellStart.end() - 1);
+	grid.pointIndices.resize(points.size());
+	for (int i = 0; i < (int)points.size(); ++i)
+	{
+		grid.pointIndices[cursor[cellOfPoint[i]]++] = i;
+	}
+}
+
+void FindPointsWithinRadius(const PointGrid& grid, const cv::Point2f& p, const float radius, std::vector<int>& indices)
+{
+	indices.clear();
+	if (grid.points.empty())
+	{
+		return;
+	}
+
+	const int xStart = GridCellCoord(p.x - radius, grid.origin.x, grid.cellSize, grid.cols);
+	const int xEnd = GridCellCoord(p.x + radius, grid.origin.x, grid.cellSize, grid.cols);
+	const int yStart = GridCellCoord(p.y - radius, grid.origin.y, grid.cellSize, grid.rows);
+	const int yEnd = GridCellCoord(p.y + radius, grid.origin.y, grid.cellSize, grid.rows);
+
+	const float radiusSquared = radius * radius;
+	for (int y = yStart; y <= yEnd; ++y)
+	{
+		for (int x = xStart; x <= xEnd; ++x)
+		{
+			const int cell = y * grid.cols + x;
+			for (int k = grid.cellStart[cell]; k < grid.cellStart[cell + 1]; ++k)
+			{
+				const int i = grid.pointIndices[k];
+				const float dx = grid.points[i].x - p.x;
+				const float dy = grid.points[i].y - p.y;
+				if (dx*dx + dy*dy <= radiusSquared)
+				{
+					indices.push_back(i);
+				}
+			}
+		}
+	}
+	sort(indices.begin(), indices.end());
+}
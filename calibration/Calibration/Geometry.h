@@ -0,0 +1,44 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/*
+	Computational geometry on point sets - convex hulls, and things
+	that are cheap to measure once you have one, like the diameter and
+	the smallest rectangle around the points. Also a grid for finding
+	points near other points
+*/
+
+// Convex hull of a set of points, by Andrew's monotone chain.
+// The hull goes round in a consistent direction, with no collinear points
+void ConvexHull(const std::vector<cv::Point>& points, std::vector<cv::Point>& hull);
+void ConvexHull(const std::vector<cv::Point2f>& points, std::vector<cv::Point2f>& hull);
+
+// The largest distance between any two points of a convex hull, by rotating calipers
+float ConvexHullDiameter(const std::vector<cv::Point>& hull);
+float ConvexHullDiameter(const std::vector<cv::Point2f>& hull);
+
+// The smallest area rectangle that contains a convex hull, by rotating calipers.
+// One side of it always lies along an edge of the hull
+cv::RotatedRect MinAreaBoundingRect(const std::vector<cv::Point>& hull);
+cv::RotatedRect MinAreaBoundingRect(const std::vector<cv::Point2f>& hull);
+
+// A uniform grid of square cells over a set of points, for finding the points near a place
+// without looking at all of them. The points in cell k are
+// points[pointIndices[cellStart[k]]] up to points[pointIndices[cellStart[k + 1]]]
+struct PointGrid
+{
+	cv::Point2f origin;
+	float cellSize;
+	int rows;
+	int cols;
+	std::vector<cv::Point2f> points;
+	std::vector<int> cellStart;
+	std::vector<int> pointIndices;
+};
+
+void BuildPointGrid(const std::vector<cv::Point2f>& points, const float cellSize, PointGrid& grid);
+
+// Indices of all points within radius of p, in ascending order
+void FindPointsWithinRadius(const PointGrid& grid, const cv::Point2f& p, const float radius, std::vector<int>& indices);
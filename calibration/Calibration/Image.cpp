@@ -1,14 +1,31 @@
 #include "Image.h"
 #include <iostream>
 #include <algorithm>
+#include <cstring>
 #include "Estimation.h"
+#include "Geometry.h"
+
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled in on any x86 target, but only used if the CPU we're running on has it
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define USE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 using namespace cv;
 using namespace std;
 
 #define BLACK 0
 #define WHITE 255
-#define USED 128
 
 #define MIN_PATH_SIZE 4
 
@@ -16,7 +33,19 @@ using namespace std;
 #define MIN_LINE_LENGTH 10
 
 #define RANSAC_LINE_ERROR 1.f
+#define RANSAC_LINE_CONFIDENCE 0.999f
+#define RANSAC_LINE_MAX_ITERATIONS 500
 #define CORNER_CONTOUR_EPSILON 5.f
+#define QUAD_SIDE_MARGIN 1.f
+
+// Sub-pixel corner refinement looks at the gradients in a square this far either side of each corner.
+// Keep it small, or the corners of neighbouring checkers pull on each other
+#define SUBPIX_HALF_WINDOW 3
+#define SUBPIX_MAX_ITERATIONS 10
+#define SUBPIX_EPSILON 0.01f
+
+// So that the sum over a window always fits in a signed 32 bit int
+#define MAX_ADAPTIVE_THRESHOLD_HALF_WINDOW 1450
 
 #define LONG_SIDE 9
 #define SHORT_SIDE 7
@@ -28,336 +57,1128 @@ using namespace std;
   like thresholding and erosion
 */
 
+// Helper functions
+bool IsInBounds(int height, int width, Point p)
+{
+	if (p.x >= 0 && p.x < width && p.y >= 0 && p.y < height)
+	{
+		return true;
+	}
+	return false;
+}
+bool IsInBounds(int height, int width, Point2f p)
+{
+	if (p.x >= 0 && p.x <= width - 1 && p.y >= 0 && p.y <= height - 1)
+	{
+		return true;
+	}
+	return false;
+}
+#ifdef USE_AVX2
+// Does this CPU, and the OS, support AVX2?
+bool CpuHasAVX2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+	{
+		return false;
+	}
+	// The OS has to save the AVX registers for us, or we can't use them
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+	{
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+// Add a block of n pixels starting at x to the runs of a row, where bit i of black is set if pixel x + i is black.
+// runStart is where the run we're in started, or -1 if we're not in one
+void AddMaskToRuns(const int black, const int x, const int n, int& runStart, vector<Run>& runs)
+{
+	if (black == (runStart < 0 ? 0 : (1 << n) - 1))
+	{
+		// Same colour as the run we're in (or not in) all the way along
+		return;
+	}
+	for (int i = 0; i < n; ++i)
+	{
+		const bool isBlack = ((black >> i) & 1) != 0;
+		if (isBlack && runStart < 0)
+		{
+			runStart = x + i;
+		}
+		else if (!isBlack && runStart >= 0)
+		{
+			runs.push_back(Run{ runStart, x + i });
+			runStart = -1;
+		}
+	}
+}
+
 /*
-	Gaussian kernel
-	Returns an x by y gaussian kernel with the given sigma
-	x and y have to be odd
+	Adaptive thresholding
+	This thresholds each pixel against the mean of the window around it, rather than against one
+	value for the whole image, so it copes with uneven lighting. A pixel is black if it is more than
+	percent darker than its local mean. This is Bradley and Roth's method:
+	http://people.scs.carleton.ca/~roth/iit-publications-iti/docs/gerh-50002.pdf
+
+	To make each pixel's mean cost the same no matter the window size, we first build an integral image,
+	or summed-area table, where each entry is the sum of all pixels above and to the left of it. 
+	The sum over any rectangle is then four lookups:
+	    sum = I(x2, y2) - I(x1, y2) - I(x2, y1) + I(x1, y1)
+	See https://en.wikipedia.org/wiki/Summed-area_table
+
+	The integral image is kept in unsigned 32 bit. On big images the total overflows, but since unsigned
+	arithmetic wraps, the four-lookup difference still comes out right as long as a single window's sum fits. 
+
+	Both the integral image and the comparison are done a row at a time, and the parts of each row
+	that don't have to worry about the image border are done four pixels at a time with SSE2, or eight
+	with AVX2. As for AverageThreshold, which of those gets used is decided once, at runtime, by asking
+	the CPU what it supports.
+	Detection only wants the runs of black, so the comparison emits those directly - each block of pixels
+	gives a bitmask, and a mask that doesn't start or end a run costs nothing more. The binary image
+	is never written out unless someone asks for it
 */
-Mat GaussianKernel(const int x, const int y, const int sigma)
+// Helper functions
+// Add the row above to a row of the integral image, from x on. Returns how far it got
+int AddIntegralRowScalar(uint32_t* cur, const uint32_t* prev, int x, const int length)
 {
-	Mat gaussKernel = Mat(y, x, CV_32F, 1.f);
-	int sigmaSq = sigma * sigma;
-	for (int h = 0; h < y; ++h)
+	for (; x < length; ++x)
 	{
-		for (int w = 0; w < x; ++w)
+		cur[x] += prev[x];
+	}
+	return x;
+}
+// Add the runs of black pixels in the interior of a row, from x up to xEnd, where the whole window fits
+// and so the same factor applies to every pixel. Returns how far it got; the rest is done one pixel at a time
+int AdaptiveInteriorScalar(const uchar* row, const uint32_t* top, const uint32_t* bottom, int x, const int xEnd,
+	const int half, const float factor, int& runStart, vector<Run>& runs)
+{
+	return x;
+}
+#ifdef USE_SSE2
+int AddIntegralRowSSE2(uint32_t* cur, const uint32_t* prev, int x, const int length)
+{
+	for (; x + 4 <= length; x += 4)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(cur + x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev + x));
+		_mm_storeu_si128((__m128i*)(cur + x), _mm_add_epi32(a, b));
+	}
+	return x;
+}
+int AdaptiveInteriorSSE2(const uchar* row, const uint32_t* top, const uint32_t* bottom, int x, const int xEnd,
+	const int half, const float factor, int& runStart, vector<Run>& runs)
+{
+	const __m128 vFactor = _mm_set1_ps(factor);
+	const __m128i zero = _mm_setzero_si128();
+	for (; x + 4 <= xEnd; x += 4)
+	{
+		const int x1 = x - half;
+		const int x2 = x + half + 1;
+		__m128i sum = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(bottom + x2)), _mm_loadu_si128((const __m128i*)(bottom + x1)));
+		sum = _mm_sub_epi32(sum, _mm_loadu_si128((const __m128i*)(top + x2)));
+		sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)(top + x1)));
+		__m128 threshold = _mm_mul_ps(_mm_cvtepi32_ps(sum), vFactor);
+
+		// Widen four pixels to 32 bit floats
+		int fourPixels;
+		memcpy(&fourPixels, row + x, 4);
+		__m128i pixels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(fourPixels), zero), zero);
+
+		// One bit per pixel, set if it's black
+		AddMaskToRuns(_mm_movemask_ps(_mm_cmple_ps(_mm_cvtepi32_ps(pixels), threshold)), x, 4, runStart, runs);
+	}
+	return x;
+}
+#endif
+#ifdef USE_AVX2
+TARGET_AVX2 int AddIntegralRowAVX2(uint32_t* cur, const uint32_t* prev, int x, const int length)
+{
+	for (; x + 8 <= length; x += 8)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(cur + x));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(prev + x));
+		_mm256_storeu_si256((__m256i*)(cur + x), _mm256_add_epi32(a, b));
+	}
+	return x;
+}
+TARGET_AVX2 int AdaptiveInteriorAVX2(const uchar* row, const uint32_t* top, const uint32_t* bottom, int x, const int xEnd,
+	const int half, const float factor, int& runStart, vector<Run>& runs)
+{
+	const __m256 vFactor = _mm256_set1_ps(factor);
+	for (; x + 8 <= xEnd; x += 8)
+	{
+		const int x1 = x - half;
+		const int x2 = x + half + 1;
+		__m256i sum = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(bottom + x2)), _mm256_loadu_si256((const __m256i*)(bottom + x1)));
+		sum = _mm256_sub_epi32(sum, _mm256_loadu_si256((const __m256i*)(top + x2)));
+		sum = _mm256_add_epi32(sum, _mm256_loadu_si256((const __m256i*)(top + x1)));
+		__m256 threshold = _mm256_mul_ps(_mm256_cvtepi32_ps(sum), vFactor);
+
+		// Widen eight pixels to 32 bit floats
+		__m256i pixels = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(row + x)));
+
+		// One bit per pixel, set if it's black
+		AddMaskToRuns(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_cvtepi32_ps(pixels), threshold, _CMP_LE_OQ)), x, 8, runStart, runs);
+	}
+	return x;
+}
+#endif
+// Pick the best row functions for this CPU. This only happens once
+typedef int(*AddIntegralRowFunction)(uint32_t*, const uint32_t*, int, const int);
+typedef int(*AdaptiveInteriorFunction)(const uchar*, const uint32_t*, const uint32_t*, int, const int, const int, const float, int&, vector<Run>&);
+struct AdaptiveKernels
+{
+	AddIntegralRowFunction addIntegralRow;
+	AdaptiveInteriorFunction interior;
+};
+AdaptiveKernels SelectAdaptiveKernels()
+{
+	AdaptiveKernels kernels = { AddIntegralRowScalar, AdaptiveInteriorScalar };
+#ifdef USE_SSE2
+	kernels.addIntegralRow = AddIntegralRowSSE2;
+	kernels.interior = AdaptiveInteriorSSE2;
+#endif
+#ifdef USE_AVX2
+	if (CpuHasAVX2())
+	{
+		kernels.addIntegralRow = AddIntegralRowAVX2;
+		kernels.interior = AdaptiveInteriorAVX2;
+	}
+#endif
+	return kernels;
+}
+// Build the integral image, which is (rows+1) by (cols+1) with a zero first row and column
+void BuildIntegralImage(const Mat& input, const AdaptiveKernels& kernels, vector<uint32_t>& integral)
+{
+	const int stride = input.cols + 1;
+	integral.resize(stride * (input.rows + 1));
+	fill(integral.begin(), integral.begin() + stride, 0);
+
+	for (int y = 0; y < input.rows; ++y)
+	{
+		const uchar* row = input.ptr<uchar>(y);
+		const uint32_t* prev = &integral[y * stride];
+		uint32_t* cur = &integral[(y + 1) * stride];
+
+		// Running sum along the row. This part can't be vectorised
+		uint32_t rowSum = 0;
+		cur[0] = 0;
+		for (int x = 0; x < input.cols; ++x)
 		{
-			// center coordinates
-			Point p(w - (x/2), h - (y/2));
+			rowSum += row[x];
+			cur[x + 1] = rowSum;
+		}
 
-			// compute gaussian value as a float
-			float g = exp(-(p.x*p.x + p.y*p.y) / (2 * sigmaSq)) / (2 * 3.14159*sigmaSq);
+		// Then add the row above
+		const int x = kernels.addIntegralRow(cur, prev, 1, stride);
+		AddIntegralRowScalar(cur, prev, x, stride);
+	}
+}
+// Add the runs of black pixels in one row. top and bottom are the integral image rows
+// above and below the window, which is windowHeight rows tall and half either side of each pixel
+void AdaptiveThresholdRow(const uchar* row, const uint32_t* top, const uint32_t* bottom, const int cols,
+	const int half, const int windowHeight, const float scale, const AdaptiveKernels& kernels, vector<Run>& runs)
+{
+	int runStart = -1;
+	int x = 0;
 
-			gaussKernel.at<float>(h, w) = g;
+	// The interior of the row, where the whole window fits horizontally
+	const int interiorStart = half;
+	const int interiorEnd = cols - half;
+
+	// Scalar, for the border pixels
+	auto isBlack = [&](int px)
+	{
+		const int x1 = max(px - half, 0);
+		const int x2 = min(px + half, cols - 1) + 1;
+		const uint32_t sum = bottom[x2] - bottom[x1] - top[x2] + top[x1];
+		const float factor = scale / (float)((x2 - x1) * windowHeight);
+		return (float)row[px] <= (float)(int)sum * factor;
+	};
+
+	// Left border
+	for (; x < interiorStart && x < cols; ++x)
+	{
+		AddMaskToRuns(isBlack(x), x, 1, runStart, runs);
+	}
+
+	// Interior, where the window width and so the factor is the same for every pixel
+	const float factor = scale / (float)((2 * half + 1) * windowHeight);
+	x = kernels.interior(row, top, bottom, x, interiorEnd, half, factor, runStart, runs);
+
+	// Whatever's left, including the right border
+	for (; x < cols; ++x)
+	{
+		AddMaskToRuns(isBlack(x), x, 1, runStart, runs);
+	}
+	if (runStart >= 0)
+	{
+		runs.push_back(Run{ runStart, cols });
+	}
+}
+// Actual functions
+bool AdaptiveThresholdRunLength(const cv::Mat& input, RunLengthImage& output, int windowSize, int percent)
+{
+	// Some brief error checking
+	if (input.rows == 0 || input.cols == 0)
+	{
+		return false;
+	}
+	if (windowSize <= 0 || percent < 0 || percent >= 100)
+	{
+		return false;
+	}
+
+	// The window sums are converted to signed 32 bit for the vector compare, so a window
+	// can have at most 2^31 / 255 pixels in it
+	int half = min(windowSize / 2, MAX_ADAPTIVE_THRESHOLD_HALF_WINDOW);
+
+	// Reused between calls, since these can be very big. One per thread
+	static thread_local vector<uint32_t> integral;
+	static const AdaptiveKernels kernels = SelectAdaptiveKernels();
+	BuildIntegralImage(input, kernels, integral);
+	const int stride = input.cols + 1;
+	const float scale = (100 - percent) / 100.f;
+
+	output.rows = input.rows;
+	output.cols = input.cols;
+	output.runs.clear();
+	output.rowStart.resize(input.rows + 1);
+	for (int y = 0; y < input.rows; ++y)
+	{
+		// Window rows, clamped to the image
+		const int y1 = max(y - half, 0);
+		const int y2 = min(y + half, input.rows - 1) + 1;
+
+		output.rowStart[y] = output.runs.size();
+		AdaptiveThresholdRow(input.ptr<uchar>(y), &integral[y1 * stride], &integral[y2 * stride], input.cols,
+			half, y2 - y1, scale, kernels, output.runs);
+	}
+	output.rowStart[input.rows] = output.runs.size();
+
+	return true;
+}
+bool AdaptiveThreshold(const cv::Mat& input, cv::Mat& output, int windowSize, int percent)
+{
+	if (input.rows != output.rows || input.cols != output.cols)
+	{
+		return false;
+	}
+
+	RunLengthImage binary;
+	if (!AdaptiveThresholdRunLength(input, binary, windowSize, percent))
+	{
+		return false;
+	}
+
+	// Write the runs out into the caller's image
+	for (int y = 0; y < binary.rows; ++y)
+	{
+		uchar* out = output.ptr<uchar>(y);
+		memset(out, WHITE, binary.cols);
+		for (int r = binary.rowStart[y]; r < binary.rowStart[y + 1]; ++r)
+		{
+			memset(out + binary.runs[r].xStart, BLACK, binary.runs[r].xEnd - binary.runs[r].xStart);
 		}
 	}
-	// normalise the corners
-	gaussKernel /= gaussKernel.at<float>(0, 0);
-	return gaussKernel;
+
+	return true;
 }
 
+/*
+	Average Threshold
+	Find the average pixel value in the image, and threshold based on that
+
+	Detection uses this instead of the adaptive threshold when ADAPTIVE_THRESHOLD is off, through
+	AverageThresholdRunLength, so it's worth making fast. It's two passes:
+	sum every pixel, then compare every pixel. Both work on whole rows at a time through raw row pointers
+	(or the whole image as one row, if it's contiguous), and both have SSE2 and AVX2 versions
+	that do 16 or 32 pixels at once. Which version gets used is decided once, at runtime, by asking the
+	CPU what it supports.
+
+	The sum is kept as an exact integer, and instead of comparing against a float average we use the
+	equivalent integer threshold: pixel < sum/N exactly when pixel < ceil(sum/N)
+*/
 // Helper functions
-bool IsInBounds(int height, int width, Point p)
+// Scalar versions, for anything without SSE2
+uint64_t SumRowScalar(const uchar* row, const int length)
 {
-	if (p.x >= 0 && p.x < width && p.y >= 0 && p.y < height)
+	uint64_t sum = 0;
+	for (int x = 0; x < length; ++x)
 	{
-		return true;
+		sum += row[x];
 	}
-	return false;
+	return sum;
+}
+void ThresholdRowScalar(const uchar* row, uchar* out, const int length, const uchar threshold)
+{
+	for (int x = 0; x < length; ++x)
+	{
+		out[x] = row[x] < threshold ? BLACK : WHITE;
+	}
+}
+#ifdef USE_SSE2
+// Sum of absolute differences against zero adds up each 8 bytes into a 64 bit lane
+uint64_t SumRowSSE2(const uchar* row, const int length)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	int x = 0;
+	for (; x + 16 <= length; x += 16)
+	{
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(row + x)), zero));
+	}
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, acc);
+	return lanes[0] + lanes[1] + SumRowScalar(row + x, length - x);
+}
+// There's no unsigned byte compare, but pixel >= threshold exactly when max(pixel, threshold) == pixel.
+// That mask is all ones (WHITE) for pixels at or above the threshold, and zero (BLACK) below
+void ThresholdRowSSE2(const uchar* row, uchar* out, const int length, const uchar threshold)
+{
+	const __m128i t = _mm_set1_epi8((char)threshold);
+	int x = 0;
+	for (; x + 16 <= length; x += 16)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+		_mm_storeu_si128((__m128i*)(out + x), _mm_cmpeq_epi8(_mm_max_epu8(pixels, t), pixels));
+	}
+	ThresholdRowScalar(row + x, out + x, length - x, threshold);
+}
+#endif
+#ifdef USE_AVX2
+TARGET_AVX2 uint64_t SumRowAVX2(const uchar* row, const int length)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+	int x = 0;
+	for (; x + 32 <= length; x += 32)
+	{
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(row + x)), zero));
+	}
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + SumRowScalar(row + x, length - x);
+}
+TARGET_AVX2 void ThresholdRowAVX2(const uchar* row, uchar* out, const int length, const uchar threshold)
+{
+	const __m256i t = _mm256_set1_epi8((char)threshold);
+	int x = 0;
+	for (; x + 32 <= length; x += 32)
+	{
+		__m256i pixels = _mm256_loadu_si256((const __m256i*)(row + x));
+		_mm256_storeu_si256((__m256i*)(out + x), _mm256_cmpeq_epi8(_mm256_max_epu8(pixels, t), pixels));
+	}
+	ThresholdRowScalar(row + x, out + x, length - x, threshold);
+}
+#endif
+// Pick the best row functions for this CPU. This only happens once
+typedef uint64_t(*SumRowFunction)(const uchar*, const int);
+typedef void(*ThresholdRowFunction)(const uchar*, uchar*, const int, const uchar);
+struct ThresholdKernels
+{
+	SumRowFunction sumRow;
+	ThresholdRowFunction thresholdRow;
+};
+ThresholdKernels SelectThresholdKernels()
+{
+	ThresholdKernels kernels = { SumRowScalar, ThresholdRowScalar };
+#ifdef USE_SSE2
+	kernels.sumRow = SumRowSSE2;
+	kernels.thresholdRow = ThresholdRowSSE2;
+#endif
+#ifdef USE_AVX2
+	if (CpuHasAVX2())
+	{
+		kernels.sumRow = SumRowAVX2;
+		kernels.thresholdRow = ThresholdRowAVX2;
+	}
+#endif
+	return kernels;
+}
+// The mean of all pixels, rounded up
+uchar FindAverageThreshold(const cv::Mat& input, const ThresholdKernels& kernels)
+{
+	int rows = input.rows;
+	int length = input.cols;
+	if (input.isContinuous())
+	{
+		length *= rows;
+		rows = 1;
+	}
+
+	uint64_t sum = 0;
+	for (int y = 0; y < rows; ++y)
+	{
+		sum += kernels.sumRow(input.ptr<uchar>(y), length);
+	}
+	const uint64_t numPixels = (uint64_t)input.rows * input.cols;
+	return (uchar)((sum + numPixels - 1) / numPixels);
+}
+// Actual function
+bool AverageThreshold(const cv::Mat& input, cv::Mat& output)
+{
+	if (input.rows != output.rows || input.cols != output.cols)
+	{
+		return false;
+	}
+	if (input.rows == 0 || input.cols == 0)
+	{
+		return false;
+	}
+
+	static const ThresholdKernels kernels = SelectThresholdKernels();
+
+	// Find average
+	const uchar threshold = FindAverageThreshold(input, kernels);
+
+	// If both images are one contiguous block, treat them as one long row
+	int rows = input.rows;
+	int length = input.cols;
+	if (input.isContinuous() && output.isContinuous())
+	{
+		length *= rows;
+		rows = 1;
+	}
+
+	// Actually do threshold
+	for (int y = 0; y < rows; ++y)
+	{
+		kernels.thresholdRow(input.ptr<uchar>(y), output.ptr<uchar>(y), length, threshold);
+	}
+
+	return true;
 }
 
 /*
-	Gaussian thresholding
-	This calculates the threshold per pixel by computing the mean of the neighbourhood values
-	weighted by a gaussian kernel of the same size
+	Run length encoding
+
+	After thresholding the image is binary, and mostly long stretches of the same colour - 
+	a 20 megapixel image of a checkerboard has maybe a couple of hundred thousand runs of black in it.
+	So storing just the runs is a lot less memory to drag through the cache than a whole byte per pixel,
+	and everything afterwards (labelling, edge finding) can work a run at a time.
+
+	A pixel is black if it is darker than the threshold, exactly as in AverageThreshold. 
+	Sixteen pixels at a time are checked against the threshold, and if none of them start or end a run
+	they're skipped over in one go, which is most of the time. 
 */
-bool GaussianThreshold(const cv::Mat& input, cv::Mat& output, int kernelSize, int constant)
+// Helper functions
+// Add the runs of pixels darker than threshold in one row
+void EncodeRow(const uchar* row, const int cols, const uchar threshold, vector<Run>& runs)
 {
-	// Some brief error checking
-	if (input.rows != output.rows || input.cols != output.cols)
+	int runStart = -1;
+	int x = 0;
+#ifdef USE_SSE2
+	const __m128i t = _mm_set1_epi8((char)threshold);
+	for (; x + 16 <= cols; x += 16)
+	{
+		const __m128i p = _mm_loadu_si128((const __m128i*)(row + x));
+		// One bit per pixel, set if it's white
+		const int white = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(p, t), p));
+		AddMaskToRuns(~white & 0xFFFF, x, 16, runStart, runs);
+	}
+#endif
+	for (; x < cols; ++x)
+	{
+		AddMaskToRuns(row[x] < threshold, x, 1, runStart, runs);
+	}
+	if (runStart >= 0)
+	{
+		runs.push_back(Run{ runStart, cols });
+	}
+}
+// Encode every row of an image against a threshold
+void EncodeImage(const cv::Mat& input, const uchar threshold, RunLengthImage& output)
+{
+	output.rows = input.rows;
+	output.cols = input.cols;
+	output.runs.clear();
+	output.rowStart.resize(input.rows + 1);
+	for (int y = 0; y < input.rows; ++y)
+	{
+		output.rowStart[y] = output.runs.size();
+		EncodeRow(input.ptr<uchar>(y), input.cols, threshold, output.runs);
+	}
+	output.rowStart[input.rows] = output.runs.size();
+}
+// Actual functions
+bool AverageThresholdRunLength(const cv::Mat& input, RunLengthImage& output)
+{
+	if (input.rows == 0 || input.cols == 0)
 	{
 		return false;
 	}
-	if (kernelSize <= 0 || kernelSize % 2 == 0)
+
+	static const ThresholdKernels kernels = SelectThresholdKernels();
+	EncodeImage(input, FindAverageThreshold(input, kernels), output);
+	return true;
+}
+bool EncodeRunLength(const cv::Mat& input, RunLengthImage& output)
+{
+	if (input.rows == 0 || input.cols == 0)
 	{
 		return false;
 	}
 
-	// construct gaussian kernel of given size
-	Mat gaussKernel = GaussianKernel(kernelSize, kernelSize, kernelSize/5);
-	float kernelWeight = 0;
-	for (int y = 0; y < kernelSize; ++y)
+	// Anything that isn't black is white
+	EncodeImage(input, BLACK + 1, output);
+	return true;
+}
+void DecodeRunLength(const RunLengthImage& input, cv::Mat& output)
+{
+	output = Mat(input.rows, input.cols, CV_8U, Scalar(WHITE));
+	for (int y = 0; y < input.rows; ++y)
 	{
-		for (int x = 0; x < kernelSize; ++x)
+		uchar* row = output.ptr<uchar>(y);
+		for (int r = input.rowStart[y]; r < input.rowStart[y + 1]; ++r)
 		{
-			kernelWeight += gaussKernel.at<float>(y, x);
+			memset(row + input.runs[r].xStart, BLACK, input.runs[r].xEnd - input.runs[r].xStart);
 		}
 	}
-	/*Mat(kernelSize, kernelSize, CV_32F, 1);
-	for (int i = 0; i < kernelSize; ++i) for (int j = 0; j < kernelSize; ++j) gaussKernel.at<float>(i, j) = 1;
-	GaussianBlur(gaussKernel, gaussKernel, Size(kernelSize, kernelSize), 1, 1, BORDER_DEFAULT);*/
-
-//#ifdef DEBUG
-	//cout << gaussKernel << endl;
-//#endif
-
-	// centre of neighbourhood is half the kernel size plus 1:
-	int centre = kernelSize / 2 + 1;
-	int halfKernel = kernelSize / 2;
+}
 
-	// Over each pixel, for the neighbourhood around it, compute the mean
-	// and threshold
-	// Any points off-image are 0
+/*
+	Erosion
+	There are two supplied kernels for this, but I guess you can also supply your own
+	The kernel is placed over every input pixel. If any pixel covered by the kernel's nonzero values is
+	0, then the output pixel is 0
+	Any pixel outside the image is considered 0
+*/
+bool Erode(const cv::Mat& input, cv::Mat& output, cv::Mat erosionKernel)
+{
+	// Some brief error checking
+	if (input.rows != output.rows || input.cols != output.cols)
+	{
+		return false;
+	}
 
-	float totalMean = 0;
+	// just to make sure
+	output = input.clone();
 
 	for (int y = 0; y < input.rows; ++y)
 	{
 		for (int x = 0; x < input.cols; ++x)
 		{
-			totalMean += input.at<uint8_t>(y, x);
-			continue;
-			// For the neighbourhood around the pixel
-			float mean = 0;
-			int min = 255, max = 0;
-			for (int h = -halfKernel; h <= halfKernel; ++h)
+			int erosionSum = 0;
+			for (int h = 0; h < erosionKernel.rows; ++h)
 			{
-				for (int w = -halfKernel; w <= halfKernel; ++w)
+				for (int w = 0; w < erosionKernel.cols; ++w)
 				{
-					Point p(x+w, y+h);
-					int value = 0;
+					Point p(x + w - 1, y + h - 1);
 					if ((p.x > 0 && p.x < input.cols) && (p.y > 0 && p.y < input.rows))
 					{
-						value = input.at<uint8_t>(p.y, p.x);
-						if (value < min)
-						{
-							min = value;
-						}
-						if (value > max)
-						{
-							max = value;
-						}
+						erosionSum += input.at<uint8_t>(p.y, p.x)*erosionKernel.at<int>(h, w);
 					}
-					float weight = gaussKernel.at<float>(h + halfKernel, w + halfKernel);
-
-					mean += weight * value;
 				}
 			}
 
-			mean /= kernelWeight;// kernelSize * kernelSize; // gotta divide by total weight
-			mean -= constant;
-			int pixelToThreshold = input.at<uint8_t>(y, x);
-
-			// Is the range too small?
-			if (max - min < 20)
-			{
-				mean = 128; // if it's too small, just pick an easy bound. 
-				// That way, it all gets shunted to one side to avoid salt and pepper
-			}
-
-			if (pixelToThreshold > mean)
-			{
-				output.at<uint8_t>(y, x) = 255;
-			}
-			else
-			{
-				output.at<uint8_t>(y, x) = 0;
-			}
-		}
-	}
-
-	totalMean /= input.cols*input.rows;
-	for (int y = 0; y < input.rows; ++y)
-	{
-		for (int x = 0; x < input.cols; ++x)
-		{
-			int pixelToThreshold = input.at<uint8_t>(y, x);
-
-			if (pixelToThreshold > 127/*totalMean*/)
+			if (erosionSum > 0)
 			{
-				output.at<uint8_t>(y, x) = 255;
+				output.at<uint8_t>(y, x) = WHITE;
 			}
 			else
 			{
-				output.at<uint8_t>(y, x) = 0;
+				output.at<uint8_t>(y, x) = input.at<uint8_t>(y, x);
 			}
 		}
 	}
 
-
 	return true;
 }
 
 /*
-	Average Threshold
-	Find the average pixel value in the image, and threshold based on that
+	Find Contours
+	This requires a binarised image. We search through the image for black components, 8-connected,
+	and for each one collect its edge pixels - black pixels that touch a white one - along with
+	its bounding box, area and centroid. 
+
+	This is done with two-pass connected component labelling, using union-find:
+	https://en.wikipedia.org/wiki/Connected-component_labeling#Two-pass
+	The first pass gives each black pixel a provisional label, taken from its already-visited
+	neighbours (left, and the three above), and merges labels whenever two different ones meet.
+	The second pass resolves each pixel to its final blob and accumulates that blob's statistics.
+	Every pixel is touched a constant number of times, no matter how many blobs there are. 
+
+	All the scratch memory is reused between calls, and the edge pixels for all blobs go into
+	one shared array, so no blob allocates anything of its own
 */
-bool AverageThreshold(const cv::Mat& input, cv::Mat& output)
+// Helper functions
+// Find the root label of the set, halving the path as we go
+int FindRootLabel(vector<int>& parent, int label)
 {
-	if (input.rows != output.rows || input.cols != output.cols)
+	while (parent[label] != label)
+	{
+		parent[label] = parent[parent[label]];
+		label = parent[label];
+	}
+	return label;
+}
+// Merge the sets of two labels. The smaller root wins, so roots are always the first label seen
+int MergeLabels(vector<int>& parent, int a, int b)
+{
+	a = FindRootLabel(parent, a);
+	b = FindRootLabel(parent, b);
+	if (a == b)
+	{
+		return a;
+	}
+	if (a < b)
+	{
+		parent[b] = a;
+		return a;
+	}
+	parent[a] = b;
+	return b;
+}
+// Every root is the smallest label in its set, and labels are handed out in raster order.
+// So going through the labels in order, each label's root has already been resolved to its blob,
+// and the blobs get numbered in raster order of their first pixel. Returns the number of blobs
+int NumberBlobs(vector<int>& parent, vector<int>& blobOfLabel)
+{
+	blobOfLabel.resize(parent.size());
+	int numBlobs = 0;
+	for (int l = 0; l < parent.size(); ++l)
+	{
+		if (parent[l] == l)
+		{
+			blobOfLabel[l] = numBlobs++;
+		}
+		else
+		{
+			blobOfLabel[l] = blobOfLabel[FindRootLabel(parent, l)];
+		}
+	}
+	return numBlobs;
+}
+// Grow a blob's bounding box to take in the pixels [xStart, xEnd) on row y.
+// Rows come in order, so only the bottom can move down
+void GrowBoundingBox(Blob& blob, int xStart, int xEnd, int y)
+{
+	if (blob.area == 0)
+	{
+		blob.boundingBox = Rect(xStart, y, xEnd - xStart, 1);
+		return;
+	}
+	const int right = max(blob.boundingBox.x + blob.boundingBox.width, xEnd);
+	blob.boundingBox.x = min(blob.boundingBox.x, xStart);
+	blob.boundingBox.width = right - blob.boundingBox.x;
+	blob.boundingBox.height = y - blob.boundingBox.y + 1;
+}
+// Finish the centroids, and lay the edge pixels out blob by blob, keeping raster order within each blob.
+// sums holds the x and y sums of each blob, and gets used as scratch
+void LayOutBoundary(vector<Blob>& blobs, vector<int64_t>& sums, const vector<pair<Point, int> >& edgePixels, vector<Point>& boundary)
+{
+	int offset = 0;
+	for (int b = 0; b < blobs.size(); ++b)
+	{
+		Blob& blob = blobs[b];
+		blob.centroid = Point2f((float)((double)sums[2 * b] / blob.area), (float)((double)sums[2 * b + 1] / blob.area));
+		blob.boundaryStart = offset;
+		offset += blob.boundaryCount;
+		// Reuse the sums as write cursors
+		sums[2 * b] = blob.boundaryStart;
+	}
+	boundary.resize(offset);
+	for (const auto& e : edgePixels)
+	{
+		boundary[sums[2 * e.second]++] = e.first;
+	}
+}
+// Actual function
+bool LabelBlobs(const cv::Mat& input, std::vector<Blob>& blobs, std::vector<cv::Point>& boundary)
+{
+	blobs.clear();
+	boundary.clear();
+	const int rows = input.rows;
+	const int cols = input.cols;
+	if (rows == 0 || cols == 0)
 	{
 		return false;
 	}
 
-	// Find average
-	float average = 0;
-	for (int y = 0; y < input.rows; ++y)
+	// Scratch, reused between calls. One set per thread
+	static thread_local vector<int> labels;
+	static thread_local vector<int> parent;
+	static thread_local vector<int> blobOfLabel;
+	static thread_local vector<int64_t> sums;
+	static thread_local vector<pair<Point, int> > edgePixels;
+	labels.resize(rows * cols);
+	parent.clear();
+	edgePixels.clear();
+
+	// First pass: provisional labels. -1 is white
+	for (int y = 0; y < rows; ++y)
 	{
-		for (int x = 0; x < input.cols; ++x)
+		const uchar* row = input.ptr<uchar>(y);
+		int* label = &labels[y * cols];
+		const int* labelAbove = label - cols;
+		for (int x = 0; x < cols; ++x)
 		{
-			average += (float)input.at<uchar>(y,x);
+			if (row[x] != BLACK)
+			{
+				label[x] = -1;
+				continue;
+			}
+
+			// If the pixel above is black, it touches all the other visited neighbours,
+			// so they're already in its set. Otherwise the only pair that might need merging is
+			// above-right with left or above-left. See Wu et al, Optimizing two-pass connected-component
+			// labeling algorithms
+			const int left = (x > 0) ? label[x - 1] : -1;
+			const int aboveLeft = (y > 0 && x > 0) ? labelAbove[x - 1] : -1;
+			const int above = (y > 0) ? labelAbove[x] : -1;
+			const int aboveRight = (y > 0 && x < cols - 1) ? labelAbove[x + 1] : -1;
+			int l = -1;
+			if (above >= 0)
+			{
+				l = above;
+			}
+			else if (aboveRight >= 0)
+			{
+				l = aboveRight;
+				if (left >= 0)
+				{
+					l = MergeLabels(parent, aboveRight, left);
+				}
+				else if (aboveLeft >= 0)
+				{
+					l = MergeLabels(parent, aboveRight, aboveLeft);
+				}
+			}
+			else if (left >= 0)
+			{
+				l = left;
+			}
+			else if (aboveLeft >= 0)
+			{
+				l = aboveLeft;
+			}
+			else
+			{
+				// A new blob, as far as we know so far
+				l = parent.size();
+				parent.push_back(l);
+			}
+			label[x] = l;
 		}
 	}
-	average /= (float)input.rows*input.cols;
 
-	// Actually do threshold
-	for (int y = 0; y < input.rows; ++y)
+	const int numBlobs = NumberBlobs(parent, blobOfLabel);
+	Blob emptyBlob;
+	emptyBlob.area = 0;
+	emptyBlob.boundaryStart = 0;
+	emptyBlob.boundaryCount = 0;
+	blobs.assign(numBlobs, emptyBlob);
+	sums.assign(2 * numBlobs, 0);
+
+	// Second pass: accumulate each blob's statistics, and find edge pixels
+	for (int y = 0; y < rows; ++y)
 	{
-		for (int x = 0; x < input.cols; ++x)
+		const uchar* row = input.ptr<uchar>(y);
+		const uchar* rowAbove = (y > 0) ? input.ptr<uchar>(y - 1) : nullptr;
+		const uchar* rowBelow = (y < rows - 1) ? input.ptr<uchar>(y + 1) : nullptr;
+		const int* label = &labels[y * cols];
+		for (int x = 0; x < cols; ++x)
 		{
-			auto pixel = input.at<uchar>(y, x);
-			if (pixel < average)
+			if (label[x] < 0)
 			{
-				output.at<uchar>(y, x) = BLACK;
+				continue;
 			}
-			else
+
+			const int b = blobOfLabel[label[x]];
+			Blob& blob = blobs[b];
+			GrowBoundingBox(blob, x, x + 1, y);
+			blob.area++;
+			sums[2 * b] += x;
+			sums[2 * b + 1] += y;
+
+			// Is this an edge pixel? Off-image neighbours don't count as white
+			bool edge = false;
+			const int x0 = max(x - 1, 0);
+			const int x1 = min(x + 1, cols - 1);
+			for (int nx = x0; nx <= x1 && !edge; ++nx)
+			{
+				edge = (rowAbove && rowAbove[nx] == WHITE) || (rowBelow && rowBelow[nx] == WHITE) || row[nx] == WHITE;
+			}
+			if (edge)
 			{
-				output.at<uchar>(y, x) = WHITE;
+				edgePixels.push_back(make_pair(Point(x, y), b));
+				blob.boundaryCount++;
 			}
 		}
 	}
 
+	LayOutBoundary(blobs, sums, edgePixels, boundary);
+
 	return true;
 }
 
 /*
-	Erosion
-	There are two supplied kernels for this, but I guess you can also supply your own
-	The kernel is placed over every input pixel. If any pixel covered by the kernel's nonzero values is
-	0, then the output pixel is 0
-	Any pixel outside the image is considered 0
+	Blob labelling on a run length encoded image
+
+	This is the same two-pass labelling as above, but a run at a time instead of a pixel at a time.
+	A run is 8-connected to a run on the row above if they overlap once the run above is
+	stretched by a pixel each way, and since both rows are sorted by x, the runs that might touch
+	are found by walking along the two rows together. 
+
+	Edge pixels are found per run too. The two end pixels of a run have a white pixel beside them
+	(unless they're at the side of the image). Any other pixel in the run is an edge pixel unless
+	all three of its neighbours above, and all three below, are black - that is, unless it lies in
+	the "safe" span of a run in the row above and of a run in the row below, where the safe span of a
+	run is the run shrunk by a pixel each end. So the edge pixels of a run are the run minus the
+	intersection of two lists of spans, which again only needs a walk along the neighbouring rows. 
+
+	The blobs and boundary come out exactly the same as from the image version, in the same order
 */
-bool Erode(const cv::Mat& input, cv::Mat& output, cv::Mat erosionKernel)
+// Helper functions
+// The safe spans, clipped to [xStart, xEnd), of the runs on a neighbouring row.
+// cursor is where to start looking on that row, and moves along as the runs we ask about do
+void FindSafeSpans(const RunLengthImage& input, int cursor, int rowEnd, int xStart, int xEnd, vector<pair<int, int> >& spans)
 {
-	// Some brief error checking
-	if (input.rows != output.rows || input.cols != output.cols)
+	spans.clear();
+	for (int r = cursor; r < rowEnd && input.runs[r].xStart < xEnd; ++r)
+	{
+		const Run& run = input.runs[r];
+		// Off-image neighbours don't count as white
+		const int lo = max((run.xStart == 0) ? 0 : run.xStart + 1, xStart);
+		const int hi = min((run.xEnd == input.cols) ? input.cols : run.xEnd - 1, xEnd);
+		if (lo < hi)
+		{
+			spans.push_back(make_pair(lo, hi));
+		}
+	}
+}
+// Intersect two sorted lists of disjoint spans
+void IntersectSpans(const vector<pair<int, int> >& a, const vector<pair<int, int> >& b, vector<pair<int, int> >& out)
+{
+	out.clear();
+	int i = 0;
+	int j = 0;
+	while (i < a.size() && j < b.size())
+	{
+		const int lo = max(a[i].first, b[j].first);
+		const int hi = min(a[i].second, b[j].second);
+		if (lo < hi)
+		{
+			out.push_back(make_pair(lo, hi));
+		}
+		if (a[i].second < b[j].second)
+		{
+			++i;
+		}
+		else
+		{
+			++j;
+		}
+	}
+}
+// Actual function
+bool LabelBlobs(const RunLengthImage& input, std::vector<Blob>& blobs, std::vector<cv::Point>& boundary)
+{
+	blobs.clear();
+	boundary.clear();
+	const int rows = input.rows;
+	const int cols = input.cols;
+	if (rows == 0 || cols == 0 || input.rowStart.size() != rows + 1)
 	{
 		return false;
 	}
+	const vector<Run>& runs = input.runs;
+	const vector<int>& rowStart = input.rowStart;
+
+	// Scratch, reused between calls. One set per thread
+	static thread_local vector<int> runLabels;
+	static thread_local vector<int> parent;
+	static thread_local vector<int> blobOfLabel;
+	static thread_local vector<int64_t> sums;
+	static thread_local vector<pair<Point, int> > edgePixels;
+	static thread_local vector<pair<int, int> > safeAbove;
+	static thread_local vector<pair<int, int> > safeBelow;
+	static thread_local vector<pair<int, int> > safe;
+	runLabels.resize(runs.size());
+	parent.clear();
+	edgePixels.clear();
+
+	// First pass: provisional labels for each run
+	for (int y = 0; y < rows; ++y)
+	{
+		int above = (y > 0) ? rowStart[y - 1] : rowStart[y];
+		const int aboveEnd = rowStart[y];
+		for (int r = rowStart[y]; r < rowStart[y + 1]; ++r)
+		{
+			const Run& run = runs[r];
+			// Runs above that end before this one (stretched) starts can't touch this or any later run
+			while (above < aboveEnd && runs[above].xEnd < run.xStart)
+			{
+				++above;
+			}
+			int l = -1;
+			for (int a = above; a < aboveEnd && runs[a].xStart <= run.xEnd; ++a)
+			{
+				l = (l < 0) ? runLabels[a] : MergeLabels(parent, l, runLabels[a]);
+			}
+			if (l < 0)
+			{
+				// A new blob, as far as we know so far
+				l = parent.size();
+				parent.push_back(l);
+			}
+			runLabels[r] = l;
+		}
+	}
 
-	// just to make sure
-	output = input.clone();
+	const int numBlobs = NumberBlobs(parent, blobOfLabel);
+	Blob emptyBlob;
+	emptyBlob.area = 0;
+	emptyBlob.boundaryStart = 0;
+	emptyBlob.boundaryCount = 0;
+	blobs.assign(numBlobs, emptyBlob);
+	sums.assign(2 * numBlobs, 0);
 
-	for (int y = 0; y < input.rows; ++y)
+	// Second pass: accumulate each blob's statistics, and find edge pixels
+	for (int y = 0; y < rows; ++y)
 	{
-		for (int x = 0; x < input.cols; ++x)
+		int above = (y > 0) ? rowStart[y - 1] : 0;
+		const int aboveEnd = (y > 0) ? rowStart[y] : 0;
+		int below = (y < rows - 1) ? rowStart[y + 1] : 0;
+		const int belowEnd = (y < rows - 1) ? rowStart[y + 2] : 0;
+		for (int r = rowStart[y]; r < rowStart[y + 1]; ++r)
 		{
-			int erosionSum = 0;
-			for (int h = 0; h < erosionKernel.rows; ++h)
+			const Run& run = runs[r];
+			const int length = run.xEnd - run.xStart;
+			const int b = blobOfLabel[runLabels[r]];
+			Blob& blob = blobs[b];
+			GrowBoundingBox(blob, run.xStart, run.xEnd, y);
+			blob.area += length;
+			// Sum of x from xStart to xEnd - 1
+			sums[2 * b] += (int64_t)(run.xStart + run.xEnd - 1) * length / 2;
+			sums[2 * b + 1] += (int64_t)y * length;
+
+			// The end pixels only count as safe if they're at the side of the image
+			const int innerStart = (run.xStart == 0) ? 0 : run.xStart + 1;
+			const int innerEnd = (run.xEnd == cols) ? cols : run.xEnd - 1;
+			if (y > 0)
 			{
-				for (int w = 0; w < erosionKernel.cols; ++w)
+				while (above < aboveEnd && runs[above].xEnd <= run.xStart)
 				{
-					Point p(x + w - 1, y + h - 1);
-					if ((p.x > 0 && p.x < input.cols) && (p.y > 0 && p.y < input.rows))
-					{
-						erosionSum += input.at<uint8_t>(p.y, p.x)*erosionKernel.at<int>(h, w);
-					}
+					++above;
 				}
+				FindSafeSpans(input, above, aboveEnd, innerStart, innerEnd, safeAbove);
 			}
-
-			if (erosionSum > 0)
+			else
 			{
-				output.at<uint8_t>(y, x) = WHITE;
+				safeAbove.assign(1, make_pair(innerStart, innerEnd));
+			}
+			if (y < rows - 1)
+			{
+				while (below < belowEnd && runs[below].xEnd <= run.xStart)
+				{
+					++below;
+				}
+				FindSafeSpans(input, below, belowEnd, innerStart, innerEnd, safeBelow);
 			}
 			else
 			{
-				output.at<uint8_t>(y, x) = input.at<uint8_t>(y, x);
+				safeBelow.assign(1, make_pair(innerStart, innerEnd));
+			}
+			IntersectSpans(safeAbove, safeBelow, safe);
+
+			// Everything else in the run is edge
+			const int edgesBefore = edgePixels.size();
+			int x = run.xStart;
+			for (const auto& span : safe)
+			{
+				for (; x < span.first; ++x)
+				{
+					edgePixels.push_back(make_pair(Point(x, y), b));
+				}
+				x = span.second;
+			}
+			for (; x < run.xEnd; ++x)
+			{
+				edgePixels.push_back(make_pair(Point(x, y), b));
 			}
+			blob.boundaryCount += edgePixels.size() - edgesBefore;
 		}
 	}
 
+	LayOutBoundary(blobs, sums, edgePixels, boundary);
+
 	return true;
 }
-
-/*
-	Find Contours
-	This requires a binarised image. We search through the image for black components,
-	and walk the edge of black and white until we meet with the starting point. Then, this
-	whole area is given to a floodfill algorithm that replaces the black with a grey that
-	signifies that this blob has been found. The image is searched further and this process
-	repeats
-*/
-// I know this is hack but it's the best way I could get it working
-const cv::Point dirs[Contour::NUM_DIRS] =
-{
-	Point(0,-1),
-	Point(-1,-1),
-	Point(-1,0),
-	Point(-1,1),
-	Point(0,1),
-	Point(1,1),
-	Point(1,0),
-	Point(1,-1)
-};
-bool PixelIsAdjacentToWhite(const Mat& input, const Point& p)
+// Keep the blobs with big enough edges as contours
+void BlobsToContours(const vector<Blob>& blobs, const vector<Point>& boundary, vector<Contour>& contours)
 {
-	for (int i = 0; i < Contour::NUM_DIRS; ++i)
+	for (const Blob& b : blobs)
 	{
-		if (!IsInBounds(input.rows, input.cols, p + dirs[i]))
-		{
-			continue;
-		}
-
-		auto pixel = input.at<uchar>(p + dirs[i]);
-		if (pixel == WHITE)
+		if (b.boundaryCount > MIN_PATH_SIZE)
 		{
-			return true;
+			contours.push_back(Contour());
+			Contour& c = contours.back();
+			c.length = b.boundaryCount;
+			c.start = boundary[b.boundaryStart];
+			c.path.assign(boundary.begin() + b.boundaryStart, boundary.begin() + b.boundaryStart + b.boundaryCount);
+			c.boundingBox = b.boundingBox;
+			c.area = b.area;
+			c.centroid = b.centroid;
 		}
 	}
-
-	return false;
 }
 bool FindContours(const cv::Mat& input, std::vector<Contour>& contours, bool debug)
 {
-	Mat img = input.clone();
+	static thread_local vector<Blob> blobs;
+	static thread_local vector<Point> boundary;
+	if (!LabelBlobs(input, blobs, boundary))
+	{
+		return false;
+	}
 
-#define NO_POINT Point(-1,-1)
+	BlobsToContours(blobs, boundary, contours);
 
-	Point start(-1, -1);
-	Contour currentContour;
-	currentContour.start = NO_POINT;
-	for (int y = 0; y < img.rows; ++y)
+	if (debug)
 	{
-		for (int x = 0; x < img.cols; ++x)
-		{
-			auto pixel = input.at<uint8_t>(y, x);
+		DrawContours(input, contours);
+	}
 
-			// Find the beginning of a contour
-			if (pixel == BLACK && PixelIsAdjacentToWhite(input, Point(x,y)))
-			{
-				start = Point(x, y);
-				// use a separate function to walk this
-				//Contour c = FindContour(img, start); // this is what's wrong
-				Contour c = FloodFillEdgePixels(img, start, USED);
-				if (c.path.size() > MIN_PATH_SIZE)
-				{
-					contours.push_back(c);
-					if (debug)
-					{
-						imshow("a contour", img);
-						waitKey(0);
-					}
-				}
-				 
-				
-			}
+#ifdef DEBUG
+	DrawContours(input, contours);
+#endif
 
-			// We found the contour here.
-			// Mark it, remove squares, then keep looking for more
-		}
+	return true;
+}
+bool FindContours(const RunLengthImage& input, std::vector<Contour>& contours, bool debug)
+{
+	static thread_local vector<Blob> blobs;
+	static thread_local vector<Point> boundary;
+	if (!LabelBlobs(input, blobs, boundary))
+	{
+		return false;
+	}
+
+	BlobsToContours(blobs, boundary, contours);
+
+	if (debug)
+	{
+		Mat draw;
+		DecodeRunLength(input, draw);
+		DrawContours(draw, contours);
 	}
 
 #ifdef DEBUG
-	DrawContours(img, contours);
+	Mat draw;
+	DecodeRunLength(input, draw);
+	DrawContours(draw, contours);
 #endif
 
 	return true;
@@ -394,78 +1215,6 @@ void TestFindContour()
 
 }
 
-/*
-	Flood fill
-
-	Given a point in an image, flood fill 8 way on the value of the
-	starting pixel. Fill with newVal
-*/
-Contour FloodFillEdgePixels(Mat& img, const Point& start, int newVal)
-{
-	Contour c;
-	c.length = 0;
-	c.start = start;	
-	//c.path.push_back(start);
-
-	// sanity check
-	if (!IsInBounds(img.rows, img.cols, start))
-	{
-		return c;
-	}
-
-	auto fillVal = img.at<uchar>(start);
-	vector<Point> stack;
-	stack.push_back(start);
-
-	while (!stack.empty())
-	{
-		// sanity
-		if (stack.size() > img.cols*img.rows)
-		{
-			break;
-		}
-		
-		// Get the front of the stack and remove it
-		Point p = stack.back();
-		stack.pop_back();
-
-		// check if this point has been taken care of already
-		if (img.at<uchar>(p) == newVal)
-		{
-			continue;
-		}
-
-		// If this point is an edge point, add it to the contour
-		if (PixelIsAdjacentToWhite(img, p))
-		{
-			c.path.push_back(p);
-		}
-
-		// fill this point
-		img.at<uchar>(p) = newVal;
-
-		// push all points around it, 8-way, that are the fill value
-		for (int i = -1; i <= 1; ++i)
-		{
-			for (int j = -1; j <= 1; ++j)
-			{
-				if (i == 0 && j == 0)
-				{
-					continue;
-				}
-
-				Point q = p + Point(i, j);
-				if (IsInBounds(img.rows, img.cols, q) && img.at<uchar>(q) == fillVal)
-				{
-					stack.push_back(q);
-				}
-			}
-		}
-	}
-
-	return c;
-}
-
 /*
 	DEBUG
 	Draw a given set of contours in an image. Should be the image they were found in
@@ -491,34 +1240,32 @@ void DrawContours(const cv::Mat& input, const std::vector<Contour>& contours)
 
 /*
 	DEBUG
-	Draw a set of lines in the image as long as they go
+	Draw a line across the whole image
 */
-void DrawLine(const cv::Mat& input, const LineSegment l)
+void DrawLine(const cv::Mat& input, const Line2f& l)
 {
 	Mat draw = input.clone();
 
-	LineSegment topEdge{ Point(0,0), Point(input.cols-1, 0) };
-	LineSegment rightEdge{ Point(input.cols-1, 0), Point(input.cols-1, input.rows-1) };
-	LineSegment bottomEdge{ Point(0,input.rows-1), Point(input.cols-1, input.rows-1) };
-	LineSegment leftEdge{ Point(0,0), Point(0, input.rows-1) };
-
-	// extend line out to meet image edge
-	// Get intersection of line with each image edge
-	// Then find the closest two points, and those frame the line we want to draw
-	auto pTop = GetIntersectionOfLines(l, topEdge);
-	auto pRight = GetIntersectionOfLines(l, rightEdge);
-	auto pBottom = GetIntersectionOfLines(l, bottomEdge);
-	auto pLeft = GetIntersectionOfLines(l, leftEdge);
-
-	// Some of these points will not be in the frame, and some will
-	if (IsInBounds(input.rows, input.cols, pTop))
-		line(draw, pTop, l.p1, (128, 128, 128), 1);
-	if (IsInBounds(input.rows, input.cols, pRight))
-		line(draw, pRight, l.p1, (128, 128, 128), 1);
-	if (IsInBounds(input.rows, input.cols, pLeft))
-		line(draw, pLeft, l.p1, (128, 128, 128), 1);
-	if (IsInBounds(input.rows, input.cols, pBottom))
-		line(draw, pBottom, l.p1, (128, 128, 128), 1);
+	const float right = (float)(input.cols - 1);
+	const float bottom = (float)(input.rows - 1);
+	const Line2f edges[4] = { LineThroughPoints(0.f, 0.f, right, 0.f), LineThroughPoints(right, 0.f, right, bottom),
+		                      LineThroughPoints(0.f, bottom, right, bottom), LineThroughPoints(0.f, 0.f, 0.f, bottom) };
+
+	// The line crosses the lines along two of the image edges inside the image, and those two
+	// points frame the part we can draw
+	vector<Point2f> ends;
+	for (const Line2f& edge : edges)
+	{
+		Point2f p;
+		if (IntersectLines(l, edge, p) && IsInBounds(input.rows, input.cols, p))
+		{
+			ends.push_back(p);
+		}
+	}
+	if (ends.size() >= 2)
+	{
+		line(draw, ends[0], ends[1], (128, 128, 128), 1);
+	}
 #ifdef DEBUG
 	namedWindow("lines", WINDOW_NORMAL);
 	imshow("lines", draw);
@@ -544,60 +1291,14 @@ int ConvolveDerivativeKernel(const int kernel[5], const int kernelDivisor, const
 
 	return result;
 }
-Point GetIntersectionOfLines(const LineSegment& l1, const LineSegment& l2)
-{
-	float a1 = l1.p2.y - l1.p1.y;
-	float b1 = l1.p1.x - l1.p2.x;
-	float c1 = -1 * l1.p1.x*a1 - l1.p1.y*b1;
-
-	float a2 = l2.p2.y - l2.p1.y;
-	float b2 = l2.p1.x - l2.p2.x;
-	float c2 = -1 * l2.p1.x*a2 - l2.p1.y*b2;
-
-	float x, y;
-	// The following comes from converting both lines from 
-	// the form ax + by + c = 0 (which is where I get the a1, etc)
-	// to y = mx + b form, and then equating the y's and solving for x
-	if ((b1 == 0 && b2 == 0) || (a1 == 0 && a2 == 0))
-	{
-		// Lines are both vertical or both horizontal. Return a dud point
-		return Point(-1, -1);
-	}
-	if (b1 == 0)
-	{
-		x = -c1 / a1;
-		y = (-a2/b2)*x + (-c2/b2);
-	}
-	else if (b2 == 0)
-	{
-		x = -c2 / a2;
-		y = (-a1 / b1)*x + (-c1 / b1);
-	}
-	else if (a1 == 0)
-	{
-		y = -c1 / b1;
-		x = (-b2/a2)*y + (-c2/a2);
-	}
-	else if (a2 == 0)
-	{
-		y = -c2 / b2;
-		x = (-b1 / a1)*y + (-c1 / a1);
-	}
-	else {
-		x = ((c2 / b2) - (c1 / b1)) / ((a1 / b1) - (a2 / b2));
-		y = -1 * (a1 / b1)*x - c1 / b1;
-	}
-
-	
-
-	return Point((int)x, (int)y);
-}
-bool CheckCornerValidity(const Contour& c, const Point& p1)
+bool CheckCornerValidity(const Contour& c, const Point2f& p1)
 {
 	bool withinBounds = false;
 	for (const auto& p : c.path)
 	{
-		if (DistBetweenPoints(p1, p) < CORNER_CONTOUR_EPSILON)
+		const float x = p.x - p1.x;
+		const float y = p.y - p1.y;
+		if (x*x + y*y < CORNER_CONTOUR_EPSILON * CORNER_CONTOUR_EPSILON)
 		{
 			withinBounds = true;
 			break;
@@ -612,7 +1313,7 @@ bool CheckCornerValidity(const Contour& c, const Point& p1)
 	return true;
 }
 // Actual function
-bool FindQuad(const Mat& img, const Contour& c, Quad& q)
+bool FindQuad(const Mat& img, const Contour& c, Quad& q, mt19937& rng)
 {
 	// get all points in a vector
 	// New idea: RANSAC
@@ -634,36 +1335,29 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 	// Seems like RANSAC dies after getting two lines, and can't get horizontal lines...
 
 	int minLineSize = points.size() / 5;
-	vector<LineSegment> lines;
+	vector<Line2f> lines;
+	vector<uchar> isInlier;
 	while (true)
 	{
 		// Search among points for a line with RANSAC
-		vector<Point> inliers;
-		pair<Point, Point> seedPoints;
-		inliers = FindLineInPointsRANSAC(points, minLineSize, RANSAC_LINE_ERROR, 500, seedPoints);
+		Line2f line;
+		const int numInliers = FindLineInPointsRANSAC(points, minLineSize, RANSAC_LINE_ERROR, RANSAC_LINE_CONFIDENCE,
+			RANSAC_LINE_MAX_ITERATIONS, line, isInlier, rng);
 
-		if (!inliers.empty())
+		if (numInliers > 0)
 		{
-			// remove inliers from points
-			for (auto p : inliers)
+			// remove inliers from points, keeping the rest in order
+			int kept = 0;
+			for (int i = 0; i < points.size(); ++i)
 			{
-				int i = 0;
-				for (i = 0; i < points.size(); ++i)
+				if (!isInlier[i])
 				{
-					if (p == points[i])
-					{
-						break;
-					}
+					points[kept++] = points[i];
 				}
-				points.erase(points.begin() + i);
 			}
+			points.resize(kept);
 
-			// Create a line segment with the start and end of inliers
-			// We define it by the two points that were used to create it
-			LineSegment l;
-			l.p1 = seedPoints.first;
-			l.p2 = seedPoints.second;
-			lines.push_back(l);
+			lines.push_back(line);
 		}
 		else
 		{
@@ -673,24 +1367,20 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 	}
 
 	// Find the centroid of the contour as a heuristic for the quad centre
-	// And the two furthest points for diagonal width
 	Point centroid(0,0);
-	float size = 0;
 	for (auto& p : c.path)
 	{
 		centroid += p;
-		for (auto& q : c.path)
-		{
-			float d = DistBetweenPoints(p, q);
-			if (d > size)
-			{
-				size = d;
-			}
-		}
 	}
 	centroid.x /= c.path.size();
 	centroid.y /= c.path.size();
 
+	// And the two furthest points for diagonal width. These are always on the convex hull,
+	// so measure that rather than every pair of contour points
+	vector<Point> hull;
+	ConvexHull(c.path, hull);
+	const float size = ConvexHullDiameter(hull);
+
 
 	// Check that there are four lines
 	if (lines.size() == 4)
@@ -701,7 +1391,7 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 		// find the intersection
 
 		int cornerIndex = 0;
-		int centreX = 0, centreY = 0;
+		float centreX = 0, centreY = 0;
 
 		// There's a better way to do this. 
 		// Get the first intersection. Remove the first line, start with the next
@@ -710,9 +1400,11 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 
 		// Get first intersection. It's either between line 0 and line 1, or l0 and l2:
 		// Try l0 and l1:
-		Point corner = GetIntersectionOfLines(lines[0], lines[1]);
-		LineSegment nextLine = lines[1];
-		LineSegment nextOtherLine = lines[2];
+		// Parallel lines never meet, so they leave the corner out of bounds
+		Point2f corner(-1, -1);
+		IntersectLines(lines[0], lines[1], corner);
+		Line2f nextLine = lines[1];
+		Line2f nextOtherLine = lines[2];
 		if (IsInBounds(img.rows, img.cols, corner) && DistBetweenPoints(corner, centroid) < size)
 		{
 			q.points[0] = corner;
@@ -722,7 +1414,8 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 		else {
 			nextLine = lines[2];
 			nextOtherLine = lines[1];
-			Point corner = GetIntersectionOfLines(lines[0], lines[2]);
+			corner = Point2f(-1, -1);
+			IntersectLines(lines[0], lines[2], corner);
 			if (IsInBounds(img.rows, img.cols, corner) && DistBetweenPoints(corner, centroid) < size)
 			{
 				q.points[0] = corner;
@@ -731,8 +1424,9 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 			}
 		}
 		// Next corner is between whatever just didn't work, and the one that did
-		corner = GetIntersectionOfLines(nextLine, nextOtherLine);
-		LineSegment finalLine = lines[3];
+		corner = Point2f(-1, -1);
+		IntersectLines(nextLine, nextOtherLine, corner);
+		Line2f finalLine = lines[3];
 		if (IsInBounds(img.rows, img.cols, corner) && DistBetweenPoints(corner, centroid) < size)
 		{
 			q.points[1] = corner;
@@ -741,7 +1435,8 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 		}
 		else {
 			// If this fails, nextLine and line 3
-			Point corner = GetIntersectionOfLines(nextLine, lines[3]);
+			corner = Point2f(-1, -1);
+			IntersectLines(nextLine, lines[3], corner);
 			finalLine = nextOtherLine;
 			nextOtherLine = lines[3];
 			if (IsInBounds(img.rows, img.cols, corner) && DistBetweenPoints(corner, centroid) < size)
@@ -752,7 +1447,8 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 			}
 		}
 		// Next corner is between what we just connected to, and the final line. This has to be a corner
-		corner = GetIntersectionOfLines(nextOtherLine, finalLine);
+		corner = Point2f(-1, -1);
+		IntersectLines(nextOtherLine, finalLine, corner);
 		if (IsInBounds(img.rows, img.cols, corner) && DistBetweenPoints(corner, centroid) < size)
 		{
 			q.points[2] = corner;
@@ -760,7 +1456,8 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 			centreY += corner.y;
 		}
 		// And last but not least, final line back to line 0
-		corner = GetIntersectionOfLines(finalLine, lines[0]);
+		corner = Point2f(-1, -1);
+		IntersectLines(finalLine, lines[0], corner);
 		if (IsInBounds(img.rows, img.cols, corner) && DistBetweenPoints(corner, centroid) < size)
 		{
 			q.points[3] = corner;
@@ -791,7 +1488,7 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 		}
 
 		// Compute the centre
-		q.centre = Point(centreX/4, centreY/4);
+		q.centre = Point2f(centreX/4.f, centreY/4.f);
 
 		return true;
 	}
@@ -800,57 +1497,189 @@ bool FindQuad(const Mat& img, const Contour& c, Quad& q)
 }
 
 /*
-	Given a quad, what's the length of the longest diagonal?
-	This also involves figuring out which corners are diagonal. 
-	For this, pick two corners, define a line, and if both other corners
-	are on the same side of it, then it's not a diagonal
+	Sub-pixel corner refinement
+
+	The corners from FindQuad are intersections of lines fitted to edge pixels, so they're only
+	good to a pixel or so. This moves each corner to the point q where, for every pixel p in a
+	window around it, the image gradient g at p is perpendicular to p - q. That's true on the
+	flat parts of the window, where g is zero, and along the edges, which all run through q.
+	So it holds at the corner of a single checker, and at the saddle point where two checkers meet.
+
+	Summing (g.(q - p))^2 over the window and minimising gives a 2x2 linear system
+		(sum g g^T) q = sum g g^T p
+	We solve that, recentre the window on the new q, and go again until it stops moving.
+	Pixels are weighted by a Gaussian so the middle of the window counts for the most.
+	This is Forstner's operator, and the same idea as OpenCV's cornerSubPix.
+
+	All corners in the frame go in one batch as flat x and y arrays, and the inner loop
+	over each window row is plain arithmetic on contiguous pixels, so it vectorises.
+	A corner whose window would leave the image, or that has no gradient around it, or that
+	wanders off more than a window away, is left where it was
 */
 // Helpers
-float DistBetweenPoints(const Point& p1, const Point& p2)
+void BuildSubPixelWeights(vector<float>& weights)
 {
-	float x = (p1.x - p2.x);
-	float y = (p1.y - p2.y);
-	return sqrt(x*x + y*y);
+	const int size = 2 * SUBPIX_HALF_WINDOW + 1;
+	const float sigma = SUBPIX_HALF_WINDOW / 2.f;
+	weights.resize(size * size);
+	for (int y = 0; y < size; ++y)
+	{
+		for (int x = 0; x < size; ++x)
+		{
+			const float dx = (float)(x - SUBPIX_HALF_WINDOW);
+			const float dy = (float)(y - SUBPIX_HALF_WINDOW);
+			weights[y * size + x] = exp(-(dx*dx + dy*dy) / (2 * sigma * sigma));
+		}
+	}
 }
-// Actual
-float GetLongestDiagonal(const Quad& q)
+bool RefineCornerSubPixel(const Mat& img, const vector<float>& weights, float& cornerX, float& cornerY)
 {
-	// Just go over all pairs of points and get the longest distance
-	// between two pairs
-	// Since a side won't be bigger than a diagonal unless we have a really
-	// weird lens
-	float maxDist = 0;
-	for (int i = 0; i < 4; ++i)
+	const int size = 2 * SUBPIX_HALF_WINDOW + 1;
+	float x = cornerX;
+	float y = cornerY;
+
+	for (int it = 0; it < SUBPIX_MAX_ITERATIONS; ++it)
 	{
-		Point p1 = q.points[i];
-		for (int j = i + 1; j < 4; ++j)
+		const int cx = (int)floor(x + 0.5f);
+		const int cy = (int)floor(y + 0.5f);
+		// We need one more pixel around the window for the central differences
+		if (cx - SUBPIX_HALF_WINDOW - 1 < 0 || cx + SUBPIX_HALF_WINDOW + 1 >= img.cols ||
+			cy - SUBPIX_HALF_WINDOW - 1 < 0 || cy + SUBPIX_HALF_WINDOW + 1 >= img.rows)
 		{
-			Point p2 = q.points[j];
+			return false;
+		}
 
-			float dist = DistBetweenPoints(p1, p2);
-			if (dist > maxDist)
+		// Accumulate relative to the window centre, so that the sums stay small
+		float a00 = 0, a01 = 0, a11 = 0, b0 = 0, b1 = 0;
+		for (int wy = 0; wy < size; ++wy)
+		{
+			const int py = cy - SUBPIX_HALF_WINDOW + wy;
+			const uchar* above = img.ptr<uchar>(py - 1) + cx - SUBPIX_HALF_WINDOW;
+			const uchar* row = img.ptr<uchar>(py) + cx - SUBPIX_HALF_WINDOW;
+			const uchar* below = img.ptr<uchar>(py + 1) + cx - SUBPIX_HALF_WINDOW;
+			const float* w = &weights[wy * size];
+			const float dy = (float)(wy - SUBPIX_HALF_WINDOW);
+			for (int wx = 0; wx < size; ++wx)
 			{
-				maxDist = dist;
+				const float gx = 0.5f * ((float)row[wx + 1] - (float)row[wx - 1]);
+				const float gy = 0.5f * ((float)below[wx] - (float)above[wx]);
+				const float dx = (float)(wx - SUBPIX_HALF_WINDOW);
+				const float gxx = w[wx] * gx * gx;
+				const float gxy = w[wx] * gx * gy;
+				const float gyy = w[wx] * gy * gy;
+				a00 += gxx;
+				a01 += gxy;
+				a11 += gyy;
+				b0 += gxx * dx + gxy * dy;
+				b1 += gxy * dx + gyy * dy;
 			}
 		}
+
+		const float det = a00 * a11 - a01 * a01;
+		// Edges in only one direction, or no edges at all, don't pin the corner down
+		if (det <= 1e-6f * (a00 + a11) * (a00 + a11))
+		{
+			return false;
+		}
+		const float newX = cx + (a11 * b0 - a01 * b1) / det;
+		const float newY = cy + (a00 * b1 - a01 * b0) / det;
+
+		const float moveX = newX - x;
+		const float moveY = newY - y;
+		x = newX;
+		y = newY;
+		if (moveX*moveX + moveY*moveY < SUBPIX_EPSILON * SUBPIX_EPSILON)
+		{
+			break;
+		}
+	}
+
+	if (abs(x - cornerX) > SUBPIX_HALF_WINDOW || abs(y - cornerY) > SUBPIX_HALF_WINDOW)
+	{
+		// This has run off somewhere else
+		return false;
+	}
+	cornerX = x;
+	cornerY = y;
+	return true;
+}
+// Actual functions
+void RefineCornersSubPixel(const cv::Mat& img, std::vector<float>& xs, std::vector<float>& ys)
+{
+	vector<float> weights;
+	BuildSubPixelWeights(weights);
+
+	for (int i = 0; i < xs.size(); ++i)
+	{
+		RefineCornerSubPixel(img, weights, xs[i], ys[i]);
+	}
+}
+
+void RefineQuadCorners(const cv::Mat& img, std::vector<Quad>& quads)
+{
+	// Gather every corner in the frame into one batch
+	vector<float> xs(4 * quads.size());
+	vector<float> ys(4 * quads.size());
+	for (int i = 0; i < quads.size(); ++i)
+	{
+		for (int c = 0; c < 4; ++c)
+		{
+			xs[4 * i + c] = quads[i].points[c].x;
+			ys[4 * i + c] = quads[i].points[c].y;
+		}
 	}
 
-	return maxDist;
+	RefineCornersSubPixel(img, xs, ys);
+
+	// And put them back, with the centres recomputed from the refined corners.
+	// The centre is where the diagonals cross, since that stays the centre under perspective,
+	// where the average of the corners doesn't
+	for (int i = 0; i < quads.size(); ++i)
+	{
+		Quad& q = quads[i];
+		for (int c = 0; c < 4; ++c)
+		{
+			q.points[c] = Point2f(xs[4 * i + c], ys[4 * i + c]);
+		}
+
+		if (!IntersectLines(LineThroughPoints(q.points[0], q.points[2]), LineThroughPoints(q.points[1], q.points[3]), q.centre))
+		{
+			q.centre = (q.points[0] + q.points[1] + q.points[2] + q.points[3]) * 0.25f;
+		}
+	}
 }
 
 /*
-	Returns +ve for one side, -ve for the other. Useful for checking whether
-	two points lie on the same side of the line. 
-	p is the point, p1 and p2 form the line, defined as p1 to p2
+	Given a quad, what's the length of the longest diagonal?
+	This also involves figuring out which corners are diagonal. 
+	For this, pick two corners, define a line, and if both other corners
+	are on the same side of it, then it's not a diagonal
 */
-int PointDistToLineSigned(const Point& p, const Point& p1, const Point& p2)
+// Helpers
+float DistBetweenPoints(const Point2f& p1, const Point2f& p2)
+{
+	float x = (p1.x - p2.x);
+	float y = (p1.y - p2.y);
+	return sqrt(x*x + y*y);
+}
+// Actual
+float GetLongestDiagonal(const Quad& q)
 {
-	const int a = p2.y - p1.y;
-	const int b = p1.x - p2.x;
-	const int c = -1 * p1.x*a - p1.y*b;
+	// The longest distance between any two corners.
+	// Since a side won't be bigger than a diagonal unless we have a really
+	// weird lens
+	vector<Point2f> corners(q.points, q.points + 4);
+	vector<Point2f> hull;
+	ConvexHull(corners, hull);
+	return ConvexHullDiameter(hull);
+}
 
-	int d = (a*p.x + b * p.y + c) / sqrt(a*a + b * b);
-	return d;
+RotatedRect GetBoundingRect(const Quad& q)
+{
+	vector<Point2f> corners(q.points, q.points + 4);
+	vector<Point2f> hull;
+	ConvexHull(corners, hull);
+	return MinAreaBoundingRect(hull);
 }
 
 /*
@@ -873,14 +1702,11 @@ bool CompareQuadByAngleToCentre(Quad a, Quad b)
 	For two quads, does a point lie within the quadrilateral defined
 	by the lines from each quad's centre, perpendicular to the quad's sides?
 */
-bool DoesPointLieWithinQuadOfTwoCentres(const Point& p, const Quad& q1, const Quad& q2)
+bool DoesPointLieWithinQuadOfTwoCentres(const Point2f& p, const Quad& q1, const Quad& q2)
 {
 	// Check if the point is the same side of each line as the centre point of the line between
-	// the centres
-	// as that line must be within the quad 
-	// have a function that takes in a line and a point and returns 1 for one side and -1 for the other
-
-	Point centre((q1.centre.x+q2.centre.x)/2, (q1.centre.y + q2.centre.y) / 2);
+	// the centres, as that point must be within the quad
+	const Point2f centre = (q1.centre + q2.centre) * 0.5f;
 	
 	// construct the lines perpendicular to each side. To do this, we draw lines 
 	// from the centres of the quads to the midpoints of each side. The midpoint
@@ -889,31 +1715,25 @@ bool DoesPointLieWithinQuadOfTwoCentres(const Point& p, const Quad& q1, const Qu
 	// non-opposite ones which is a pain now that I think about it
 	// TODO: label quad points as diagonal or not
 	// Pick corners that are adjacent. Corners 0 and 1 for one side, and 1 and 2 for the other
-	Point q1SideMid1((q1.points[0].x+q1.points[1].x)/2, (q1.points[0].y + q1.points[1].y)/2); // 0 and 1
-	Point q1SideMid2((q1.points[1].x + q1.points[2].x) / 2, (q1.points[1].y + q1.points[2].y) / 2); // 
-	Point q2SideMid1((q2.points[0].x + q2.points[1].x) / 2, (q2.points[0].y + q2.points[1].y) / 2);
-	Point q2SideMid2((q2.points[1].x + q2.points[2].x) / 2, (q2.points[1].y + q2.points[2].y) / 2);
-
-	int value = PointDistToLineSigned(p, q1.centre, q1SideMid1)*PointDistToLineSigned(centre, q1.centre, q1SideMid1);
-	if (value > 0) // they're either both positive or both negative. Thus, same side of the line
+	const Line2f sides[4] = { LineThroughPoints(q1.centre, (q1.points[0] + q1.points[1]) * 0.5f),
+		                      LineThroughPoints(q1.centre, (q1.points[1] + q1.points[2]) * 0.5f),
+		                      LineThroughPoints(q2.centre, (q2.points[0] + q2.points[1]) * 0.5f),
+		                      LineThroughPoints(q2.centre, (q2.points[1] + q2.points[2]) * 0.5f) };
+
+	// Both points have to be clearly on the same side of every line. A corner within a pixel
+	// of one of them is as likely to belong to a neighbouring pair of checkers
+	for (const Line2f& side : sides)
 	{
-		// Repeat for next lines
-		value = PointDistToLineSigned(p, q1.centre, q1SideMid2)*PointDistToLineSigned(centre, q1.centre, q1SideMid2);
-		if (value > 0)
+		const Line2f u = Normalised(side);
+		const float dp = EvaluateLine(u, p.x, p.y);
+		const float dc = EvaluateLine(u, centre.x, centre.y);
+		if (abs(dp) < QUAD_SIDE_MARGIN || abs(dc) < QUAD_SIDE_MARGIN || !OnSameSideOfLine(u, p, centre))
 		{
-			value = PointDistToLineSigned(p, q2.centre, q2SideMid1)*PointDistToLineSigned(centre, q2.centre, q2SideMid1);
-			if (value > 0) 
-			{
-				value = PointDistToLineSigned(p, q2.centre, q2SideMid2)*PointDistToLineSigned(centre, q2.centre, q2SideMid2);
-				if (value > 0)
-				{
-					return true;
-				}
-			}
+			return false;
 		}
 	}
 
-	return false;
+	return true;
 }
 
 /*
@@ -4,6 +4,8 @@
 #include <opencv2/highgui.hpp>
 #include <vector>
 #include <utility>
+#include <random>
+#include "Lines.h"
 
 struct Contour
 {
@@ -23,6 +25,39 @@ struct Contour
 	//std::vector<DIRECTION> path;
 	std::vector<cv::Point> path;
 	cv::Point start;
+
+	// Of the whole blob, not just the edge
+	cv::Rect boundingBox;
+	int area;
+	cv::Point2f centroid;
+};
+
+// A connected blob of black pixels. Its edge pixels are the boundaryCount entries
+// of a shared boundary array, starting from boundaryStart
+struct Blob
+{
+	cv::Rect boundingBox;
+	int area;
+	cv::Point2f centroid;
+	int boundaryStart;
+	int boundaryCount;
+};
+
+// A horizontal run of black pixels, from xStart up to but not including xEnd
+struct Run
+{
+	int xStart;
+	int xEnd;
+};
+
+// A binary image stored as its runs of black pixels, in raster order.
+// The runs on row y are runs[rowStart[y]] up to runs[rowStart[y + 1]]
+struct RunLengthImage
+{
+	int rows;
+	int cols;
+	std::vector<Run> runs;
+	std::vector<int> rowStart;
 };
 
 struct Quad
@@ -57,12 +92,6 @@ struct Quad
 	}
 };
 
-struct LineSegment
-{
-	cv::Point p1;
-	cv::Point p2;
-};
-
 /*
 	Prototypes of some common image operation functions like
 	thresholding and erosion
@@ -71,18 +100,37 @@ struct LineSegment
 const cv::Mat cross = (cv::Mat_<int>(3, 3) << 0, 1, 0, 1, 1, 1, 0, 1, 0);
 const cv::Mat rect = (cv::Mat_<int>(3, 3) << 1, 1, 1, 1, 1, 1, 1, 1, 1);
 
-// Requires that kernelSize be odd and positive
-bool GaussianThreshold(const cv::Mat& input, cv::Mat& output, int kernelSize, int constant);
+// Threshold each pixel against the mean of the windowSize square around it.
+// Pixels more than percent darker than their local mean are black
+bool AdaptiveThreshold(const cv::Mat& input, cv::Mat& output, int windowSize, int percent);
+
+// As AdaptiveThreshold, but straight into runs, without ever writing out the binary image
+bool AdaptiveThresholdRunLength(const cv::Mat& input, RunLengthImage& output, int windowSize, int percent);
 
 bool AverageThreshold(const cv::Mat& input, cv::Mat& output);
 
+// As AverageThreshold, but straight into runs, without ever writing out the binary image
+bool AverageThresholdRunLength(const cv::Mat& input, RunLengthImage& output);
+
+// Run length encode an already binarised image, and back again
+bool EncodeRunLength(const cv::Mat& input, RunLengthImage& output);
+void DecodeRunLength(const RunLengthImage& input, cv::Mat& output);
+
 bool IsInBounds(int height, int width, cv::Point p);
+bool IsInBounds(int height, int width, cv::Point2f p);
 
 // Erosion using one of the supplied kernels
 bool Erode(const cv::Mat& input, cv::Mat& output, cv::Mat erosionKernel);
 
+// Find all 8-connected black blobs in a binarised image, in two linear passes.
+// The edge pixels of all blobs go into boundary, one blob after another
+bool LabelBlobs(const cv::Mat& input, std::vector<Blob>& blobs, std::vector<cv::Point>& boundary);
+// The same, but working on runs, so it takes time in the number of runs rather than pixels
+bool LabelBlobs(const RunLengthImage& input, std::vector<Blob>& blobs, std::vector<cv::Point>& boundary);
+
 // Find all contours in a binarised image
 bool FindContours(const cv::Mat& input, std::vector<Contour>& contours, bool debug=false);
+bool FindContours(const RunLengthImage& input, std::vector<Contour>& contours, bool debug=false);
 
 // DEBUG - draw all contours in an image
 void DrawContours(const cv::Mat& input, const std::vector<Contour>& contours);
@@ -91,32 +139,33 @@ void DrawContours(const cv::Mat& input, const std::vector<Contour>& contours);
 //Contour FindContour(const cv::Mat& input, const cv::Point& start);
 void TestFindContour();
 
-// Floodfill part of an image, given a starting point, using its value
-// Changes all of that value, that touch it, to the second value
-Contour FloodFillEdgePixels(cv::Mat& img, const cv::Point& start, int newVal);
-
 // Find a quadrangle in a contour, or return false if it isn't confident
-bool FindQuad(const cv::Mat& img, const Contour& c, Quad& q);
+// Line fitting is randomised, and draws from the given RNG
+bool FindQuad(const cv::Mat& img, const Contour& c, Quad& q, std::mt19937& rng);
 
-// Distance between two points
-float DistBetweenPoints(const cv::Point& p1, const cv::Point& p2);
+// Move corners to sub-pixel accuracy using the image gradients around them.
+// This works for a lone checker's corner and for the saddle where two checkers meet
+void RefineCornersSubPixel(const cv::Mat& img, std::vector<float>& xs, std::vector<float>& ys);
+
+// Refine all the corners of a frame's quads in one batch, and recompute their centres from them
+void RefineQuadCorners(const cv::Mat& img, std::vector<Quad>& quads);
 
-// Distance from point to line, signed
-int PointDistToLineSigned(const cv::Point& p, const cv::Point& p1, const cv::Point& p2);
+// Distance between two points
+float DistBetweenPoints(const cv::Point2f& p1, const cv::Point2f& p2);
 
 // Compare quads
 bool CompareQuadByCentreX(Quad* a, Quad* b);
 bool CompareQuadByAngleToCentre(Quad a, Quad b);
 
-//  Intersection of two lines
-cv::Point GetIntersectionOfLines(const LineSegment& l1, const LineSegment& l2);
-
 // Does a point lie within the quad defined by two other points?
-bool DoesPointLieWithinQuadOfTwoCentres(const cv::Point& p, const Quad& q1, const Quad& q2);
+bool DoesPointLieWithinQuadOfTwoCentres(const cv::Point2f& p, const Quad& q1, const Quad& q2);
 
 // Find the length of the longest diagonal of a quad
 float GetLongestDiagonal(const Quad& q);
 
+// The smallest rectangle that contains a quad
+cv::RotatedRect GetBoundingRect(const Quad& q);
+
 bool OrderTwoQuadsByAscendingCentreX(Quad a, Quad b);
 
 // DEBUG - draw quad in an image
@@ -125,4 +174,4 @@ cv::Mat DrawQuad(const cv::Mat& input, const Quad& q);
 void DrawQuadsNumbered(const cv::Mat& input, const std::vector<Quad>& quads);
 
 // DEBUG - draw a line
-void DrawLine(const cv::Mat& input, const LineSegment l);
+void DrawLine(const cv::Mat& input, const Line2f& l);
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <cmath>
+
+#define LM_INITIAL_LAMBDA 1e-3f
+#define LM_MAX_LAMBDA 1e10f
+#define LM_MIN_RELATIVE_DECREASE 1e-6f
+#define LM_MIN_RELATIVE_STEP 1e-7f
+
+/*
+	Levenberg-Marquardt, for small problems with a fixed number of parameters
+
+	A problem plugs in by providing
+	    static const int NumParams;
+	    float Accumulate(const Params& p, Hessian& JtJ, Gradient& Jte) const;
+	    float Cost(const Params& p) const;
+	where Params, Hessian and Gradient are the fixed-size types below. Accumulate fills in JtJ
+	and Jte from scratch at p and returns the cost there, which is the sum of squared errors.
+	Errors are observed - predicted, and J is the derivative of the prediction, so the
+	Gauss-Newton step is JtJ^-1 Jte and gets added to p.
+
+	Everything is sized at compile time, so the normal equations live on the stack and nothing
+	is allocated in the loop.
+
+	Each iteration solves the damped equations (JtJ + lambda diag(JtJ)) d = Jte. Scaling the
+	damping by the diagonal makes it independent of the units of each parameter. The step is only
+	kept if it lowers the cost, in which case lambda goes down towards Gauss-Newton. If it
+	doesn't, lambda goes up towards small gradient descent steps, and we try again from the same
+	point without re-accumulating anything.
+	We stop when
+	- the cost or the step shrinks by less than the given relative amounts, or
+	- the cost is below an absolute threshold, or
+	- lambda gets so big that no step is going to help, or
+	- we run out of iterations.
+
+	See Ethan Eade, http://ethaneade.com/optimization.pdf, and Madsen, Nielsen and Tingleff,
+	Methods for Non-Linear Least Squares Problems, section 3.2
+*/
+struct LMSettings
+{
+	int maxIterations;
+	float costThreshold;
+	float minRelativeDecrease;
+	float minRelativeStep;
+};
+
+struct LMSummary
+{
+	float initialCost;
+	float finalCost;
+	int iterations;
+	bool converged;
+};
+
+template <typename Problem>
+LMSummary LevenbergMarquardt(const Problem& problem, const LMSettings& settings,
+	                         Eigen::Matrix<float, Problem::NumParams, 1>& params)
+{
+	typedef Eigen::Matrix<float, Problem::NumParams, 1> Vector;
+	typedef Eigen::Matrix<float, Problem::NumParams, Problem::NumParams> Matrix;
+
+	Matrix JtJ;
+	Vector Jte;
+	float cost = problem.Accumulate(params, JtJ, Jte);
+	float lambda = LM_INITIAL_LAMBDA;
+
+	LMSummary summary = { cost, cost, 0, false };
+	for (int its = 0; its < settings.maxIterations; ++its)
+	{
+		summary.iterations = its + 1;
+		if (cost < settings.costThreshold)
+		{
+			summary.converged = true;
+			break;
+		}
+
+		Matrix damped = JtJ;
+		damped.diagonal() *= (1 + lambda);
+		const Vector step = damped.ldlt().solve(Jte);
+		if (!step.allFinite())
+		{
+			break;
+		}
+		if (step.norm() <= settings.minRelativeStep * (params.norm() + settings.minRelativeStep))
+		{
+			summary.converged = true;
+			break;
+		}
+
+		const Vector candidate = params + step;
+		const float newCost = problem.Cost(candidate);
+		if (newCost < cost)
+		{
+			// Accept, and trust the quadratic model more
+			const bool converged = (cost - newCost) <= settings.minRelativeDecrease * cost;
+			params = candidate;
+			cost = problem.Accumulate(params, JtJ, Jte);
+			lambda /= 10;
+			if (converged)
+			{
+				summary.converged = true;
+				break;
+			}
+		}
+		else
+		{
+			// Reject, and take a smaller, more gradient-like step next time
+			lambda *= 10;
+			if (lambda > LM_MAX_LAMBDA)
+			{
+				summary.converged = true;
+				break;
+			}
+		}
+	}
+
+	summary.finalCost = cost;
+	return summary;
+}
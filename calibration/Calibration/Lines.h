@@ -0,0 +1,181 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <cmath>
+
+// USE_SSE2 is set for the whole project, in its preprocessor definitions, so every file agrees on it
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+	Lines in the plane
+
+	A line is kept as (a, b, c), with ax + by + c = 0 on the line. This is its homogeneous form,
+	so the line through two points and the point where two lines cross are both just cross
+	products. There are no special cases for vertical or horizontal lines, and the only thing
+	that can go wrong is parallel lines, which meet at infinity.
+
+	ax + by + c is the distance to the line times the length of (a, b). Which side of a line a
+	point is on only needs the sign, so there's no square root at all for that. For distances,
+	normalise the line once so that a^2 + b^2 = 1, and then ax + by + c is the signed distance
+	for every point after it.
+
+	Everything is templated on the scalar type, so there are float and double versions of each.
+	The kernels that don't need a square root are constexpr. The batch kernels take points as
+	separate x and y arrays, which is the layout that vectorises
+*/
+template <typename T>
+struct Line2
+{
+	T a;
+	T b;
+	T c;
+};
+typedef Line2<float> Line2f;
+typedef Line2<double> Line2d;
+
+// The line through two points. (a, b) is as long as the distance between them,
+// and it's all zero if they're the same point
+template <typename T>
+constexpr Line2<T> LineThroughPoints(const T x1, const T y1, const T x2, const T y2)
+{
+	return Line2<T>{ y2 - y1, x1 - x2, x2*y1 - x1*y2 };
+}
+template <typename T>
+inline Line2<T> LineThroughPoints(const cv::Point_<T>& p1, const cv::Point_<T>& p2)
+{
+	return LineThroughPoints(p1.x, p1.y, p2.x, p2.y);
+}
+
+// ax + by + c. The sign says which side of the line the point is on
+template <typename T>
+constexpr T EvaluateLine(const Line2<T>& l, const T x, const T y)
+{
+	return l.a*x + l.b*y + l.c;
+}
+
+// Are two points strictly on the same side of a line? A point on the line is on neither side
+template <typename T>
+constexpr bool OnSameSideOfLine(const Line2<T>& l, const T x1, const T y1, const T x2, const T y2)
+{
+	return EvaluateLine(l, x1, y1) * EvaluateLine(l, x2, y2) > 0;
+}
+template <typename T>
+inline bool OnSameSideOfLine(const Line2<T>& l, const cv::Point_<T>& p1, const cv::Point_<T>& p2)
+{
+	return OnSameSideOfLine(l, p1.x, p1.y, p2.x, p2.y);
+}
+
+// Where two lines cross. Returns false, and leaves the point alone, if they're parallel
+template <typename T>
+constexpr bool IntersectLines(const Line2<T>& l1, const Line2<T>& l2, T& x, T& y)
+{
+	const T w = l1.a*l2.b - l2.a*l1.b;
+	if (w == 0)
+	{
+		return false;
+	}
+	x = (l1.b*l2.c - l2.b*l1.c) / w;
+	y = (l2.a*l1.c - l1.a*l2.c) / w;
+	return true;
+}
+template <typename T>
+inline bool IntersectLines(const Line2<T>& l1, const Line2<T>& l2, cv::Point_<T>& p)
+{
+	return IntersectLines(l1, l2, p.x, p.y);
+}
+
+// Scale a line so that a^2 + b^2 = 1. A line through two equal points stays all zero
+template <typename T>
+inline Line2<T> Normalised(const Line2<T>& l)
+{
+	const T norm = std::sqrt(l.a*l.a + l.b*l.b);
+	if (norm == 0)
+	{
+		return Line2<T>{ 0, 0, 0 };
+	}
+	return Line2<T>{ l.a / norm, l.b / norm, l.c / norm };
+}
+
+// Signed distance from a point to a line. For many points, normalise the line once
+// and use EvaluateLine instead
+template <typename T>
+inline T SignedDistToLine(const Line2<T>& l, const T x, const T y)
+{
+	return EvaluateLine(Normalised(l), x, y);
+}
+template <typename T>
+inline T SignedDistToLine(const Line2<T>& l, const cv::Point_<T>& p)
+{
+	return SignedDistToLine(l, p.x, p.y);
+}
+
+// Signed distances from n points to a line
+template <typename T>
+inline void SignedDistsToLine(const Line2<T>& l, const T* xs, const T* ys, const int n, T* dists)
+{
+	const Line2<T> u = Normalised(l);
+	for (int i = 0; i < n; ++i)
+	{
+		dists[i] = EvaluateLine(u, xs[i], ys[i]);
+	}
+}
+
+// Mark which of n points are within maxDist of a line, and return how many are
+template <typename T>
+inline int MarkPointsNearLine(const Line2<T>& l, const T* xs, const T* ys, const int n, const T maxDist, uchar* isNear)
+{
+	const Line2<T> u = Normalised(l);
+	int count = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		isNear[i] = (std::abs(EvaluateLine(u, xs[i], ys[i])) <= maxDist);
+		count += isNear[i];
+	}
+	return count;
+}
+
+// How many of n points are within maxDist of a line
+template <typename T>
+inline int CountPointsNearLine(const Line2<T>& l, const T* xs, const T* ys, const int n, const T maxDist)
+{
+	const Line2<T> u = Normalised(l);
+	int count = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		count += (std::abs(EvaluateLine(u, xs[i], ys[i])) <= maxDist);
+	}
+	return count;
+}
+#ifdef USE_SSE2
+// Four points at a time. A comparison sets a lane to all ones, which is -1, so subtracting it counts
+template <>
+inline int CountPointsNearLine<float>(const Line2f& l, const float* xs, const float* ys, const int n, const float maxDist)
+{
+	const Line2f u = Normalised(l);
+	const __m128 a = _mm_set1_ps(u.a);
+	const __m128 b = _mm_set1_ps(u.b);
+	const __m128 c = _mm_set1_ps(u.c);
+	const __m128 limit = _mm_set1_ps(maxDist);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+	__m128i counts = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, _mm_loadu_ps(xs + i)), _mm_mul_ps(b, _mm_loadu_ps(ys + i))), c);
+		d = _mm_and_ps(d, absMask);
+		counts = _mm_sub_epi32(counts, _mm_castps_si128(_mm_cmple_ps(d, limit)));
+	}
+	int lanes[4];
+	_mm_storeu_si128((__m128i*)lanes, counts);
+	int count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	for (; i < n; ++i)
+	{
+		count += (std::abs(EvaluateLine(u, xs[i], ys[i])) <= maxDist);
+	}
+	return count;
+}
+#endif
@@ -1,33 +1,340 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <fstream>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <chrono>
 #include <math.h>
 #include "Features.h"
 #include "Estimation.h"
 #include "Calibration.h"
 #include "Image.h"
+#include "Selection.h"
+#include "ThreadPool.h"
 
 using namespace std;
 using namespace cv;
 using namespace Eigen;
 
-#define CHECKERBOARD_FILENAME "checkerboard.jpg"
+#define BOARD_FILENAME "board.txt"
+
+// Each image gets its own RNG, seeded from this plus the image number,
+// so that detection is reproducible no matter how the images are scheduled
+#define DETECTION_SEED 1998
+#define MAX_DETECTION_ATTEMPTS 5
+
+// Watching a folder, we wait this long for the next image before deciding capture has finished
+#define ONLINE_WAIT_MS 10000
+#define ONLINE_POLL_MS 100
+// An image is only read once its file has stayed the same size for this long, so that it's finished being written
+#define ONLINE_SETTLE_MS 500
+// Online, the estimate has settled once K changes by less than this fraction for this many frames in a row
+#define ONLINE_STABLE_CHANGE 1e-3f
+#define ONLINE_STABLE_FRAMES 5
 
 //#define DEBUG
 //#define DEBUG_DRAW_CHECKERS
 //#define DEBUG_NUMBER_CHECKERS
 //#define DEBUG_CALIBRATION
 
+/*
+	Per-image work: find the checkers, and find the homography to the synthetic checkerboard.
+	In batch mode this runs as a task on the thread pool, so it touches nothing shared except to
+	read it, and it writes its messages into its own log.
+
+	Returns false if this image is no good for calibration
+*/
+bool ProcessFrame(Mat& img, const int imageNumber, const BoardDescriptor& board,
+	              const vector<Quad>& gtQuads, mt19937& rng, Calibration& c, ostream& log)
+{
+	// Get the quads in the image, and match them to the board with a homography.
+	// We run this several times just in case, since there is some randomness in the detection.
+	// Each attempt draws fresh samples from this image's RNG. Detection can miss a few checkers
+	// and still pass, and then it might not match, so that counts as a bad attempt too
+	vector<Quad> quads;
+	Matrix3f H;
+	bool matched = false;
+	for (int its = 0; its < MAX_DETECTION_ATTEMPTS && !matched; ++its)
+	{
+		quads.clear();
+		log << "Finding checkers in captured image" << endl;
+		if (!CheckerDetection(img, board, quads, false, rng))
+		{
+			log << "Bad image for checkers in image " << imageNumber << endl;
+			continue;
+		}
+		log << "Found " << quads.size() << " quads" << endl;
+
+		// set up matches and create homography
+		log << "Finding homography for captured checkers" << endl;
+		matched = GetHomographyAndMatchQuads(H, img, board, gtQuads, quads);
+		if (!matched)
+		{
+			log << "Failed to find homography for image " << imageNumber << endl;
+		}
+	}
+	if (!matched)
+	{
+		log << "No usable checkers in image " << imageNumber << endl;
+		return false;
+	}
+
+	// Should there be homography refinement here?
+	// Yes. Yes there should be. I just haven't added it yet
+
+	// Store
+	// Need to store all our homographies in non-normalised coords
+	// Multiply on the right by the normalisation
+	c.H = H.inverse();
+	c.H /= c.H(2, 2);
+	c.quads = quads;
+	c.size = Point2f(img.cols, img.rows);
+
+	// free the memory
+	img.release();
+
+	return true;
+}
+
+bool ProcessImage(const string& folder, const int imageNumber, const BoardDescriptor& board,
+	              const vector<Quad>& gtQuads, mt19937& rng, Calibration& c, stringstream& log)
+{
+	// Read in the image
+	const string filename = folder + "\\" + to_string(imageNumber) + ".jpg";
+	Mat img = imread(filename, IMREAD_GRAYSCALE);
+	log << "Reading image " << filename << endl;
+
+	return ProcessFrame(img, imageNumber, board, gtQuads, rng, c, log);
+}
+
+/*
+	Frames for online calibration come either from a video, or from numbered images turning up in
+	a folder as they're captured
+*/
+struct FrameSource
+{
+	VideoCapture video;
+	string folder;
+	bool watching;
+	int next;
+};
+
+// The size of a file in bytes, or -1 if it isn't there
+long FileSize(const string& filename)
+{
+	ifstream file(filename, ios::binary | ios::ate);
+	if (!file)
+	{
+		return -1;
+	}
+	return (long)file.tellg();
+}
+
+bool NextFrame(FrameSource& source, Mat& img)
+{
+	if (!source.watching)
+	{
+		Mat frame;
+		if (!source.video.read(frame) || frame.empty())
+		{
+			return false;
+		}
+		if (frame.channels() == 1)
+		{
+			img = frame;
+		}
+		else
+		{
+			cvtColor(frame, img, COLOR_BGR2GRAY);
+		}
+		source.next++;
+		return true;
+	}
+
+	// Wait for the next image to turn up, and to be completely written. A JPEG that's only partly
+	// written still reads, just with the bottom missing, so we can't go by whether it reads.
+	// It's done once the image after it has turned up, or once its size hasn't changed for ONLINE_SETTLE_MS
+	const string filename = source.folder + "\\" + to_string(source.next) + ".jpg";
+	const string nextFilename = source.folder + "\\" + to_string(source.next + 1) + ".jpg";
+	long lastSize = -1;
+	int settled = 0;
+	for (int waited = 0; waited <= ONLINE_WAIT_MS + ONLINE_SETTLE_MS; waited += ONLINE_POLL_MS)
+	{
+		const long size = FileSize(filename);
+		settled = (size > 0 && size == lastSize) ? settled + ONLINE_POLL_MS : 0;
+		if (size > 0 && (settled >= ONLINE_SETTLE_MS || FileSize(nextFilename) > 0))
+		{
+			img = imread(filename, IMREAD_GRAYSCALE);
+			if (!img.empty())
+			{
+				cout << "Reading image " << filename << endl;
+				source.next++;
+				return true;
+			}
+		}
+		lastSize = size;
+		this_thread::sleep_for(chrono::milliseconds(ONLINE_POLL_MS));
+	}
+	return false;
+}
+
+/*
+	The online selection is of the frames the calibration has, by their index in its estimates.
+	Outlier rejection can drop frames that went in earlier, and starting again from Zhang brings
+	them all back. Either way the selection no longer matches, so we make it again from the frames
+	the calibration still has
+*/
+template <typename Real, typename Accum>
+void MatchSelectionToCalibration(const OnlineCalibration<Real, Accum>& online, FrameSelection& selection)
+{
+	int numKept = 0;
+	for (int n = 0; n < online.estimates.size(); ++n)
+	{
+		numKept += OnlineFrameKept(online, n);
+	}
+	bool matches = (numKept == selection.frames.size());
+	for (const int n : selection.frames)
+	{
+		matches = matches && OnlineFrameKept(online, n);
+	}
+	if (matches)
+	{
+		return;
+	}
+
+	ResetFrameSelection(selection, selection.imageSize);
+	for (int n = 0; n < online.estimates.size(); ++n)
+	{
+		if (OnlineFrameKept(online, n))
+		{
+			AddFrameToSelection(selection, online.estimates[n], n);
+		}
+	}
+}
+
+/*
+	Online calibration. Each frame is detected as it arrives, goes into the calibration, and
+	we print K every time the calibration takes a frame. Once K stops moving, there's no point
+	capturing any more, and we say so. Detection happens a frame at a time, and the pool is
+	for refinement
+*/
+template <typename Real, typename Accum>
+int RunOnlineCalibration(FrameSource& source, const BoardDescriptor& board, const vector<Quad>& gtQuads, ThreadPool& pool)
+{
+	map<int, Quad> gtQuadMap;
+	for (const Quad& q : gtQuads)
+	{
+		gtQuadMap[q.number] = q;
+	}
+
+	OnlineCalibration<Real, Accum> online;
+	ResetOnlineCalibration(online);
+	FrameSelection selection;
+	ResetFrameSelection(selection, Point2f(0, 0));
+	Matrix3f lastK = Matrix3f::Zero();
+	int stableFrames = 0;
+	Mat img;
+	while (true)
+	{
+		if (selection.frames.size() >= MAX_SELECTED_FRAMES)
+		{
+			cout << "That's " << MAX_SELECTED_FRAMES << " frames, which is as many as we use" << endl;
+			break;
+		}
+
+		const int frame = source.next;
+		if (!NextFrame(source, img))
+		{
+			break;
+		}
+
+		mt19937 rng(DETECTION_SEED + frame);
+		Calibration c;
+		if (!ProcessFrame(img, frame, board, gtQuads, rng, c, cout))
+		{
+			continue;
+		}
+
+		// Only take frames that show the calibration something new. A video has a lot of
+		// frames that are nearly the same as the one before. The first frame gives the image size
+		if (selection.frames.empty())
+		{
+			ResetFrameSelection(selection, c.size);
+		}
+		if (selection.frames.size() >= MIN_SELECTED_FRAMES && FrameInformationGain(selection, c) < SELECTION_MIN_GAIN)
+		{
+			cout << "Frame " << frame << " adds nothing new" << endl;
+			continue;
+		}
+
+		// Only frames the calibration keeps count as selected
+		bool kept = false;
+		const bool updated = AddFrameToOnlineCalibration(online, c, gtQuadMap, REFINEMENT_LOSS, pool, kept);
+		if (kept)
+		{
+			AddFrameToSelection(selection, c, online.estimates.size() - 1);
+		}
+		else
+		{
+			cout << "Frame " << frame << " was dropped from the calibration" << endl;
+		}
+		MatchSelectionToCalibration(online, selection);
+		if (!updated)
+		{
+			continue;
+		}
+
+		const Matrix3f& K = online.K;
+		cout << "K after frame " << frame << ": " << endl << K << endl;
+		cout << "Distortion: " << online.distortion.transpose() << endl;
+		stableFrames = ((K - lastK).norm() < ONLINE_STABLE_CHANGE * K.norm()) ? stableFrames + 1 : 0;
+		lastK = K;
+		if (stableFrames == ONLINE_STABLE_FRAMES)
+		{
+			cout << "K has been stable for " << ONLINE_STABLE_FRAMES << " frames. It's safe to stop capturing" << endl;
+		}
+	}
+
+	if (!online.calibrated)
+	{
+		cout << "Not enough frames worked for calibration to be viable" << endl;
+		return 1;
+	}
+	// Capture can end, from the cap or the end of the frames, before K settles
+	if (stableFrames < ONLINE_STABLE_FRAMES)
+	{
+		cout << "K hasn't been stable for " << ONLINE_STABLE_FRAMES << " frames, so it may not be accurate. "
+			 << "Capture more, with the board at other angles and in other parts of the image" << endl;
+	}
+	cout << "K: " << endl << online.K << endl;
+	cout << "Distortion: " << online.distortion.transpose() << endl;
+	return 0;
+}
+
+// What to pass on the command line, for when it is wrong
+void PrintUsage()
+{
+	cout << "Format: calibration.exe <FolderToImages> numImages [numThreads]" << endl;
+	cout << "    or: calibration.exe --watch <FolderToImages> [numThreads]" << endl;
+	cout << "    or: calibration.exe --video <FolderToBoard> <VideoFile> [numThreads]" << endl;
+	cout << "Images are expected to be named 1.jpg, 2.jpg, etc ... " << endl;
+	cout << "With --watch or --video, K is updated as each image or frame comes in" << endl;
+	cout << "The ground truth checkerboard is described in a file here named " << BOARD_FILENAME << endl;
+}
+
 /*
 	This tutorial is Zhang calibration. See README for details
 
 	Input:
 	- several frames of a full view of a checkerboard
-	- the checkerboard image itself
+	- a descriptor of the checkerboard, board.txt
 
 	Output: 
 	- the camera matrix and distortion parameters
@@ -55,86 +362,85 @@ using namespace Eigen;
 	  - not all get homography? Even when all quads are there?
 	    This is to do with corner linking. probably a bug here
 
-	  - Refinement jacobians are wrong
 	  - Initial estimate is wrong
 	  - corner linking is still buggy
 
 */
 int main(int argc, char** argv)
 {
-	if (argc < 3)
+	// Online, frames either come from a video, or turn up in a folder as they're captured
+	const string mode = argc > 1 ? argv[1] : "";
+	const bool watching = (mode == "--watch");
+	const bool video = (mode == "--video");
+	if (argc < 3 || (video && argc < 4))
 	{
 		cout << "Missing command line arguments!" << endl;
-		cout << "Format: calibration.exe <FolderToImages> numImages" << endl;
-		cout << "Images are expected to be named 1.jpg, 2.jpg, etc ... " << endl;
-		cout << "The ground truth checkerboard pattern is expected here and named " << CHECKERBOARD_FILENAME << endl;
+		PrintUsage();
 		exit(1);
 	}
 
 	// Take in the folder and the number of images
-	string folder = argv[1];
-	int numImages = stoi(argv[2]);
+	const bool online = watching || video;
+	string folder = online ? argv[2] : argv[1];
+	int numImages = online ? 0 : stoi(argv[2]);
+	// Optionally, how many threads to process images on. By default, one per core
+	const int threadsArg = video ? 4 : 3;
+	int numThreads = 0;
+	if (argc > threadsArg)
+	{
+		numThreads = stoi(argv[threadsArg]);
+	}
+	if (!online && numImages <= 0)
+	{
+		cout << "There has to be at least one image" << endl;
+		PrintUsage();
+		exit(1);
+	}
+	if (numThreads < 0)
+	{
+		cout << "The number of threads can't be negative" << endl;
+		PrintUsage();
+		exit(1);
+	}
 
 	/*******************************************/
 	/* Get data from ground truth checkerboard */
 
-	// Get ground truth checkerboard image
-	Mat checkerboard = imread(folder + "\\" + CHECKERBOARD_FILENAME, IMREAD_GRAYSCALE);
-
-	/*
-		Realistically, we should have a file that just details the precise points
-		in this image, as it should be computer-generated. But it was good test data so I just detect them. 
-	*/
-	vector<Quad> gtQuads;
-	cout << "Finding checkers in synthetic image" << endl;
-	if (!CheckerDetection(checkerboard, gtQuads, false))
+	// Read the board descriptor, and lay out the ground truth checkers from it.
+	// These are exact, so there is nothing to detect
+	BoardDescriptor board;
+	if (!ReadBoardDescriptor(folder + "\\" + BOARD_FILENAME, board))
 	{
-		checkerboard.release();
-		cout << "Could not detect checkers in synthetic image" << endl;
+		cout << "Could not read the board descriptor" << endl;
 		return 1;
 	}
+	vector<Quad> gtQuads;
+	GenerateBoardQuads(board, gtQuads);
+	cout << "Board has " << gtQuads.size() << " checkers" << endl;
 
-	// identity homography for gt quads to not transform them
-	cout << "Numbering synthetic checkers" << endl;
-	Matrix3f I;
-	I << 1, 0, 0,
-		 0, 1, 0,
-		 0, 0, 1;
-	// initial numbering
-	int topleft = 0;
-	int topright = 0;
-	int bottomleft = 0;
-	int bottomright = 0;
-	for (int i = 0; i < gtQuads.size(); ++i)
+	if (online)
 	{
-		const Quad& q = gtQuads[i];
-		// topleft
-		if ((float)q.centre.x < gtQuads[topleft].centre.x*0.9f || (float)q.centre.y < gtQuads[topleft].centre.y*0.9f)
+		ThreadPool pool(numThreads);
+		FrameSource source;
+		source.folder = folder;
+		source.watching = watching;
+		source.next = 1;
+		if (video && !source.video.open(argv[3]))
 		{
-			topleft = i;
+			cout << "Could not open video " << argv[3] << endl;
+			return 1;
 		}
-		// topright
-		if ((float)q.centre.x > gtQuads[topright].centre.x*1.1f || (float)q.centre.y < gtQuads[topright].centre.y*0.9f)
-		{
-			topright = i;
-		}
-		// bottom left
-		if ((float)q.centre.x < gtQuads[bottomleft].centre.x*0.9f || (float)q.centre.y > gtQuads[bottomleft].centre.y*1.1f)
-		{
-			bottomleft = i;
-		}
-		// bottom right
-		if ((float)q.centre.x > gtQuads[bottomright].centre.x*1.1f || (float)q.centre.y > gtQuads[bottomright].centre.y*1.1f)
+
+		switch (CALIBRATION_PRECISION)
 		{
-			bottomright = i;
+		case PRECISION_FLOAT:
+			return RunOnlineCalibration<float, float>(source, board, gtQuads, pool);
+		case PRECISION_MIXED:
+			return RunOnlineCalibration<float, double>(source, board, gtQuads, pool);
+		default:
+			return RunOnlineCalibration<double, double>(source, board, gtQuads, pool);
 		}
 	}
-	gtQuads[topleft].number = 1;
-	gtQuads[topright].number = 5;
-	gtQuads[bottomleft].number = 28;
-	gtQuads[bottomright].number = 32;
-	TransformAndNumberQuads(I, checkerboard, Point2f(checkerboard.cols, checkerboard.rows), gtQuads);
-
 
 	/*********************************/
 	/* Get data from captured images */
@@ -143,63 +449,34 @@ int main(int argc, char** argv)
 	// get an estimate of the calibration parameters and store these in a vector of calibration structures
 	// Each of these has a possible camera matrix and extrinsics
 	// By the end all these camera matrices should be the same
-	vector<Calibration> calibrationEstimates;
+	// Each image is independent of the others, so we run them all on a pool of threads.
+	// The futures are kept in image order, so the estimates come out in image order
+	// no matter which thread finishes first. Each task logs into its own stream,
+	// which we print as we collect the results, so the output doesn't interleave
+	ThreadPool pool(numThreads);
+	cout << "Processing " << numImages << " images on " << pool.Size() << " threads" << endl;
+	vector<future<bool> > results;
+	vector<Calibration> perImageEstimates(numImages);
+	vector<stringstream> logs(numImages);
 	for (int image = 0; image < numImages; ++image)
 	{
-		// Read in the image
-		Mat img = imread(folder + "\\" + to_string(image+1) + ".jpg", IMREAD_GRAYSCALE);
-		cout << "Reading image " << folder + "\\" + to_string(image + 1) + ".jpg" << endl;
-	
-		// Get the quads in the image
-		vector<Quad> quads;
-		cout << "Finding checkers in captured image" << endl;
-		int its = 0;
-		bool skip = false;
-		// We run this several times just in case, since there is some nondeterminism in the detection
-		while (!CheckerDetection(img, quads, false))
-		{
-			cout << "Bad image for checkers in image " << image + 1 << endl;
-			its++;
-			quads.clear();
-			if (its >= 5)
-			{
-				skip = true;
-				break;
-			}
-			
-		}
-		if (quads.empty() || skip)
-		{
-			cout << "No quads in image " << image + 1 << endl;
-			continue;
-		}
-		cout << "Found " << quads.size() << " quads" << endl;
+		results.push_back(pool.Enqueue([&, image]() {
+			mt19937 rng(DETECTION_SEED + image);
+			return ProcessImage(folder, image + 1, board, gtQuads, rng, perImageEstimates[image], logs[image]);
+		}));
+	}
 
-		// set up matches and create homography
-		cout << "Finding homography for captured checkers" << endl;
-		Matrix3f H;
-		if (!GetHomographyAndMatchQuads(H, img, checkerboard, gtQuads, quads))
+	vector<Calibration> calibrationEstimates;
+	for (int image = 0; image < numImages; ++image)
+	{
+		bool success = results[image].get();
+		cout << logs[image].str();
+		if (success)
 		{
-			cout << "Failed to find homography for image " << image + 1 << endl;
-			continue;
+			calibrationEstimates.push_back(perImageEstimates[image]);
 		}
-
-		// Should there be homography refinement here?
-		// Yes. Yes there should be. I just haven't added it yet
-
-		// Store
-		// Need to store all our homographies in non-normalised coords
-		// Multiply on the right by the normalisation
-		Calibration c;
-		c.H = H.inverse(); 
-		c.H /= c.H(2, 2);
-		c.quads = quads;
-		c.size = Point2f(img.cols, img.rows);
-		calibrationEstimates.push_back(c);
-
-		// free the memory
- 		img.release();
 	}
+	perImageEstimates.clear();
 
 	// We need a minimum number of estimates for this to work
 	if (calibrationEstimates.size() < 3)
@@ -211,46 +488,32 @@ int main(int argc, char** argv)
 	/************************/
 	/* Compute calibration */
 	Matrix3f K;
-	if (ComputeCalibration(calibrationEstimates, K))
+	if (ComputeCalibration(calibrationEstimates, K, CALIBRATION_PRECISION))
 	{
 		cout << "Initial K: " << endl << K << endl;
 
+		// Zhang is cheap enough to take every frame, but refinement only needs the ones that
+		// show it something new. Keep them in image order
+		vector<int> selected;
+		SelectFrames(calibrationEstimates, MAX_SELECTED_FRAMES, selected);
+		sort(selected.begin(), selected.end());
+		vector<Calibration> selectedEstimates;
+		for (const int n : selected)
+		{
+			selectedEstimates.push_back(calibrationEstimates[n]);
+		}
+		calibrationEstimates.swap(selectedEstimates);
+
 		for (auto& c : calibrationEstimates)
 		{
 			c.K = K;
+			c.distortion.setZero();
 
 			// Compute the SE3 pose too
-			// We only need the first two vectors
-			auto lambda = 1.f / (K.inverse() * Vector3f(c.H(0, 0), c.H(1, 0), c.H(2, 0))).norm();
-			auto r1 = lambda * K.inverse() * Vector3f(c.H(0,0), c.H(1,0), c.H(2,0));
-			c.r[0] = r1;
-			auto r2 = lambda * K.inverse() * Vector3f(c.H(0, 1), c.H(1, 1), c.H(2, 1));
-			c.r[1] = r2;
-			c.r[2] = c.r[0].cross(c.r[1]);
-			auto t = lambda * K.inverse() * Vector3f(c.H(0, 2), c.H(1, 2), c.H(2, 2));
-			c.t = t;
-
-			c.R << c.r[0][0], c.r[1][0], c.r[2][0],
-				c.r[0][1], c.r[1][1], c.r[2][1],
-				c.r[0][2], c.r[1][2], c.r[2][2];
-
-			// The following computation comes from Zhang, Appendix C
-			
-			// We need to compute the singular value decomposition of Q
-			// where Q is the approximation to the true R. That is to say, Q = c.R 
-			// at this point
-			// Let SVD(Q) = USV^T
-			// Then R = UV^T is the best rotation matrix that approximates Q
-			// We then put this into c.R
-			BDCSVD<MatrixXf> svd(c.R, ComputeFullU | ComputeFullV);
-			if (!svd.computeV())
-				return -1;
-			auto& V = svd.matrixV();
-			if (!svd.computeU())
+			if (!PoseFromHomography(K, c))
+			{
 				return -1;
-			auto& U = svd.matrixU();
-
-			c.R = U * V.transpose();
+			}
 		}
 	} 
 	else
@@ -266,8 +529,8 @@ int main(int argc, char** argv)
 		gtQuadMap[q.number] = q;
 	}
 
-	// We have an initial estimate. Now do refinement on this
-	if (!RefineCalibration(calibrationEstimates, gtQuadMap))
+	// We have an initial estimate. Now do refinement on this, dropping any frames that turn out to be outliers
+	if (!RefineCalibrationRejectingFrames(calibrationEstimates, gtQuadMap, REFINEMENT_LOSS, CALIBRATION_PRECISION, pool))
 	{
 		cout << "Failed to refine our calibration" << endl;
 		return false;
@@ -276,6 +539,5 @@ int main(int argc, char** argv)
 	// All the estimates should have the new parameters now
 	cout << "K: " << endl << calibrationEstimates[0].K << endl;
 
-	checkerboard.release();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+// Hypotheses are scored this many data at a time, checking between blocks whether they can still win
+#define RANSAC_SCORE_BLOCK 16
+
+/*
+	RANSAC, for any model with a minimal solver
+
+	A problem plugs in by providing
+	    typedef ... Model;
+	    static const int SampleSize;                        - how many data the minimal solver needs
+	    int NumData() const;
+	    bool Fit(const int* sample, Model& model) const;    - the minimal solver, false if the sample is degenerate
+	    bool IsInlier(const Model& model, int i) const;
+	    int CountInliers(const Model& model, int begin, int end) const;
+	The problem owns its data and its inlier threshold. CountInliers is there so that a problem
+	can score a block of data with a batch kernel, rather than one at a time.
+
+	There are two ways to stop. With minInliers set, we take the first model that has at least that
+	many inliers. Otherwise we keep the model with the most inliers.
+
+	The number of hypotheses adapts to the data. If m of the n data are inliers, a random sample
+	of s is all inliers with probability p = m(m-1)...(m-s+1) / n(n-1)...(n-s+1), and after k
+	samples we're 1 - (1-p)^k sure one of them was. So k = log(1 - confidence) / log(1 - p).
+	When looking for the best model, m is the best inlier count so far, and k shrinks every time
+	that improves. When we want the first good enough model, m is minInliers.
+
+	Two things cut the cost of each hypothesis:
+	- The T(d,d) test (Chum and Matas, Randomized RANSAC with T(d,d) test). Before scoring all
+	  the data, check d random ones, and throw the model away unless they're all inliers. Bad
+	  models almost always fail this straight away, and a good one passes with probability
+	  (m/n)^d, which the iteration count allows for. preTestSize is d, and 0 turns it off.
+	- Scoring gives up as soon as the data left can't lift the count to what it needs.
+
+	Inliers come back as indices into the data, so nothing is copied.
+	The caller owns the RNG, so concurrent tasks should each bring their own
+*/
+struct RansacParams
+{
+	float confidence;
+	int maxIterations;
+	int minInliers;
+	int preTestSize;
+};
+
+// Chance that a random sample, and the points for the T(d,d) test, are all inliers
+inline double RansacSampleSuccess(const int numData, const int numInliers, const int sampleSize, const int preTestSize)
+{
+	double p = 1;
+	for (int j = 0; j < sampleSize; ++j)
+	{
+		p *= (double)std::max(numInliers - j, 0) / (numData - j);
+	}
+	for (int j = 0; j < preTestSize; ++j)
+	{
+		p *= (double)numInliers / numData;
+	}
+	return p;
+}
+
+// How many samples we need to be confident of drawing one good one
+inline int RansacIterations(const double sampleSuccess, const float confidence, const int maxIts)
+{
+	if (sampleSuccess >= 1)
+	{
+		return 1;
+	}
+	if (sampleSuccess <= 0)
+	{
+		return maxIts;
+	}
+	const double its = std::ceil(std::log(1.0 - confidence) / std::log(1.0 - sampleSuccess));
+	return (int)std::min(its, (double)maxIts);
+}
+
+// Returns the number of inliers of the model found, 0 if there wasn't one
+template <typename Problem>
+int Ransac(const Problem& problem, const RansacParams& params, std::mt19937& rng,
+	       typename Problem::Model& bestModel, std::vector<int>& inliers)
+{
+	const int n = problem.NumData();
+	const int s = Problem::SampleSize;
+	inliers.clear();
+	if (n < s || n < params.minInliers)
+	{
+		return 0;
+	}
+
+	std::uniform_int_distribution<int> index(0, n - 1);
+	int its = RansacIterations(RansacSampleSuccess(n, std::max(params.minInliers, s), s, params.preTestSize),
+		                       params.confidence, params.maxIterations);
+	int bestCount = 0;
+	int sample[Problem::SampleSize];
+	typename Problem::Model model;
+	for (int k = 0; k < its; ++k)
+	{
+		// Draw s distinct indices
+		for (int j = 0; j < s; ++j)
+		{
+			bool repeated = true;
+			while (repeated)
+			{
+				sample[j] = index(rng);
+				repeated = false;
+				for (int l = 0; l < j; ++l)
+				{
+					repeated |= (sample[l] == sample[j]);
+				}
+			}
+		}
+		if (!problem.Fit(sample, model))
+		{
+			continue;
+		}
+
+		// T(d,d) test
+		bool passed = true;
+		for (int j = 0; j < params.preTestSize && passed; ++j)
+		{
+			passed = problem.IsInlier(model, index(rng));
+		}
+		if (!passed)
+		{
+			continue;
+		}
+
+		// Score, until there aren't enough data left to reach the target
+		const int target = std::max(bestCount + 1, params.minInliers);
+		int count = 0;
+		for (int begin = 0; begin < n && count + (n - begin) >= target; begin += RANSAC_SCORE_BLOCK)
+		{
+			count += problem.CountInliers(model, begin, std::min(begin + RANSAC_SCORE_BLOCK, n));
+		}
+		if (count < target)
+		{
+			continue;
+		}
+
+		bestCount = count;
+		bestModel = model;
+		if (params.minInliers > 0)
+		{
+			// Good enough
+			break;
+		}
+		its = std::min(its, RansacIterations(RansacSampleSuccess(n, bestCount, s, params.preTestSize),
+			                                 params.confidence, params.maxIterations));
+	}
+
+	if (bestCount == 0)
+	{
+		return 0;
+	}
+	for (int i = 0; i < n; ++i)
+	{
+		if (problem.IsInlier(bestModel, i))
+		{
+			inliers.push_back(i);
+		}
+	}
+	return (int)inliers.size();
+}
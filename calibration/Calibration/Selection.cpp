@@ -0,0 +1,173 @@
+#include "Selection.h"
+#include <iostream>
+#include <queue>
+#include <cmath>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+using namespace Eigen;
+
+/*
+	Frame selection
+
+	A frame's information is what it adds to the frames already chosen, in two ways:
+	- Coverage. The distortion is worst towards the edges of the image, and is only pinned down
+	  where there are checkers. So the image is cut into a grid, and a frame scores for the cells
+	  its checkers' corners land in that no chosen frame's do.
+	- Pose. Zhang, and the focal lengths in refinement, need the board seen at different angles.
+	  Boards that are all parallel to each other don't constrain K at all. So a frame scores for
+	  how far its board is turned from the board in the nearest chosen frame, up to
+	  SELECTION_NEW_VIEW_ANGLE, which counts as completely new.
+	The gain is the average of the two, so it runs from 0 to 1.
+
+	The board normal is r1 x r2, and H = K [r1 r2 t] up to scale, so it comes from the first two
+	columns of K^-1 H. We don't have K yet, so we use a rough one from the image size, with the
+	focal length the longer side of the image. That's plenty to tell views apart. H only fixes
+	the normal up to sign, so we compare normals by the absolute value of their dot product.
+
+	Both parts of the gain can only go down as more frames are chosen. So choosing greedily, a
+	frame's last computed gain is an upper bound on its gain now, and we only recompute the gain
+	of the frame at the top of the queue. If it's still at the top, it's the best frame, without
+	rescoring all the others (Minoux, Accelerated greedy algorithms for maximizing submodular set
+	functions)
+*/
+// Helpers
+Vector3f BoardNormal(const Calibration& c)
+{
+	const float focal = max(c.size.x, c.size.y);
+	Matrix3f K;
+	K << focal, 0, c.size.x / 2,
+		 0, focal, c.size.y / 2,
+		 0, 0, 1;
+	const Matrix3f KinvH = K.inverse() * c.H;
+	const Vector3f r1 = KinvH.col(0).normalized();
+	const Vector3f r2 = KinvH.col(1).normalized();
+	return r1.cross(r2).normalized();
+}
+
+// The coverage grid cell a point lands in, or -1 if it's off the image
+int CoverageCell(const FrameSelection& selection, const Point2f& p)
+{
+	if (selection.imageSize.x <= 0 || selection.imageSize.y <= 0)
+	{
+		return -1;
+	}
+	const int x = (int)floor(p.x / selection.imageSize.x * SELECTION_GRID_SIZE);
+	const int y = (int)floor(p.y / selection.imageSize.y * SELECTION_GRID_SIZE);
+	if (x < 0 || x >= SELECTION_GRID_SIZE || y < 0 || y >= SELECTION_GRID_SIZE)
+	{
+		return -1;
+	}
+	return y * SELECTION_GRID_SIZE + x;
+}
+
+// Actual functions
+void ResetFrameSelection(FrameSelection& selection, const cv::Point2f& imageSize)
+{
+	selection.imageSize = imageSize;
+	selection.frames.clear();
+	selection.normals.clear();
+	selection.covered.assign(SELECTION_GRID_SIZE * SELECTION_GRID_SIZE, 0);
+	selection.numCovered = 0;
+}
+
+float FrameInformationGain(const FrameSelection& selection, const Calibration& c)
+{
+	// New cells. A frame's checkers can land in the same cell many times, so mark them off as we go
+	uchar newCells[SELECTION_GRID_SIZE * SELECTION_GRID_SIZE] = { 0 };
+	int numNewCells = 0;
+	for (const Quad& q : c.quads)
+	{
+		if (q.number <= 0)
+		{
+			continue;
+		}
+		for (int k = 0; k < 4; ++k)
+		{
+			const int cell = CoverageCell(selection, q.points[k]);
+			if (cell >= 0 && !selection.covered[cell] && !newCells[cell])
+			{
+				newCells[cell] = 1;
+				numNewCells++;
+			}
+		}
+	}
+	const float coverageGain = (float)numNewCells / (SELECTION_GRID_SIZE * SELECTION_GRID_SIZE);
+
+	// Angle to the nearest view. With nothing chosen yet, any view is new
+	const Vector3f normal = BoardNormal(c);
+	float minAngle = SELECTION_NEW_VIEW_ANGLE;
+	for (const Vector3f& n : selection.normals)
+	{
+		const float cosAngle = min(abs(normal.dot(n)), 1.f);
+		minAngle = min(minAngle, acos(cosAngle));
+	}
+	const float poseGain = minAngle / SELECTION_NEW_VIEW_ANGLE;
+
+	return (coverageGain + poseGain) / 2;
+}
+
+void AddFrameToSelection(FrameSelection& selection, const Calibration& c, const int frame)
+{
+	selection.frames.push_back(frame);
+	selection.normals.push_back(BoardNormal(c));
+	for (const Quad& q : c.quads)
+	{
+		if (q.number <= 0)
+		{
+			continue;
+		}
+		for (int k = 0; k < 4; ++k)
+		{
+			const int cell = CoverageCell(selection, q.points[k]);
+			if (cell >= 0 && !selection.covered[cell])
+			{
+				selection.covered[cell] = 1;
+				selection.numCovered++;
+			}
+		}
+	}
+}
+
+void SelectFrames(const std::vector<Calibration>& candidates, const int maxFrames, std::vector<int>& selected)
+{
+	selected.clear();
+	if (candidates.empty())
+	{
+		return;
+	}
+
+	FrameSelection selection;
+	ResetFrameSelection(selection, candidates[0].size);
+
+	// Every frame's gain against nothing chosen, which is as high as it will ever be
+	priority_queue<pair<float, int> > gains;
+	for (int n = 0; n < candidates.size(); ++n)
+	{
+		gains.push(make_pair(FrameInformationGain(selection, candidates[n]), n));
+	}
+
+	while (!gains.empty() && selection.frames.size() < maxFrames)
+	{
+		const int n = gains.top().second;
+		gains.pop();
+		const float gain = FrameInformationGain(selection, candidates[n]);
+		if (!gains.empty() && gain < gains.top().first)
+		{
+			// Something else might be better now. Put this back with its new gain
+			gains.push(make_pair(gain, n));
+			continue;
+		}
+		if (gain < SELECTION_MIN_GAIN && selection.frames.size() >= MIN_SELECTED_FRAMES)
+		{
+			// This is the best there is, so everything left is redundant
+			break;
+		}
+		AddFrameToSelection(selection, candidates[n], n);
+	}
+
+	selected = selection.frames;
+	cout << "Selected " << selected.size() << " of " << candidates.size() << " frames, covering "
+		 << selection.numCovered << " of " << SELECTION_GRID_SIZE * SELECTION_GRID_SIZE << " cells of the image" << endl;
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <Eigen/Dense>
+#include <vector>
+#include "Calibration.h"
+
+// Coverage of the image is counted on a grid of this many cells each way
+#define SELECTION_GRID_SIZE 8
+// A board turned this far, in radians, from the board in every frame already chosen is a completely new view
+#define SELECTION_NEW_VIEW_ANGLE 0.6f
+// Frames that add less than this are redundant. Gains run from 0 to 1
+#define SELECTION_MIN_GAIN 0.05f
+// The most frames that go into refinement
+#define MAX_SELECTED_FRAMES 20
+// Zhang needs three views, so we always keep that many if we have them, however alike they are
+#define MIN_SELECTED_FRAMES 3
+
+/*
+	Frame selection. Refinement costs the same for every frame, but a frame only helps if it shows
+	the board somewhere new in the image, or turned a new way. So we choose the frames that do,
+	and leave out the rest, up to a cap on how many we keep.
+*/
+struct FrameSelection
+{
+	cv::Point2f imageSize;
+	// The chosen frames, and the normal of the board in each, in the camera
+	std::vector<int> frames;
+	std::vector<Eigen::Vector3f> normals;
+	// Which cells of the coverage grid the chosen frames' checkers land in
+	std::vector<uchar> covered;
+	int numCovered;
+};
+
+void ResetFrameSelection(FrameSelection& selection, const cv::Point2f& imageSize);
+
+// How much a frame would add to a selection, from 0 for nothing new to 1
+float FrameInformationGain(const FrameSelection& selection, const Calibration& c);
+
+void AddFrameToSelection(FrameSelection& selection, const Calibration& c, const int frame);
+
+// Choose up to maxFrames of the candidates, most informative first, and leave out any that are
+// redundant. The indices come back in the order the frames were chosen
+void SelectFrames(const std::vector<Calibration>& candidates, const int maxFrames, std::vector<int>& selected);
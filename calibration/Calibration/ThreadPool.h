@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+/*
+	A small fixed-size pool of worker threads.
+
+	Tasks are queued with Enqueue, which hands back a future for the task's result.
+	The futures are how callers get their results back in a deterministic order -
+	keep them in a vector in the order the tasks were submitted, and read them back
+	in that order, no matter which thread finished first.
+
+	The pool joins all its threads on destruction, after the queue has drained.
+*/
+class ThreadPool
+{
+public:
+	// A numThreads of 0 means use however many cores the machine has
+	explicit ThreadPool(unsigned int numThreads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Queue a task, and get a future for its result
+	template <typename F>
+	std::future<typename std::result_of<F()>::type> Enqueue(F task);
+
+	unsigned int Size() const { return (unsigned int)workers.size(); }
+
+private:
+	void Work();
+
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()> > tasks;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stopping;
+};
+
+inline ThreadPool::ThreadPool(unsigned int numThreads) : stopping(false)
+{
+	if (numThreads == 0)
+	{
+		numThreads = std::thread::hardware_concurrency();
+	}
+	// hardware_concurrency is allowed to return 0 if it can't tell
+	if (numThreads == 0)
+	{
+		numThreads = 1;
+	}
+
+	for (unsigned int i = 0; i < numThreads; ++i)
+	{
+		workers.emplace_back(&ThreadPool::Work, this);
+	}
+}
+
+inline ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueCondition.notify_all();
+	for (auto& t : workers)
+	{
+		t.join();
+	}
+}
+
+template <typename F>
+std::future<typename std::result_of<F()>::type> ThreadPool::Enqueue(F task)
+{
+	typedef typename std::result_of<F()>::type Result;
+
+	// packaged_task is move-only, and std::function needs to be copyable,
+	// so hold it by shared pointer
+	auto packaged = std::make_shared<std::packaged_task<Result()> >(std::move(task));
+	std::future<Result> result = packaged->get_future();
+	{
+		std::unique_lock<std::mutex> lock(queueMutex);
+		tasks.push([packaged]() { (*packaged)(); });
+	}
+	queueCondition.notify_one();
+	return result;
+}
+
+inline void ThreadPool::Work()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueCondition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (stopping && tasks.empty())
+			{
+				return;
+			}
+			task = std::move(tasks.front());
+			tasks.pop();
+		}
+		task();
+	}
+}